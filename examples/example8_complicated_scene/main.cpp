@@ -81,12 +81,7 @@ int main(int argc, char* args[])
 		auto numTriangles = renderer->renderAllDrawableMeshes();
 
 		//Display to screen
-		double deltaTime = winApp->updateScreenSurface(
-			renderer->commitRenderedColorBuffer(),
-			width, 
-			height,
-			3,//RGB
-			numTriangles);
+		double deltaTime = winApp->updateScreenSurface(renderer, numTriangles);
 
 		//Camera operation
 		{
@@ -8,6 +8,7 @@
 #include "glm/glm.hpp"
 
 #include "TRShadingState.h"
+#include "TRMathUtils.h"
 
 namespace TinyRenderer
 {
@@ -39,8 +40,9 @@ namespace TinyRenderer
 		TRDrawableSubMesh(const TRDrawableSubMesh& mesh);
 		TRDrawableSubMesh& operator=(const TRDrawableSubMesh& mesh);
 
-		void setVertices(const std::vector<TRVertex> &vertices) { m_vertices = vertices; }
-		void setIndices(const std::vector<unsigned int> &indices) { m_indices = indices; }
+		//Note: the bounding volumes are invalidated once the geometry is changed
+		void setVertices(const std::vector<TRVertex> &vertices) { m_vertices = vertices; m_bounding = BoundingVolumes(); }
+		void setIndices(const std::vector<unsigned int> &indices) { m_indices = indices; m_bounding = BoundingVolumes(); }
 
 		void setDiffuseMapTexId(const int &id) { m_drawing_material.diffuseMapTexId = id; }
 		void setSpecularMapTexId(const int &id) { m_drawing_material.specularMapTexId = id; }
@@ -57,12 +59,28 @@ namespace TinyRenderer
 		const std::vector<TRVertex>& getVertices() const { return m_vertices; }
 		const std::vector<unsigned int>& getIndices() const { return m_indices; }
 
+		//Bounding volumes in the model space, of the whole submesh and of each batch of faces
+		//Note: empty volumes (not computed yet) are never culled
+		static constexpr int FACE_BATCH_SIZE = 512;
+		void computeBoundingVolumes();
+		const TRBoundingBox& getBoundingBox() const { return m_bounding.box; }
+		const TRBoundingSphere& getBoundingSphere() const { return m_bounding.sphere; }
+		const std::vector<TRBoundingBox>& getFaceBatchBoundingBoxes() const { return m_bounding.faceBatchBoxes; }
+
 		void clear();
 
 	protected:
 		TRVertexBuffer m_vertices;
 		TRIndexBuffer  m_indices;
 
+		struct BoundingVolumes
+		{
+			TRBoundingBox box;
+			TRBoundingSphere sphere;
+			std::vector<TRBoundingBox> faceBatchBoxes;//Faces [i * FACE_BATCH_SIZE, (i + 1) * FACE_BATCH_SIZE)
+		};
+		BoundingVolumes m_bounding;
+
 		struct DrawableMaterialTex
 		{
 			int diffuseMapTexId = -1;
@@ -88,7 +106,7 @@ namespace TinyRenderer
 		void setDepthtestMode(TRDepthTestMode mode) { m_drawing_config.depthtestMode = mode; }
 		void setDepthwriteMode(TRDepthWriteMode mode) { m_drawing_config.depthwriteMode = mode; }
 		void setAlphablendMode(TRAlphaBlendingMode mode) { m_drawing_config.alphaBlendMode = mode; }
-		void setModelMatrix(const glm::mat4& mat) { m_drawing_config.modelMatrix = mat; }
+		void setModelMatrix(const glm::mat4& mat) { m_drawing_config.modelMatrix = mat; ++m_model_matrix_stamp; }
 		void setLightingMode(TRLightingMode mode) { m_drawing_config.lightingMode = mode; }
 
 		//Setting
@@ -113,10 +131,13 @@ namespace TinyRenderer
 		TRDepthWriteMode getDepthwriteMode() const { return m_drawing_config.depthwriteMode; }
 		TRAlphaBlendingMode getAlphablendMode() const { return m_drawing_config.alphaBlendMode; }
 		const glm::mat4& getModelMatrix() const { return m_drawing_config.modelMatrix; }
+		//Note: increased by each setModelMatrix(), so that the moved meshes are detected without comparing the matrices
+		unsigned int getModelMatrixStamp() const { return m_model_matrix_stamp; }
 		TRLightingMode getLightingMode() const { return m_drawing_config.lightingMode; }
 
 		unsigned int getDrawableMaxFaceNums() const;
 		TRDrawableBuffer& getDrawableSubMeshes() { return m_drawables; }
+		const TRDrawableBuffer& getDrawableSubMeshes() const { return m_drawables; }
 
 	protected:
 		void importMeshFromFile(const std::string &path, bool generatedMipmap = true);
@@ -135,6 +156,7 @@ namespace TinyRenderer
 			glm::mat4 modelMatrix = glm::mat4(1.0f);
 		};
 		DrawableConfig m_drawing_config;
+		unsigned int m_model_matrix_stamp = 0;
 
 		//Material
 		struct DrawableMaterialCof
@@ -3,23 +3,62 @@
 
 #include <vector>
 #include <memory>
+#include <atomic>
+#include <type_traits>
 
 #include "glm/glm.hpp"
 #include "TRPixelSampler.h"
+#include "TRShadingState.h"
 
 namespace TinyRenderer
 {
 	using uint = unsigned int;
 
+	//G-buffer texel: the material of a pixel for deferred shading
+	struct TRGBufferTexel
+	{
+		glm::vec3 pos;		//World space position
+		glm::vec3 normal;	//World space normal (normalized)
+		glm::vec3 ambient;	//Ambient reflectance
+		glm::vec3 diffuse;	//Diffuse reflectance
+		glm::vec3 specular;	//Specular reflectance
+		glm::vec3 emission;	//Emission (glow) color
+		float shininess;
+		float alpha;
+		bool lighting;		//Lighting enable or not
+	};
+
+	//Destination of the MSAA resolve: a caller-provided image, e.g. the pixels of a SDL surface
+	struct TRPresentTarget
+	{
+		void *pixels = nullptr;
+		size_t pitch = 0;			//Bytes per row
+		TRPresentFormat format = TRPresentFormat::TR_PRESENT_RGB8;
+		bool toneMapping = false;	//Exposure tone mapping: 1 - exp(-color * exposure)
+		float exposure = 1.0f;
+		bool gammaCorrection = false;	//Gamma encoding: pow(color, 1 / 2.2)
+	};
+
 	class TRFrameBuffer final
 	{
 	public:
 		typedef std::shared_ptr<TRFrameBuffer> ptr;
 
+		//Block size of the coarse depth buffer (hierarchical z)
+		//Note: the fast clear flags are kept for the same blocks
+		static constexpr int COARSE_DEPTH_BLOCK_SIZE = 8;
+
 		// ctor/dtor.
-		TRFrameBuffer(int width, int height);
+		//Note: samplingNum is the number of MSAA sampling points per pixel: 1, 2, 4 or 8
+		TRFrameBuffer(int width, int height, int samplingNum = 4,
+			TRFrameBufferLayout layout = TRFrameBufferLayout::TR_LAYOUT_INTERLEAVED,
+			TRPixelAddressMode addressMode = TRPixelAddressMode::TR_ADDRESS_LINEAR,
+			TRColorFormat colorFormat = TRColorFormat::TR_COLOR_RGBA8,
+			TRDepthFormat depthFormat = TRDepthFormat::TR_DEPTH_FLOAT32);
 		~TRFrameBuffer() = default;
 
+		//Fast clears: only the blocks are flagged as cleared, a block is filled with
+		//the clear value lazily by the first write to it.
 		void clearDepth(const float &depth);
 		void clearColor(const glm::vec4 &color);
 		void clearColorAndDepth(const glm::vec4 &color, const float &depth);
@@ -27,26 +66,201 @@ namespace TinyRenderer
 		// Getter.
 		int getWidth() const { return m_width; }
 		int getHeight() const { return m_height; }
-		const TRDepthBuffer &getDepthBuffer() const { return m_depthBuffer; }
-		const TRColorBuffer &getColorBuffer() const { return m_colorBuffer; }
+		int getSamplingNum() const { return m_samplingNum; }
+		TRFrameBufferLayout getLayout() const { return m_layout; }
+		TRPixelAddressMode getAddressMode() const { return m_addressMode; }
+		TRColorFormat getColorFormat() const { return m_colorFormat; }
+		bool isHDR() const { return m_colorFormat != TRColorFormat::TR_COLOR_RGBA8; }
+		TRDepthFormat getDepthFormat() const { return m_depthFormat; }
 
+		//Address of the pixel (x,y), and of its sampling point s in the depth and color buffers
+		//Note: the address mapping is separable for all the modes, i.e. index = f(x) + g(y)
+		size_t getPixelIndex(const uint &x, const uint &y) const { return m_addressX[x] + m_addressY[y]; }
+		size_t getSampleIndex(const size_t &pixel, const uint &s) const { return pixel * m_pixelStride + s * m_sampleStride; }
+
+		//Depth range of the unorm depth formats
+		void setDepthRange(const float &near, const float &far);
+
+		//Note: the unorm depth is converted back to 1/w
 		float readDepth(const uint &x, const uint &y, const uint &i) const;
+		//Note: the HDR colors are clamped to [0,1] without tone mapping
 		TRPixelRGBA readColor(const uint &x, const uint &y, const uint &i) const;
 
 		void writeDepth(const uint &x, const uint &y, const uint &i, const float &value);
 		void writeColor(const uint &x, const uint &y, const uint &i, const glm::vec4 &color);
-		void writeColorWithMask(const uint &x, const uint &y, const glm::vec4 &color, const TRMaskPixelSampler &mask);
-		void writeColorWithMaskAlphaBlending(const uint &x, const uint &y, const glm::vec4 &color, const TRMaskPixelSampler &mask);
-		void writeDepthWithMask(const uint &x, const uint &y, const TRDepthPixelSampler &depth, const TRMaskPixelSampler &mask);
 
-		//MSAA resolve
-		const TRColorBuffer &resolve();
+		//Note: N must be equal to getSamplingNum(), the caller dispatches it once for the whole kernel
+		//      A fully covered pixel is stored compressed (only its first sampling point), and
+		//      it's expanded to all the sampling points once it gets partially covered (on edges).
+		template<int N>
+		void writeColorWithMask(const uint &x, const uint &y, const glm::vec4 &color, const TRMaskPixelSampler<N> &mask);
+		template<int N>
+		void writeColorWithMaskAlphaBlending(const uint &x, const uint &y, const glm::vec4 &color, const TRMaskPixelSampler<N> &mask);
+		//Note: Format must be equal to getDepthFormat(), dispatched by the caller as well
+		template<int N, TRDepthFormat Format>
+		void writeDepthWithMask(const uint &x, const uint &y, const TRDepthPixelSampler<N> &depth, const TRMaskPixelSampler<N> &mask);
+
+		//Depth testing: clear the mask of the sampling points which fail the test
+		//Note: the depth is converted to the format of the attachment before comparing (reversed z)
+		template<int N, TRDepthFormat Format>
+		void depthTestWithMask(const uint &x, const uint &y, const TRDepthPixelSampler<N> &depth,
+			const TRDepthCompareMode &mode, TRMaskPixelSampler<N> &mask) const;
+
+		//Coarse depth buffer: the farthest depth (minimum in reversed z) of each block
+		//Note: it is conservative as long as the depth values only get closer, and should
+		//      be refreshed by updateCoarseDepth() once the depth writing is done.
+		float readCoarseDepth(const uint &bx, const uint &by) const { return m_coarseDepthBuffer[by * m_coarseWidth + bx]; }
+		void updateCoarseDepth();
+
+		//G-buffer for deferred shading
+		//Note: a pixel is pending if its color samples are still to be lit from the G-buffer texel.
+		//      Only those fragments that fully cover a pixel are deferred, so one texel per pixel is enough.
+		void createGBuffer();
+		bool hasGBuffer() const { return !m_gBuffer.empty(); }
+		bool isGBufferPending(const uint &x, const uint &y) const { return m_gBufferPending[y * m_width + x] != 0; }
+		const TRGBufferTexel &readGBuffer(const uint &x, const uint &y) const { return m_gBuffer[y * m_width + x]; }
+		void writeGBuffer(const uint &x, const uint &y, const TRGBufferTexel &texel);
+		void discardGBuffer(const uint &x, const uint &y) { m_gBufferPending[y * m_width + x] = 0; }
+		//Whether any pixel has been deferred since the last lighting, markGBufferLit() once they're all lit
+		bool hasPendingGBuffer() const { return m_gBufferAnyPending.load(std::memory_order_relaxed); }
+		void markGBufferLit() { m_gBufferAnyPending.store(false, std::memory_order_relaxed); }
+
+		//MSAA color compression: all the sampling points of the pixel share one color
+		bool isColorCompressed(const uint &x, const uint &y) const { return m_colorCompressed[getPixelIndex(x, y)] != 0; }
+
+		//MSAA resolve into a single-sample RGB image (row by row, width * height * 3 bytes)
+		//Note: only the uncompressed pixels (on the edges) are averaged, the framebuffer is left untouched
+		void resolve(std::vector<unsigned char> &image) const;
+		//Fused MSAA resolve, tone mapping, gamma encoding and format conversion into the target
+		//Note: the HDR colors are averaged and tone mapped in floating point
+		void resolve(const TRPresentTarget &target) const;
 
 	private:
 	
 		TRDepthBuffer m_depthBuffer;           // Z-buffer
+		TRDepthBufferD24 m_depthBufferD24;					// Z-buffer (TR_DEPTH_UNORM24)
+		TRDepthBufferD16 m_depthBufferD16;					// Z-buffer (TR_DEPTH_UNORM16)
 		TRColorBuffer m_colorBuffer;		   // Color buffer
+		TRColorBufferRGBA16F m_colorBufferRGBA16F;			// HDR color buffer (TR_COLOR_RGBA16F)
+		TRColorBufferR11G11B10F m_colorBufferR11G11B10F;	// HDR color buffer (TR_COLOR_R11G11B10F)
 		unsigned int m_width, m_height;
+		unsigned int m_samplingNum;			   // MSAA sampling points per pixel
+		TRFrameBufferLayout m_layout;
+		TRPixelAddressMode m_addressMode;
+		TRColorFormat m_colorFormat;
+		TRDepthFormat m_depthFormat;
+		float m_depthOffset = 0.0f, m_depthScale = 1.0f;	// Unorm depth: (1/w - m_depthOffset) * m_depthScale
+		std::vector<uint> m_addressX, m_addressY;  // Separable pixel address mapping
+		size_t m_numPixels;					   // Including the padding of the tiles
+		size_t m_pixelStride, m_sampleStride;  // Sampling point s of pixel p -> p * m_pixelStride + s * m_sampleStride
+
+		//Deferred shading
+		std::vector<TRGBufferTexel> m_gBuffer;				// Per-pixel material
+		std::vector<unsigned char> m_gBufferPending;		// Per-pixel flag: waiting for lighting
+		std::atomic<bool> m_gBufferAnyPending{ false };		// Any pixel is pending (written by the fragment threads)
+
+		//MSAA color compression
+		std::vector<unsigned char> m_colorCompressed;		// Per-pixel flag: only the first sampling point is valid
+
+		//Fast clears
+		enum BlockClearState { BLOCK_MATERIALIZED = 0, BLOCK_CLEARED, BLOCK_MATERIALIZING };
+		using BlockClearStates = std::unique_ptr<std::atomic<unsigned char>[]>;
+		BlockClearStates m_depthClearStates;				// Per-block state of the depth buffer
+		BlockClearStates m_colorClearStates;				// Per-block state of the color buffer
+		float m_clearDepth = 1.0f;
+		TRPixelRGBA m_clearColor = trBlack;
+		glm::vec4 m_clearColorValue = glm::vec4(0.0f);
+
+		//Hierarchical z
+		std::vector<float> m_coarseDepthBuffer;				// Per-block farthest depth
+		std::unique_ptr<std::atomic<unsigned char>[]> m_coarseDepthDirty; // Per-block flag: depth was written (by any fragment thread)
+		unsigned int m_coarseWidth, m_coarseHeight;
+
+		template<typename Buffer>
+		void updateCoarseDepth(const Buffer &buffer);
+		template<int N, typename Buffer>
+		void updateCoarseDepth_aux(const Buffer &buffer);
+		template<int N>
+		void resolve_aux(const TRPresentTarget &target, const unsigned char *encode, const float *encodef) const;
+		template<int N>
+		void resolveRow(const uint &y, const uint &bx, const uint &ex, TRPixelRGBA *row) const;
+		template<int N>
+		void resolveRowPlanes(const uint &y, const uint &bx, const uint &ex, TRPixelRGBA *row) const;
+		template<typename Buffer>
+		void resolveHDR(const Buffer &buffer, const TRPresentTarget &target) const;
+		template<int N, typename Buffer>
+		void resolveHDR_aux(const Buffer &buffer, const TRPresentTarget &target) const;
+		template<int N, typename Buffer>
+		void resolveRowPlanesHDR(const Buffer &buffer, const uint &y, const uint &bx, const uint &ex, glm::vec4 *row) const;
+
+		//Depth kernels specialized for the format of the attachment
+		template<typename Buffer>
+		float readDepth_aux(const Buffer &buffer, const size_t &pixel, const uint &i) const;
+		template<typename Buffer>
+		void writeDepth_aux(Buffer &buffer, const size_t &pixel, const uint &i, const float &value);
+		template<int N, typename Buffer>
+		void writeDepthWithMask_aux(Buffer &buffer, const size_t &pixel, const TRDepthPixelSampler<N> &depth, const TRMaskPixelSampler<N> &mask);
+		template<int N, typename Buffer>
+		void depthTestWithMask_aux(const Buffer &buffer, const uint &x, const uint &y, const TRDepthPixelSampler<N> &depth,
+			const TRDepthCompareMode &mode, TRMaskPixelSampler<N> &mask) const;
+		template<typename Buffer>
+		void materializeDepth_aux(Buffer &buffer, const uint &block);
+
+		//Depth attachment of the format
+		template<TRDepthFormat Format>
+		using DepthFormatTag = std::integral_constant<TRDepthFormat, Format>;
+		TRDepthBuffer &depthAttachment(DepthFormatTag<TRDepthFormat::TR_DEPTH_FLOAT32>) { return m_depthBuffer; }
+		TRDepthBufferD24 &depthAttachment(DepthFormatTag<TRDepthFormat::TR_DEPTH_UNORM24>) { return m_depthBufferD24; }
+		TRDepthBufferD16 &depthAttachment(DepthFormatTag<TRDepthFormat::TR_DEPTH_UNORM16>) { return m_depthBufferD16; }
+		const TRDepthBuffer &depthAttachment(DepthFormatTag<TRDepthFormat::TR_DEPTH_FLOAT32>) const { return m_depthBuffer; }
+		const TRDepthBufferD24 &depthAttachment(DepthFormatTag<TRDepthFormat::TR_DEPTH_UNORM24>) const { return m_depthBufferD24; }
+		const TRDepthBufferD16 &depthAttachment(DepthFormatTag<TRDepthFormat::TR_DEPTH_UNORM16>) const { return m_depthBufferD16; }
+
+		//Color kernels specialized for the format of the attachment
+		template<typename Buffer>
+		void writeColor_aux(Buffer &buffer, const size_t &pixel, const uint &i, const glm::vec4 &color);
+		template<int N, typename Buffer>
+		void writeColorWithMask_aux(Buffer &buffer, const size_t &pixel, const glm::vec4 &color, const TRMaskPixelSampler<N> &mask);
+		template<int N, typename Buffer>
+		void writeColorWithMaskAlphaBlending_aux(Buffer &buffer, const size_t &pixel, const glm::vec4 &color, const TRMaskPixelSampler<N> &mask);
+
+		uint getBlockIndex(const uint &x, const uint &y) const
+		{
+			return (y / COARSE_DEPTH_BLOCK_SIZE) * m_coarseWidth + (x / COARSE_DEPTH_BLOCK_SIZE);
+		}
+		bool isBlockCleared(const BlockClearStates &states, const uint &block) const
+		{
+			return states[block].load(std::memory_order_acquire) != BLOCK_MATERIALIZED;
+		}
+
+		//Fill the block with the clear value before its first write
+		//Note: fill is invoked with the address of each pixel of the block
+		template<typename Fill>
+		void materializeBlock(const BlockClearStates &states, const uint &block, const Fill &fill);
+		void materializeDepth(const uint &x, const uint &y);
+		void materializeColor(const uint &x, const uint &y);
+
+		//Copy the color of the first sampling point to the others
+		template<typename Buffer>
+		void decompressColor(Buffer &buffer, const size_t &pixel)
+		{
+			if (m_colorCompressed[pixel] == 0)
+				return;
+			const auto value = buffer[getSampleIndex(pixel, 0)];
+			for (uint s = 1; s < m_samplingNum; ++s)
+			{
+				buffer[getSampleIndex(pixel, s)] = value;
+			}
+			m_colorCompressed[pixel] = 0;
+		}
+
+		void markCoarseDepthDirty(const uint &x, const uint &y)
+		{
+			//Note: loaded first, so that the flag's cache line isn't written by every fragment of the block
+			auto &dirty = m_coarseDepthDirty[getBlockIndex(x, y)];
+			if (dirty.load(std::memory_order_relaxed) == 0)
+				dirty.store(1, std::memory_order_relaxed);
+		}
 	};
 }
 
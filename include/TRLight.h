@@ -5,6 +5,8 @@
 
 #include "glm/glm.hpp"
 
+#include "TRMathUtils.h"
+
 namespace TinyRenderer
 {
 	//Abstract class of light source
@@ -22,6 +24,10 @@ namespace TinyRenderer
 		virtual float cutoff(const glm::vec3 &lightDir) const = 0;
 		virtual glm::vec3 direction(const glm::vec3 &fragPos) const = 0;
 
+		//Region where the attenuated intensity is not less than the threshold
+		//Note: return false if it's unbounded, e.g. the directional light
+		virtual bool influenceBounds(const float &/*threshold*/, TRBoundingSphere &/*bounds*/) const { return false; }
+
 	protected:
 		glm::vec3 m_intensity;
 	};
@@ -49,6 +55,24 @@ namespace TinyRenderer
 
 		virtual float cutoff(const glm::vec3 &lightDir) const override { return 1.0f; }
 
+		virtual bool influenceBounds(const float &threshold, TRBoundingSphere &bounds) const override
+		{
+			//Solve intensity / (c + l * d + q * d^2) = threshold for the distance d
+			//Note: the spot light is bounded by the same sphere regardless of its cutoff
+			const float k = glm::max(m_intensity.x, glm::max(m_intensity.y, m_intensity.z)) / glm::max(threshold, 1e-6f);
+			const float c = m_attenuation.x - k, l = m_attenuation.y, q = m_attenuation.z;
+			bounds.center = m_lightPos;
+			if (c > 0.0f)
+				bounds.radius = -1.0f;//Below the threshold everywhere
+			else if (q > 0.0f)
+				bounds.radius = (-l + glm::sqrt(l * l - 4.0f * q * c)) / (2.0f * q);
+			else if (l > 0.0f)
+				bounds.radius = -c / l;
+			else
+				return false;
+			return true;
+		}
+
 		glm::vec3 &getLightPos() { return m_lightPos; }
 
 	private:
@@ -1,10 +1,61 @@
 #ifndef TRMATHUTILS_H
 #define TRMATHUTILS_H
 
+#include <cfloat>
+
 #include "glm/glm.hpp"
 
 namespace TinyRenderer
 {
+	//Axis-aligned bounding box
+	class TRBoundingBox final
+	{
+	public:
+		glm::vec3 min = glm::vec3(FLT_MAX);
+		glm::vec3 max = glm::vec3(-FLT_MAX);
+
+		bool isEmpty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+		glm::vec3 getCenter() const { return (min + max) * 0.5f; }
+		glm::vec3 getExtent() const { return (max - min) * 0.5f; }
+
+		void expand(const glm::vec3 &p) { min = glm::min(min, p); max = glm::max(max, p); }
+		void expand(const TRBoundingBox &box) { min = glm::min(min, box.min); max = glm::max(max, box.max); }
+
+		//Bounding box of the transformed box
+		TRBoundingBox transform(const glm::mat4 &mat) const;
+	};
+
+	class TRBoundingSphere final
+	{
+	public:
+		glm::vec3 center = glm::vec3(0.0f);
+		float radius = -1.0f;
+
+		bool isEmpty() const { return radius < 0.0f; }
+	};
+
+	//View frustum planes extracted from a (model) view projection matrix
+	//Note: the planes are in the space which the matrix transforms from, e.g. the model space for
+	//      projection * view * model, so that the bounding volumes are tested without transforming them.
+	class TRFrustum final
+	{
+	public:
+		TRFrustum() = default;
+		explicit TRFrustum(const glm::mat4 &mat);
+
+		//Note: conservative tests, true only if the volume is completely outside of a plane
+		bool isOutside(const TRBoundingBox &box) const;
+		bool isOutside(const TRBoundingSphere &sphere) const;
+
+		//Note: only the planes in the mask are tested, and the ones the box is completely inside of
+		//      are removed from it, so the boxes nested in this one can skip them (hierarchical culling)
+		bool isOutside(const TRBoundingBox &box, unsigned int &planeMask) const;
+		static constexpr unsigned int ALL_PLANES = 0x3F;
+
+	private:
+		//Left, right, bottom, top, near and far planes, inside if dot(plane.xyz, p) + plane.w >= 0
+		glm::vec4 m_planes[6];
+	};
 
 	class TRMathUtils final
 	{
@@ -5,90 +5,93 @@
 #include <vector>
 
 #include "glm/glm.hpp"
+#include "tbb/cache_aligned_allocator.h"
 
 namespace TinyRenderer
 {
-	template <typename T, size_t N>
-	class TRIPixelSampler
+	//Sampling points of a pixel
+	//Note: sized by the sampling number N of the framebuffer, so that 1x/4x fragments stay small
+	template <typename T, int N>
+	class TRPixelSampler
 	{
 	public:
 		std::array<T, N> samplers;
 
-		static size_t getSamplingNum() { return N; }
+		TRPixelSampler() = default;
+		TRPixelSampler(const T &value) { samplers.fill(value); }
 
 		T& operator[](const int &index) { return samplers[index]; }
 		const T& operator[](const int &index) const { return samplers[index]; }
 
 	};
 
+	//Sampling pattern of MSAA NX
+	template <int N>
+	class TRSamplingPattern;
+
 	//1x Sampling Point
-	template <typename T>
-	class TRPixelSampler1X : public TRIPixelSampler<T, 1>
+	template <>
+	class TRSamplingPattern<1>
 	{
 	public:
 
-		TRPixelSampler1X(const T &value) { samplers.fill(value); }
-
 		static const std::array<glm::vec2, 1> &getSamplingOffsets()
 		{
-			return { glm::vec2(0.0f, 0.0f) };
+			static const std::array<glm::vec2, 1> offsets = { { glm::vec2(0.0f, 0.0f) } };
+			return offsets;
 		}
 
 	};
 
 	//2x Sampling Point
-	template <typename T>
-	class TRPixelSampler2X : public TRIPixelSampler<T, 2>
+	template <>
+	class TRSamplingPattern<2>
 	{
 	public:
 
-		TRPixelSampler2X(const T &value) { samplers.fill(value); }
-
 		static const std::array<glm::vec2, 2> &getSamplingOffsets()
 		{
-			return { glm::vec2(-0.25f, -0.25f), glm::vec2(+0.25f, +0.25f) };
+			static const std::array<glm::vec2, 2> offsets = { { glm::vec2(-0.25f, -0.25f), glm::vec2(+0.25f, +0.25f) } };
+			return offsets;
 		}
 
 	};
 
 	//4x Sampling Point
-	template <typename T>
-	class TRPixelSampler4X : public TRIPixelSampler<T, 4>
+	template <>
+	class TRSamplingPattern<4>
 	{
 	public:
 
-		TRPixelSampler4X(const T &value) { samplers.fill(value); }
-
 		static const std::array<glm::vec2, 4> &getSamplingOffsets()
 		{
 			//Sampling points' offset
 			//Note:Rotated grid sampling pattern
 			//Refs: https://mynameismjp.wordpress.com/2012/10/24/msaa-overview/
-			return
-			{
+			static const std::array<glm::vec2, 4> offsets =
+			{ {
 				glm::vec2(+0.125f, +0.375f),
 				glm::vec2(+0.375f, -0.125f),
 				glm::vec2(-0.125f, -0.375f),
 				glm::vec2(-0.375f, +0.125f)
-			};
+			} };
+			return offsets;
 		}
 	};
 
 	//8x Sampling Point
-	template <typename T>
-	class TRPixelSampler8X : public TRIPixelSampler<T, 8>
+	template <>
+	class TRSamplingPattern<8>
 	{
 	public:
 
-		TRPixelSampler8X(const T &value) { samplers.fill(value); }
-
 		static const std::array<glm::vec2, 8> &getSamplingOffsets()
 		{
 			//Sampling points' offset
 			//Note:Rotated grid sampling pattern
 			//Refs: https://mynameismjp.wordpress.com/2012/10/24/msaa-overview/
-			return
-			{
+			static const std::array<glm::vec2, 8> offsets =
+			{ {
 				glm::vec2(-0.375f, +0.375f),
 				glm::vec2(+0.125f, +0.375f),
 				glm::vec2(-0.125f, +0.125f),
@@ -97,33 +100,49 @@ namespace TinyRenderer
 				glm::vec2(+0.125f, -0.125f),
 				glm::vec2(-0.125f, -0.375f),
 				glm::vec2(+0.375f, -0.375f)
-			};
+			} };
+			return offsets;
 		}
 	};
 
-#define MSAA4X
-
-#ifdef MSAA4X
-	template<typename T>
-	using TRPixelSampler = TRPixelSampler4X<T>;
-	//Note: MSAA 8X is a little time-consuming
-	//template<typename T>
-	//using TRPixelSampler = TRPixelSampler8X<T>;
-#else
-	template<typename T>
-	using TRPixelSampler = TRPixelSampler1X<T>;
-#endif
+	//Supported sampling numbers: 1, 2, 4 and 8
+	inline bool isValidSamplingNum(const int &num) { return num == 1 || num == 2 || num == 4 || num == 8; }
 
 	using TRPixelRGB = std::array<unsigned char, 3>;
 	using TRPixelRGBA = std::array<unsigned char, 4>;
-	using TRMaskPixelSampler = TRPixelSampler<unsigned char>;
-	using TRDepthPixelSampler = TRPixelSampler<float>;
-	using TRColorPixelSampler = TRPixelSampler<TRPixelRGBA>;
+	template <int N>
+	using TRMaskPixelSampler = TRPixelSampler<unsigned char, N>;
+	template <int N>
+	using TRDepthPixelSampler = TRPixelSampler<float, N>;
+	template <int N>
+	using TRColorPixelSampler = TRPixelSampler<TRPixelRGBA, N>;
+
+	//All the N sampling points of the pixel are covered
+	template <int N>
+	inline bool isFullyCovered(const TRMaskPixelSampler<N> &mask)
+	{
+		bool covered = true;
+		for (int s = 0; s < N; ++s)
+			covered = covered && (mask[s] == 1);
+		return covered;
+	}
 
 	//Framebuffer attachment
-	using TRMaskBuffer = std::vector<TRMaskPixelSampler>;
-	using TRDepthBuffer = std::vector<TRDepthPixelSampler>;
-	using TRColorBuffer = std::vector<TRColorPixelSampler>;
+	//Note: the address of sampling point s of a pixel depends on the framebuffer layout
+	using TRDepthBuffer = std::vector<float, tbb::cache_aligned_allocator<float>>;
+
+	//Reduced-precision depth attachment
+	using TRPixelD24 = std::array<unsigned char, 3>;
+	using TRPixelD16 = unsigned short;
+	using TRDepthBufferD24 = std::vector<TRPixelD24, tbb::cache_aligned_allocator<TRPixelD24>>;
+	using TRDepthBufferD16 = std::vector<TRPixelD16, tbb::cache_aligned_allocator<TRPixelD16>>;
+	using TRColorBuffer = std::vector<TRPixelRGBA, tbb::cache_aligned_allocator<TRPixelRGBA>>;
+
+	//HDR color attachment
+	using TRPixelRGBA16F = glm::uint64;		//glm::packHalf4x16
+	using TRPixelR11G11B10F = glm::uint32;	//glm::packF2x11_1x10
+	using TRColorBufferRGBA16F = std::vector<TRPixelRGBA16F, tbb::cache_aligned_allocator<TRPixelRGBA16F>>;
+	using TRColorBufferR11G11B10F = std::vector<TRPixelR11G11B10F, tbb::cache_aligned_allocator<TRPixelR11G11B10F>>;
 
 	constexpr TRPixelRGBA trWhite = { 255, 255, 255 ,255 };
 	constexpr TRPixelRGBA trBlack = { 0, 0, 0, 0 };
@@ -2,22 +2,66 @@
 #define TRRENDERER_H
 
 #include "glm/glm.hpp"
-#include "SDL2/SDL.h"
 
 #include "TRFrameBuffer.h"
 #include "TRDrawableMesh.h"
 #include "TRShadingState.h"
 #include "TRShadingPipeline.h"
+#include "TRSceneBVH.h"
+
+#include "tbb/enumerable_thread_specific.h"
 
 namespace TinyRenderer
 {
+	class TileBinningCache;
+	class StreamingPipelineCache;
+
+	//Pipeline statistics of a frame
+	//Note: the triangles after clipping are counted by culled and rasterized, one face could be split into several of them.
+	//      The stage times are summed over the worker threads, since the stages overlap in the parallel pipeline.
+	struct TRFrameStats
+	{
+		//Geometry
+		unsigned long long numVerticesShaded = 0;
+		unsigned long long numTrianglesSubmitted = 0;
+		unsigned long long numTrianglesFrustumCulled = 0;	//Skipped by the bounding volumes of the submeshes and face batches
+		unsigned long long numTrianglesClipped = 0;		//Crossing the clipping planes of the guard band
+		unsigned long long numTrianglesOutside = 0;		//Fully outside of the view frustum
+		unsigned long long numTrianglesCulled = 0;		//Backface culling
+		unsigned long long numTrianglesRasterized = 0;
+
+		//Rasterization & fragments
+		unsigned long long numQuadsGenerated = 0;
+		unsigned long long numFragmentsGenerated = 0;
+		unsigned long long numFragmentsDepthRejected = 0;
+		unsigned long long numFragmentsCoverageRejected = 0;	//Alpha to coverage
+		unsigned long long numFragmentShaderInvocations = 0;	//Including the material shader of deferred shading
+		unsigned long long numSamplesWritten = 0;				//Color samples
+
+		//Time (ms)
+		double vertexRasterTime = 0.0;	//Vertex shading, clipping, culling, triangle setup and rasterization
+		double fragmentTime = 0.0;		//Depth testing, fragment shading and framebuffer writing
+		double resolveTime = 0.0;
+		double commitTime = 0.0;
+
+		TRFrameStats &operator+=(const TRFrameStats &stats);
+	};
+
 	class TRRenderer final
 	{
 	public:
 		typedef std::shared_ptr<TRRenderer> ptr;
 
-		TRRenderer(int width, int height);
-		~TRRenderer() = default;
+		//Note: samplingNum is the number of MSAA sampling points per pixel: 1, 2, 4 or 8
+		//      layout and addressMode are the storage layout of the sampling points and the pixels in the framebuffers
+		//      colorFormat is the format of the color attachment, the HDR formats are tone mapped in the resolve
+		//      depthFormat is the format of the depth attachment, the unorm formats depend on the near & far planes
+		TRRenderer(int width, int height, int samplingNum = 4,
+			TRFrameBufferLayout layout = TRFrameBufferLayout::TR_LAYOUT_INTERLEAVED,
+			TRPixelAddressMode addressMode = TRPixelAddressMode::TR_ADDRESS_LINEAR,
+			TRColorFormat colorFormat = TRColorFormat::TR_COLOR_RGBA8,
+			TRDepthFormat depthFormat = TRDepthFormat::TR_DEPTH_FLOAT32);
+		~TRRenderer();
 
 		//Drawable objects load/unload
 		void addDrawableMesh(TRDrawableMesh::ptr mesh);
@@ -31,12 +75,22 @@ namespace TinyRenderer
 		//Setting
 		void setViewMatrix(const glm::mat4 &view) { m_viewMatrix = view; }
 		void setModelMatrix(const glm::mat4 &model) { m_modelMatrix = model; }
-		void setProjectMatrix(const glm::mat4 &project, float near, float far) { m_projectMatrix = project;m_frustum_near_far = glm::vec2(near, far); }
+		void setProjectMatrix(const glm::mat4 &project, float near, float far)
+		{
+			m_projectMatrix = project;
+			m_frustum_near_far = glm::vec2(near, far);
+			m_backBuffer->setDepthRange(near, far);
+		}
 		void setShaderPipeline(TRShadingPipeline::ptr shader) { m_shader_handler = shader; }
+		void setRasterizationMode(TRRasterizationMode mode) { m_raster_mode = mode; }
+		void setShadingMode(TRShadingMode mode) { m_shading_state.trShadingMode = mode; }
+		void setDepthPrepassMode(TRDepthPrepassMode mode) { m_depth_prepass_mode = mode; }
 		void setViewerPos(const glm::vec3 &viewer);
 
 		int addLightSource(TRLight::ptr lightSource);
 		TRLight::ptr getLightSource(const int &index);
+		//Note: the light sources are shared by all the renderers, unload them before loading another scene
+		void unloadLightSources();
 		void setExposure(const float &exposure);
 
 		//Draw call
@@ -44,30 +98,80 @@ namespace TinyRenderer
 
 		unsigned int renderDrawableMesh(const size_t &index);
 
+		//Scene queries by the bounding volume hierarchy of the drawable meshes
+		//Note: the hierarchy is rebuilt after adding or unloading meshes, and refitted for the moved ones
+		void updateSceneBVH() { m_sceneBVH.update(m_drawableMeshes); }
+		const TRSceneBVH &getSceneBVH() const { return m_sceneBVH; }
+		//Meshes within the range where the attenuated intensity of the light is above the threshold
+		void queryLightInfluencedMeshes(const int &lightIndex, const float &threshold, std::vector<size_t> &meshes);
+		//The nearest triangle under the pixel (x, y) of the screen
+		bool pickDrawableMesh(const int &x, const int &y, TRRayHit &hit);
+
+		//Statistics of the draw calls and the commit since the last reset
+		//Note: reset by renderAllDrawableMeshes(), the counters are accumulated per thread without any synchronization
+		TRFrameStats getFrameStats() const;
+		void resetFrameStats();
+
 		//Commit rendered result
+		//Note: the MSAA back buffer is resolved herein, either into the RGB image owned by the renderer
+		//      or straight into the caller-provided target (e.g. the screen surface)
 		unsigned char* commitRenderedColorBuffer();
+		void commitRenderedColorBuffer(const TRPresentTarget &target);
+
+		//Fixed-capacity polygon for clipping without any heap allocation
+		//Note: each one of the 7 clipping planes adds one vertex at most
+		struct ClippingPolygon
+		{
+			static constexpr int MAX_VERTICES = 3 + 7;
+			TRShadingPipeline::VertexData vertices[MAX_VERTICES];
+			int size = 0;
+
+			bool empty() const { return size == 0; }
+			void push_back(const TRShadingPipeline::VertexData &v) { vertices[size++] = v; }
+		};
 
 		//Homogeneous space clipping - Sutherland Hodgeman algorithm
-		static std::vector<TRShadingPipeline::VertexData> clipingSutherlandHodgeman(
+		//Note: guard_band scales the x/y clipping planes (w=x -> guard_band.x*w=x), triangles inside the
+		//      guard band are left to the rasterizer's bounding box clamp instead of being clipped.
+		//      Return true if the triangle is actually clipped, i.e. neither trivially accepted nor rejected.
+		static bool clipingSutherlandHodgeman(
 			const TRShadingPipeline::VertexData &v0,
 			const TRShadingPipeline::VertexData &v1,
 			const TRShadingPipeline::VertexData &v2,
 			const float &near, 
-			const float &far);
+			const float &far,
+			ClippingPolygon &clipped_polygon,
+			const glm::vec2 &guard_band = glm::vec2(1.0f));
 
 	private:
 
+		//Render passes of a drawable mesh
+		enum RenderPass
+		{
+			FORWARD_PASS,		//Depth testing, shading and writing as the drawable's setting
+			DEPTH_ONLY_PASS,	//Depth testing and writing only
+			EQUAL_DEPTH_PASS	//Shading the fragments at the stored depth, without depth writing
+		};
+
+		bool isOpaqueDrawableMesh(const size_t &index) const;
+		unsigned int renderDrawableMesh(const size_t &index, const RenderPass &pass);
+
 		//Cliping auxiliary functions
-		static std::vector<TRShadingPipeline::VertexData> clipingSutherlandHodgeman_aux(
-			const std::vector<TRShadingPipeline::VertexData> &polygon,
-			const int &axis, 
-			const int &side);
+		static void clipingSutherlandHodgeman_aux(
+			const ClippingPolygon &polygon,
+			const int &plane,
+			const glm::vec2 &guard_band,
+			ClippingPolygon &inside_polygon);
 
 	private:
 
 		//Drawable mesh array
 		std::vector<TRDrawableMesh::ptr> m_drawableMeshes;
 
+		//Hierarchy over the drawable meshes and the visible ones of the current frame
+		TRSceneBVH m_sceneBVH;
+		std::vector<size_t> m_visibleMeshes;
+
 		//MVP transformation matrices
 		glm::mat4 m_modelMatrix = glm::mat4(1.0f);				//From local space  -> world space
 		glm::mat4 m_viewMatrix = glm::mat4(1.0f);				//From world space  -> camera space
@@ -76,16 +180,29 @@ namespace TinyRenderer
 
 		TRShadingState m_shading_state;
 
+		//Streaming pipeline or sort-middle tile binning
+		TRRasterizationMode m_raster_mode = TRRasterizationMode::TR_RASTER_STREAMING;
+
+		//Depth-only pass before shading the opaque meshes or not
+		TRDepthPrepassMode m_depth_prepass_mode = TRDepthPrepassMode::TR_DEPTH_PREPASS_DISABLE;
+
 		//Near plane & far plane
 		glm::vec2 m_frustum_near_far;
 
 		//Shader pipeline handler
 		TRShadingPipeline::ptr m_shader_handler = nullptr;
 
-		//Double buffers
+		//MSAA back buffer and single-sample present image
 		TRFrameBuffer::ptr m_backBuffer;                      // The frame buffer that's goint to be written.
-		TRFrameBuffer::ptr m_frontBuffer;                     // The frame buffer that's goint to be displayed.
-		std::vector<unsigned char> m_renderedImg;			// The rendered image.
+		std::vector<unsigned char> m_renderedImg;			// The resolved image that's going to be displayed.
+
+		//Per-thread pipeline statistics
+		tbb::enumerable_thread_specific<TRFrameStats> m_frameStats;
+
+		//Draw call buffers owned by each renderer, so that renderers could draw on different threads
+		std::vector<TRShadingPipeline::VertexData> m_transformedVertices;	//Vertex shader outputs of the submesh
+		std::unique_ptr<TileBinningCache> m_tileBinningCache;				//Binned triangles of the screen tiles
+		std::unique_ptr<StreamingPipelineCache> m_streamingCache;			//Rasterized faces and pixel mutexes
 	};
 }
 
@@ -0,0 +1,115 @@
+#ifndef TRSCENE_BVH_H
+#define TRSCENE_BVH_H
+
+#include <vector>
+#include <memory>
+
+#include "glm/glm.hpp"
+
+#include "TRMathUtils.h"
+#include "TRDrawableMesh.h"
+
+namespace TinyRenderer
+{
+	//Nearest intersection of a ray and the drawable meshes
+	struct TRRayHit
+	{
+		int meshIndex = -1;
+		int submeshIndex = -1;
+		int faceIndex = -1;
+		float distance = FLT_MAX;	//Along the ray direction
+		glm::vec3 position = glm::vec3(0.0f);
+	};
+
+	//Bounding volume hierarchy over the world space bounding boxes of the drawable meshes' submeshes
+	//Note: the submeshes of an entity are bounded by a subtree since they're usually close to each other.
+	//      It's refitted (rather than rebuilt) for the meshes whose model matrices are changed,
+	//      and rebuilt only if the refitted nodes get much looser.
+	class TRSceneBVH final
+	{
+	public:
+		typedef std::shared_ptr<TRSceneBVH> ptr;
+
+		//A submesh of a drawable mesh
+		struct Item
+		{
+			int meshIndex;
+			int submeshIndex;
+		};
+
+		TRSceneBVH() = default;
+		~TRSceneBVH() = default;
+
+		//Note: rebuild the hierarchy if the meshes are added or removed, otherwise refit the moved ones
+		void update(const std::vector<TRDrawableMesh::ptr> &meshes);
+		void invalidate() { m_valid = false; }
+
+		bool isEmpty() const { return m_nodes.empty(); }
+		const TRBoundingBox &getBoundingBox() const;
+		unsigned int getNumFaces() const { return m_numFaces; }
+
+		//Items overlapping the frustum (in the world space) or the sphere
+		void queryFrustum(const TRFrustum &frustum, std::vector<Item> &items) const;
+		void querySphere(const TRBoundingSphere &sphere, std::vector<Item> &items) const;
+
+		//Indices of the meshes overlapping the frustum in ascending order, and their number of faces
+		unsigned int queryVisibleMeshes(const TRFrustum &frustum, std::vector<size_t> &meshes) const;
+
+		//Nearest intersection of the ray and the triangles
+		//Note: the meshes must be the ones of the last update
+		bool raycast(const std::vector<TRDrawableMesh::ptr> &meshes, const glm::vec3 &origin,
+			const glm::vec3 &dir, TRRayHit &hit) const;
+
+	private:
+		//Note: the left child of an inner node is the next node, so the children are behind their parent
+		struct Node
+		{
+			TRBoundingBox box;
+			int parent = -1;
+			int right = -1;	//Right child of an inner node
+			int first = 0;	//Leaf node: the items m_order[first, first + count)
+			int count = 0;	//Zero for the inner nodes
+		};
+
+		//A submesh with its world space bounding box
+		struct Leaf
+		{
+			Item item;
+			TRBoundingBox box;
+			int node = -1;	//The leaf node containing it
+		};
+
+		//Leaves of a mesh: m_leaves[first, first + count)
+		struct MeshRecord
+		{
+			const TRDrawableMesh *mesh = nullptr;
+			unsigned int modelMatrixStamp = 0;
+			unsigned int numFaces = 0;
+			int first = 0;
+			int count = 0;
+		};
+
+		void build(const std::vector<TRDrawableMesh::ptr> &meshes);
+		int buildRecursive(int parent, int first, int count);
+		void refitLeaves(const MeshRecord &record, const TRDrawableMesh &mesh);
+
+		//Visit the leaves whose bounding boxes pass the overlapping test
+		//Note: the overlapping test gets the mask of its parent (e.g. the frustum planes still to be tested)
+		template<typename Overlap, typename Visitor>
+		void traverse(const Overlap &overlap, const Visitor &visitor) const;
+
+	private:
+		static constexpr int MAX_LEAF_SIZE = 2;
+
+		bool m_valid = false;
+		unsigned int m_numFaces = 0;
+		float m_nodesArea = 0.0f;		//Sum of the surface areas of the nodes
+		float m_builtNodesArea = 0.0f;	//The one right after building
+		std::vector<Node> m_nodes;
+		std::vector<Leaf> m_leaves;
+		std::vector<int> m_order;	//Leaf indices sorted by the hierarchy
+		std::vector<MeshRecord> m_meshes;
+	};
+}
+
+#endif
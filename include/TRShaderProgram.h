@@ -76,6 +76,8 @@ namespace TinyRenderer
 
 		virtual void fragmentShader(const FragmentData &data, glm::vec4 &fragColor,
 			const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const override;
+		virtual bool materialShader(const FragmentData &data, TRGBufferTexel &texel,
+			const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const override;
 	};
 
 	class TRBlinnPhongNormalMapShadingPipeline final : public TR3DShadingPipeline
@@ -88,6 +90,8 @@ namespace TinyRenderer
 		virtual void vertexShader(VertexData &vertex) const override;
 		virtual void fragmentShader(const FragmentData &data, glm::vec4 &fragColor,
 			const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const override;
+		virtual bool materialShader(const FragmentData &data, TRGBufferTexel &texel,
+			const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const override;
 	};
 
 	class TRAlphaBlendingShadingPipeline final : public TR3DShadingPipeline
@@ -1,6 +1,7 @@
 #ifndef TRSHADERPIPELINE_H
 #define TRSHADERPIPELINE_H
 
+#include <tuple>
 #include <vector>
 #include <memory>
 
@@ -10,6 +11,7 @@
 #include "TRTexture2D.h"
 #include "TRParallelWrapper.h"
 #include "TRPixelSampler.h"
+#include "TRFrameBuffer.h"
 
 namespace TinyRenderer
 {
@@ -52,11 +54,6 @@ namespace TinyRenderer
 			glm::ivec2 spos;//Screen space position
 			glm::mat3 TBN;  //Tangent, bitangent, normal matrix
 			float rhw;
-			
-			//MSAA Mask
-			//Note: each sampling point should have its own depth
-			TRMaskPixelSampler coverage = 0;
-			TRDepthPixelSampler coverage_depth = 0.0f;
 
 			FragmentData() = default;
 			FragmentData(const glm::ivec2 &screen_pos) : spos(screen_pos) {}
@@ -65,7 +62,44 @@ namespace TinyRenderer
 
 		};
 
+		//Attribute plane equation in screen space: a(x,y) = a + dadx * dx + dady * dy
+		template<typename T>
+		struct AttributePlane
+		{
+			T a, dadx, dady;
+
+			inline T at(const float &dx, const float &dy) const { return a + dadx * dx + dady * dy; }
+		};
+
+		//Per-triangle setup for rasterization and interpolation
+		class TriangleSetup
+		{
+		public:
+			glm::ivec2 spos[3];	//Screen space positions
+			float rhw[3];		//Reciprocal of w
+
+			//Plane equations relative to spos[0]
+			//Note: pos, nor and tex are premultiplied by rhw (perspective correction)
+			AttributePlane<glm::vec3> pos;
+			AttributePlane<glm::vec3> nor;
+			AttributePlane<glm::vec2> tex;
+			AttributePlane<float> depth;//rhw
+			AttributePlane<glm::mat3> TBN;
+			bool needInterpolatedTBN = false;
+
+			TriangleSetup() = default;
+			TriangleSetup(const VertexData &v0, const VertexData &v1, const VertexData &v2);
+
+			//Interpolation at the given pixel, including the perspective correction restore
+			void interpolate(const glm::ivec2 &p, FragmentData &data) const;
+			glm::vec2 interpolateTexcoord(const glm::ivec2 &p) const;
+		};
+
 		//2x2 fragments block for calculating dFdx and dFdy.
+		//Note: the varyings are not stored but interpolated lazily from the triangle setup,
+		//      only for those fragments passing the depth test and the helper lanes for derivatives.
+		//      N is the sampling number, which sizes the coverage mask and depths.
+		template <int N>
 		class QuadFragments
 		{
 		public:
@@ -76,25 +110,54 @@ namespace TinyRenderer
 			 *   f0 -> (x+0, y+0), f1 -> (x+1,y+0 )
 			 *   f2 -> (x+0, y+1), f3 -> (x+1,y+1)
 			 ************************************/
-			FragmentData fragments[4];
+			glm::ivec2 spos;								//Screen space position of f0
+			const TriangleSetup *triangle = nullptr;		//The triangle it belongs to
+
+			//MSAA Mask
+			//Note: each sampling point should have its own depth
+			TRMaskPixelSampler<N> coverage[4] = { 0, 0, 0, 0 };
+			TRDepthPixelSampler<N> coverage_depth[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+			inline glm::ivec2 fragmentPos(const int &i) const { return spos + glm::ivec2(i & 1, i >> 1); }
 
 			//Forward differencing
 			//Note: Need to handle the boundary condition.
-			inline float dUdx() const { return fragments[1].tex.x - fragments[0].tex.x; }
-			inline float dUdy() const { return fragments[2].tex.x - fragments[0].tex.x; }
-			inline float dVdx() const { return fragments[1].tex.y - fragments[0].tex.y;	}
-			inline float dVdy() const { return fragments[2].tex.y - fragments[0].tex.y; }
-		
-			//Perspective correction restore
-			inline void aftPrespCorrectionForBlocks()
+			inline void dUVdxy(glm::vec2 &dUVdx, glm::vec2 &dUVdy) const
 			{
-				TRShadingPipeline::FragmentData::aftPrespCorrection(fragments[0]);
-				TRShadingPipeline::FragmentData::aftPrespCorrection(fragments[1]);
-				TRShadingPipeline::FragmentData::aftPrespCorrection(fragments[2]);
-				TRShadingPipeline::FragmentData::aftPrespCorrection(fragments[3]);
+				const glm::vec2 uv0 = triangle->interpolateTexcoord(fragmentPos(0));
+				dUVdx = triangle->interpolateTexcoord(fragmentPos(1)) - uv0;
+				dUVdy = triangle->interpolateTexcoord(fragmentPos(2)) - uv0;
 			}
 		};
 
+		//Rasterized 2x2 fragments blocks, only the list of the framebuffer's sampling number is used
+		class QuadFragmentsBuffer
+		{
+		public:
+			template <int N>
+			std::vector<QuadFragments<N>> &blocks() { return std::get<samplingSlot(N)>(m_blocks); }
+
+			size_t size() const 
+			{
+				return std::get<0>(m_blocks).size() + std::get<1>(m_blocks).size() +
+					std::get<2>(m_blocks).size() + std::get<3>(m_blocks).size();
+			}
+			bool empty() const { return size() == 0; }
+			void clear()
+			{
+				std::get<0>(m_blocks).clear();
+				std::get<1>(m_blocks).clear();
+				std::get<2>(m_blocks).clear();
+				std::get<3>(m_blocks).clear();
+			}
+
+		private:
+			static constexpr int samplingSlot(int n) { return n == 1 ? 0 : n == 2 ? 1 : n == 4 ? 2 : 3; }
+
+			std::tuple<std::vector<QuadFragments<1>>, std::vector<QuadFragments<2>>,
+				std::vector<QuadFragments<4>>, std::vector<QuadFragments<8>>> m_blocks;
+		};
+
 		virtual ~TRShadingPipeline() = default;
 
 		//Vertex shader settting
@@ -118,33 +181,68 @@ namespace TinyRenderer
 		void setNormalTexId(const int &id) { m_normal_tex_id = id; }
 		void setGlowTexId(const int &id) { m_glow_tex_id = id; }
 		void setShininess(const float &shininess) { m_shininess = shininess; }
+		//Note: the tone mapping is deferred to the resolve if the color attachment is HDR
+		void setToneMapping(const bool &enable) { m_tone_mapping = enable; }
 
 		//Shaders
 		virtual void vertexShader(VertexData &vertex) const = 0;
 		virtual void fragmentShader(const FragmentData &data, glm::vec4 &fragColor,
 			const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const = 0;
 
+		//Deferred shading
+		//Note: a pipeline supporting deferred shading fills the G-buffer texel and returns true,
+		//      otherwise the fragment is shaded by fragmentShader as usual.
+		virtual bool materialShader(const FragmentData &/*data*/, TRGBufferTexel &/*texel*/,
+			const glm::vec2 &/*dUVdx*/, const glm::vec2 &/*dUVdy*/) const { return false; }
+		static glm::vec4 blinnPhongLighting(const TRGBufferTexel &texel, const bool &toneMapping);
+
 		//Rasterization
+		//Note: if coarse_depth is not null, the blocks occluded by its hierarchical z are skipped
+		//      the triangle should outlive the rasterized fragments which refer to it
+		//      sampling_num is the number of MSAA sampling points per pixel: 1, 2, 4 or 8
 		static void rasterize_fill_edge_function(
-			const VertexData &v0,
-			const VertexData &v1,
-			const VertexData &v2,
+			const TriangleSetup &triangle,
 			const unsigned int &screen_width,
 			const unsigned int &screene_height,
-			std::vector<QuadFragments> &rasterized_points);
+			QuadFragmentsBuffer &rasterized_points,
+			const int &sampling_num,
+			const TRFrameBuffer *coarse_depth = nullptr);
+
+		//Rasterization restricted to the given rectangle [clip_min, clip_max] (inclusive)
+		static void rasterize_fill_edge_function(
+			const TriangleSetup &triangle,
+			const glm::ivec2 &clip_min,
+			const glm::ivec2 &clip_max,
+			QuadFragmentsBuffer &rasterized_points,
+			const int &sampling_num,
+			const TRFrameBuffer *coarse_depth = nullptr);
 
 		//Textures and lights setting
 		static int upload_texture_2D(TRTexture2D::ptr tex);
 		static TRTexture2D::ptr getTexture2D(int index);
 		static int addLight(TRLight::ptr lightSource);
 		static TRLight::ptr getLight(int index);
+		static int getNumLights() { return static_cast<int>(m_lights.size()); }
+		static void clearLights();
 		static void setExposure(const float &exposure) { m_exposure = exposure; }
+		static float getExposure() { return m_exposure; }
 		static void setViewerPos(const glm::vec3 &viewer) { m_viewer_pos = viewer; }
 
 		//Texture sampling
 		static glm::vec4 texture2D(const unsigned int &id, const glm::vec2 &uv, 
 			const glm::vec2 &dUVdx, const glm::vec2 &dUVdy);
 
+	private:
+
+		//Rasterization kernel specialized for MSAA NX
+		template<int N>
+		static void rasterize_fill_edge_function_aux(
+			const TriangleSetup &triangle,
+			const glm::ivec2 &clip_min,
+			const glm::ivec2 &clip_max,
+			std::vector<QuadFragments<N>> &rasterized_points,
+			const TRFrameBuffer *coarse_depth);
+
 	protected:
 
 		glm::mat4 m_model_matrix = glm::mat4(1.0f);
@@ -157,6 +255,14 @@ namespace TinyRenderer
 		static glm::vec3 m_viewer_pos;
 		static float m_exposure;
 
+		//Tone mapping: HDR -> LDR
+		//Refs: https://learnopengl.com/Advanced-Lighting/HDR
+		static glm::vec3 toneMapping(const glm::vec3 &hdrColor, const bool &enable)
+		{
+			return enable ? glm::vec3(1.0f - glm::exp(-hdrColor * m_exposure)) : hdrColor;
+		}
+		glm::vec3 toneMapping(const glm::vec3 &hdrColor) const { return toneMapping(hdrColor, m_tone_mapping); }
+
 		//Material setting
 		glm::vec3 m_ka = glm::vec3(0.0f);
 		glm::vec3 m_kd = glm::vec3(1.0f);
@@ -170,6 +276,7 @@ namespace TinyRenderer
 		int m_glow_tex_id = -1;
 
 		bool m_lighting_enable = true;
+		bool m_tone_mapping = true;
 	};
 }
 
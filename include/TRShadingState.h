@@ -41,6 +41,28 @@ namespace TinyRenderer
 		TR_DEPTH_WRITE_ENABLE
 	};
 
+	//Depth compare function
+	//Note: reversed z, the closer the greater
+	enum TRDepthCompareMode
+	{
+		TR_DEPTH_COMPARE_GREATER,	//Pass if the fragment is closer than the stored one
+		TR_DEPTH_COMPARE_GEQUAL,	//Pass if the fragment is not farther than the stored one
+		TR_DEPTH_COMPARE_EQUAL		//Pass if the fragment is at the stored depth
+	};
+
+	enum TRColorWriteMode
+	{
+		TR_COLOR_WRITE_DISABLE,
+		TR_COLOR_WRITE_ENABLE
+	};
+
+	//Depth prepass mode
+	enum TRDepthPrepassMode
+	{
+		TR_DEPTH_PREPASS_DISABLE,	//Shade the opaque meshes in a single pass
+		TR_DEPTH_PREPASS_ENABLE		//Depth-only pass first, then shade each visible sample once with the equal depth test
+	};
+
 	enum TRLightingMode
 	{
 		TR_LIGHTING_DISABLE,
@@ -54,13 +76,71 @@ namespace TinyRenderer
 		TR_ALPHA_TO_COVERAGE
 	};
 
+	//Rasterization pipeline mode
+	enum TRRasterizationMode
+	{
+		TR_RASTER_STREAMING,	//Parallel pipeline over faces, per-pixel locking
+		TR_RASTER_TILE_BINNING	//Sort-middle: bin faces into screen tiles, one worker per tile
+	};
+
+	//Framebuffer storage layout of the sampling points
+	enum TRFrameBufferLayout
+	{
+		TR_LAYOUT_INTERLEAVED,		//The sampling points of a pixel are contiguous
+		TR_LAYOUT_SAMPLE_PLANES		//One contiguous cache-aligned plane per sampling point index (SoA)
+	};
+
+	//Framebuffer pixel address mapping, the same as the texture holders
+	enum TRPixelAddressMode
+	{
+		TR_ADDRESS_LINEAR,			//Row by row
+		TR_ADDRESS_TILING,			//4x4 tiles
+		TR_ADDRESS_ZCURVE_TILING	//32x32 tiles, morton curve inside each tile
+	};
+
+	//Color attachment format of the framebuffer
+	enum TRColorFormat
+	{
+		TR_COLOR_RGBA8,			//LDR, the fragment shaders do the tone mapping
+		TR_COLOR_RGBA16F,		//HDR half floats, tone mapping once per pixel in the resolve
+		TR_COLOR_R11G11B10F		//HDR packed floats without alpha, tone mapping once per pixel in the resolve
+	};
+
+	//Depth attachment format of the framebuffer
+	//Note: the unorm formats store (1/w - 1/far) / (1/near - 1/far), i.e. still reversed z
+	enum TRDepthFormat
+	{
+		TR_DEPTH_FLOAT32,		//1/w as float
+		TR_DEPTH_UNORM24,		//24-bit unorm, packed into 3 bytes
+		TR_DEPTH_UNORM16		//16-bit unorm
+	};
+
+	//Pixel format of the present target, in memory byte order
+	enum TRPresentFormat
+	{
+		TR_PRESENT_RGB8,		//3 bytes per pixel
+		TR_PRESENT_RGBA8,		//4 bytes per pixel, i.e. SDL_PIXELFORMAT_ABGR8888 on little endian
+		TR_PRESENT_BGRA8,		//4 bytes per pixel, i.e. SDL_PIXELFORMAT_ARGB8888 on little endian
+		TR_PRESENT_RGB32F		//3 floats per pixel
+	};
+
+	//Shading mode
+	enum TRShadingMode
+	{
+		TR_SHADING_FORWARD,		//Shade every fragment passing the depth test
+		TR_SHADING_DEFERRED		//Write materials to the G-buffer, and shade each pixel once after all meshes
+	};
+
 	class TRShadingState
 	{
 	public:
 		TRCullFaceMode trCullFaceMode		 = TRCullFaceMode::TR_CULL_BACK;
 		TRDepthTestMode trDepthTestMode		 = TRDepthTestMode::TR_DEPTH_TEST_ENABLE;
 		TRDepthWriteMode trDepthWriteMode	 = TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE;
+		TRDepthCompareMode trDepthCompareMode = TRDepthCompareMode::TR_DEPTH_COMPARE_GREATER;
+		TRColorWriteMode trColorWriteMode	 = TRColorWriteMode::TR_COLOR_WRITE_ENABLE;
 		TRAlphaBlendingMode trAlphaBlendMode = TRAlphaBlendingMode::TR_ALPHA_DISABLE;
+		TRShadingMode trShadingMode			 = TRShadingMode::TR_SHADING_FORWARD;
 	};
 
 }
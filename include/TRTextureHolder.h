@@ -2,6 +2,7 @@
 #define TRTEXTURE_HOLDER_H
 
 #include <memory>
+#include <cstdint>
 
 namespace TinyRenderer
 {
@@ -0,0 +1,64 @@
+#ifndef TRTRACER_H
+#define TRTRACER_H
+
+#include <string>
+#include <atomic>
+
+namespace TinyRenderer
+{
+	//Timeline tracer of the pipeline stages, dumped as Chrome trace json (chrome://tracing or ui.perfetto.dev)
+	//Note: it's disabled by default, then an event costs nothing but a relaxed atomic load.
+	//      Each thread records its begin/end events into its own ring buffer without any locking,
+	//      the oldest events of a thread are overwritten once its buffer is full.
+	class TRTracer final
+	{
+	public:
+		//Note: capacity is the number of events kept per thread, enabling discards the recorded events.
+		//      It reallocates the ring buffers and resets the epoch, so enable it
+		//      only when no thread is rendering, e.g. between the frames
+		static void enable(size_t capacity = 1 << 16);
+		static void disable();
+		static bool isEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+		//Note: only the pointers of name and category are recorded, so they must be string literals.
+		//      arg (e.g. the index of the mesh or the first face) is dumped if it's not negative.
+		static void begin(const char *name, const char *category, long long arg = -1);
+		static void end(const char *name, const char *category);
+
+		//Note: the ring buffers are read without any synchronization, so dump or clear them
+		//      only when no thread is rendering, e.g. between the frames
+		static void clear();
+		static bool dumpChromeTrace(const std::string &path);
+
+	private:
+		static std::atomic<bool> s_enabled;
+	};
+
+	//Begin and end events of the enclosing scope
+	class TRTraceScope final
+	{
+	public:
+		TRTraceScope(const char *name, const char *category, long long arg = -1)
+			: m_name(TRTracer::isEnabled() ? name : nullptr), m_category(category)
+		{
+			if (m_name != nullptr)
+				TRTracer::begin(m_name, m_category, arg);
+		}
+
+		~TRTraceScope()
+		{
+			//Note: always closed once begun, even if the tracer is disabled in the meantime
+			if (m_name != nullptr)
+				TRTracer::end(m_name, m_category);
+		}
+
+		TRTraceScope(const TRTraceScope&) = delete;
+		TRTraceScope &operator=(const TRTraceScope&) = delete;
+
+	private:
+		const char *m_name;
+		const char *m_category;
+	};
+}
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "SDL2/SDL.h"
 
+#include "TRRenderer.h"
+
 #include <string>
 #include <sstream>
 #include <memory>
@@ -19,6 +21,9 @@ namespace TinyRenderer
 
 		bool setup(int width, int height, std::string title);
 
+		//Display the screen surface and count the FPS
+		double presentScreenSurface(unsigned int num_triangles);
+
 	public:
 
 		typedef std::shared_ptr<TRWindowsApp> ptr;
@@ -76,6 +81,11 @@ namespace TinyRenderer
 			int channel,
 			unsigned int num_triangles);
 
+		//Resolve the rendered result of the renderer into the screen surface directly
+		double updateScreenSurface(
+			TRRenderer::ptr renderer,
+			unsigned int num_triangles);
+
 		static TRWindowsApp::ptr getInstance();
 		static TRWindowsApp::ptr getInstance(int width, int height, const std::string title = "winApp");
 
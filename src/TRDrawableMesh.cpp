@@ -9,11 +9,13 @@
 
 #include "TRTexture2D.h"
 #include "TRShadingPipeline.h"
+#include "TRTracer.h"
 
 namespace TinyRenderer
 {
 	TRDrawableSubMesh::TRDrawableSubMesh(const TRDrawableSubMesh& mesh)
-		: m_vertices(mesh.m_vertices), m_indices(mesh.m_indices), m_drawing_material(mesh.m_drawing_material) {}
+		: m_vertices(mesh.m_vertices), m_indices(mesh.m_indices), m_bounding(mesh.m_bounding),
+		m_drawing_material(mesh.m_drawing_material) {}
 
 	TRDrawableSubMesh& TRDrawableSubMesh::operator=(const TRDrawableSubMesh& mesh)
 	{
@@ -21,14 +23,49 @@ namespace TinyRenderer
 			return *this;
 		m_vertices = mesh.m_vertices;
 		m_indices = mesh.m_indices;
+		m_bounding = mesh.m_bounding;
 		m_drawing_material = mesh.m_drawing_material;
 		return *this;
 	}
 
+	void TRDrawableSubMesh::computeBoundingVolumes()
+	{
+		m_bounding = BoundingVolumes();
+
+		//Note: only the vertices referenced by the faces are bounded
+		const size_t faceNum = m_indices.size() / 3;
+		m_bounding.faceBatchBoxes.resize((faceNum + FACE_BATCH_SIZE - 1) / FACE_BATCH_SIZE);
+		for (size_t f = 0; f < faceNum; ++f)
+		{
+			auto &batchBox = m_bounding.faceBatchBoxes[f / FACE_BATCH_SIZE];
+			batchBox.expand(m_vertices[m_indices[f * 3 + 0]].vpositions);
+			batchBox.expand(m_vertices[m_indices[f * 3 + 1]].vpositions);
+			batchBox.expand(m_vertices[m_indices[f * 3 + 2]].vpositions);
+		}
+		for (const auto &batchBox : m_bounding.faceBatchBoxes)
+		{
+			m_bounding.box.expand(batchBox);
+		}
+
+		if (m_bounding.box.isEmpty())
+			return;
+
+		//Sphere around the center of the box, tighter than the circumsphere of the box
+		m_bounding.sphere.center = m_bounding.box.getCenter();
+		float radius2 = 0.0f;
+		for (const auto &index : m_indices)
+		{
+			const glm::vec3 d = m_vertices[index].vpositions - m_bounding.sphere.center;
+			radius2 = glm::max(radius2, glm::dot(d, d));
+		}
+		m_bounding.sphere.radius = glm::sqrt(radius2);
+	}
+
 	void TRDrawableSubMesh::clear()
 	{
 		std::vector<TRVertex>().swap(m_vertices);
 		std::vector<unsigned int>().swap(m_indices);
+		m_bounding = BoundingVolumes();
 	}
 
 	//----------------------------------------------AssimpImporterWrapper----------------------------------------------
@@ -121,6 +158,7 @@ namespace TinyRenderer
 
 			drawable.setVertices(vertices);
 			drawable.setIndices(indices);
+			drawable.computeBoundingVolumes();
 
 			return drawable;
 		}
@@ -147,6 +185,8 @@ namespace TinyRenderer
 
 	void TRDrawableMesh::importMeshFromFile(const std::string &path, bool generatedMipmap)
 	{
+		TRTraceScope trace("Load mesh", "asset");
+
 		for (auto &drawable : m_drawables)
 		{
 			drawable.clear();
@@ -1,41 +1,328 @@
 #include "TRFrameBuffer.h"
 
 #include <cmath>
+#include <cstring>
+#include <thread>
+#include <iostream>
 #include <algorithm>
 
+#include "glm/gtc/packing.hpp"
+
 #include "TRParallelWrapper.h"
 
+//SIMD resolve and streaming stores of the present target (SSE2 is always available on x86-64)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TR_SIMD_SSE
+#define TR_NON_TEMPORAL_STORE
+#endif
+
 namespace TinyRenderer
 {
-	TRFrameBuffer::TRFrameBuffer(int width, int height)
-		: m_width(width), m_height(height)
+	//----------------------------------------------Color formats----------------------------------------------
+
+	//Encoding, decoding and alpha blending of the texels of the color attachment
+	template<typename Texel>
+	struct TRColorTraits;
+
+	template<>
+	struct TRColorTraits<TRPixelRGBA>
+	{
+		static TRPixelRGBA encode(const glm::vec4 &color)
+		{
+			TRPixelRGBA value;
+			value[0] = static_cast<unsigned char>(color.x * 255);//RED
+			value[1] = static_cast<unsigned char>(color.y * 255);//GREEN
+			value[2] = static_cast<unsigned char>(color.z * 255);//BLUE
+			value[3] = static_cast<unsigned char>(255 * color.w);//ALPHA
+			return value;
+		}
+		static glm::vec4 decode(const TRPixelRGBA &value)
+		{
+			return glm::vec4(value[0], value[1], value[2], value[3]) * (1.0f / 255.0f);
+		}
+		static void blend(TRPixelRGBA &dst, const TRPixelRGBA &value, const float &src_alpha)
+		{
+			const float des_alpha = 1.0f - src_alpha;
+			dst[0] = value[0] * src_alpha + dst[0] * des_alpha;
+			dst[1] = value[1] * src_alpha + dst[1] * des_alpha;
+			dst[2] = value[2] * src_alpha + dst[2] * des_alpha;
+			dst[3] = value[3];
+		}
+	};
+
+	template<>
+	struct TRColorTraits<TRPixelRGBA16F>
+	{
+		static TRPixelRGBA16F encode(const glm::vec4 &color) { return glm::packHalf4x16(color); }
+		static glm::vec4 decode(const TRPixelRGBA16F &value) { return glm::unpackHalf4x16(value); }
+		static void blend(TRPixelRGBA16F &dst, const TRPixelRGBA16F &value, const float &src_alpha)
+		{
+			const glm::vec4 src = decode(value);
+			dst = encode(glm::vec4(glm::mix(glm::vec3(decode(dst)), glm::vec3(src), src_alpha), src.a));
+		}
+	};
+
+	template<>
+	struct TRColorTraits<TRPixelR11G11B10F>
 	{
-		m_depthBuffer.resize(m_width * m_height, 1.0f);
-		m_colorBuffer.resize(m_width * m_height, trBlack);
+		//Note: no sign bit and no alpha channel, the denormals are flushed to zero since
+		//      glm::packF2x11_1x10 doesn't handle them, and the values are clamped to the largest finite one
+		static TRPixelR11G11B10F encode(const glm::vec4 &color)
+		{
+			const glm::vec3 value = glm::clamp(glm::vec3(color), 0.0f, 65000.0f);
+			return glm::packF2x11_1x10(value * glm::step(glm::vec3(6.103515625e-05f), value));
+		}
+		static glm::vec4 decode(const TRPixelR11G11B10F &value) { return glm::vec4(glm::unpackF2x11_1x10(value), 1.0f); }
+		static void blend(TRPixelR11G11B10F &dst, const TRPixelR11G11B10F &value, const float &src_alpha)
+		{
+			dst = encode(glm::vec4(glm::mix(glm::vec3(decode(dst)), glm::vec3(decode(value)), src_alpha), 1.0f));
+		}
+	};
+
+	//----------------------------------------------Depth formats----------------------------------------------
+
+	//Conversion between 1/w and the key of the depth attachment for comparison
+	//Note: the unorm keys are truncated, so decode(key) is never farther than the depth it's converted from,
+	//      which keeps the hierarchical z conservative
+	template<typename Texel>
+	struct TRDepthTraits;
+
+	template<>
+	struct TRDepthTraits<float>
+	{
+		using Key = float;
+		static Key encode(const float &depth, const float &, const float &) { return depth; }
+		static float decode(const Key &key, const float &, const float &) { return key; }
+		static Key load(const float &texel) { return texel; }
+		static float store(const Key &key) { return key; }
+	};
+
+	template<>
+	struct TRDepthTraits<TRPixelD24>
+	{
+		using Key = unsigned int;
+		static constexpr float maxValue = 16777215.0f;
+		static Key encode(const float &depth, const float &offset, const float &scale)
+		{
+			return static_cast<Key>(glm::clamp((depth - offset) * scale, 0.0f, 1.0f) * maxValue);
+		}
+		static float decode(const Key &key, const float &offset, const float &scale)
+		{
+			return key / (maxValue * scale) + offset;
+		}
+		static Key load(const TRPixelD24 &texel) { return texel[0] | (texel[1] << 8) | (texel[2] << 16); }
+		static TRPixelD24 store(const Key &key)
+		{
+			return { { static_cast<unsigned char>(key), static_cast<unsigned char>(key >> 8), static_cast<unsigned char>(key >> 16) } };
+		}
+	};
+
+	template<>
+	struct TRDepthTraits<TRPixelD16>
+	{
+		using Key = unsigned int;
+		static constexpr float maxValue = 65535.0f;
+		static Key encode(const float &depth, const float &offset, const float &scale)
+		{
+			return static_cast<Key>(glm::clamp((depth - offset) * scale, 0.0f, 1.0f) * maxValue);
+		}
+		static float decode(const Key &key, const float &offset, const float &scale)
+		{
+			return key / (maxValue * scale) + offset;
+		}
+		static Key load(const TRPixelD16 &texel) { return texel; }
+		static TRPixelD16 store(const Key &key) { return static_cast<TRPixelD16>(key); }
+	};
+
+	//Note: reversed z, the closer the greater
+	template<typename Key>
+	static inline bool depthTestPassed(const TRDepthCompareMode &mode, const Key &depth, const Key &stored)
+	{
+		switch (mode)
+		{
+		case TRDepthCompareMode::TR_DEPTH_COMPARE_GEQUAL: return depth >= stored;
+		case TRDepthCompareMode::TR_DEPTH_COMPARE_EQUAL: return depth == stored;
+		default: return depth > stored;
+		}
+	}
+
+	//----------------------------------------------TRFrameBuffer----------------------------------------------
+
+	TRFrameBuffer::TRFrameBuffer(int width, int height, int samplingNum, TRFrameBufferLayout layout,
+		TRPixelAddressMode addressMode, TRColorFormat colorFormat, TRDepthFormat depthFormat) : m_width(width),
+		m_height(height), m_samplingNum(samplingNum), m_layout(layout), m_addressMode(addressMode),
+		m_colorFormat(colorFormat), m_depthFormat(depthFormat)
+	{
+		if (!isValidSamplingNum(samplingNum))
+		{
+			std::cerr << "Invalid MSAA sampling number: " << samplingNum << ", fall back to 4" << std::endl;
+			m_samplingNum = 4;
+		}
+
+		//Pixel address mapping
+		m_addressX.resize(m_width);
+		m_addressY.resize(m_height);
+		switch (m_addressMode)
+		{
+		case TRPixelAddressMode::TR_ADDRESS_TILING:
+		{
+			//4x4 tiles: ((y/4) * widthInTiles + x/4) * 16 + (y%4) * 4 + x%4
+			const uint widthInTiles = (m_width + 3) >> 2, heightInTiles = (m_height + 3) >> 2;
+			for (uint x = 0; x < m_width; ++x)
+				m_addressX[x] = ((x >> 2) << 4) + (x & 3);
+			for (uint y = 0; y < m_height; ++y)
+				m_addressY[y] = (((y >> 2) * widthInTiles) << 4) + ((y & 3) << 2);
+			m_numPixels = widthInTiles * heightInTiles * 16;
+			break;
+		}
+		case TRPixelAddressMode::TR_ADDRESS_ZCURVE_TILING:
+		{
+			//32x32 tiles: ((y/32) * widthInTiles + x/32) * 1024 + morton(x%32, y%32)
+			//Note: morton code is separable since the bits of x and y are interleaved
+			auto spreadBits = [](uint v) -> uint
+			{
+				uint r = 0;
+				for (int i = 0; i < 5; ++i)
+					r |= (v & (1u << i)) << i;
+				return r;
+			};
+			const uint widthInTiles = (m_width + 31) >> 5, heightInTiles = (m_height + 31) >> 5;
+			for (uint x = 0; x < m_width; ++x)
+				m_addressX[x] = ((x >> 5) << 10) + spreadBits(x & 31);
+			for (uint y = 0; y < m_height; ++y)
+				m_addressY[y] = (((y >> 5) * widthInTiles) << 10) + (spreadBits(y & 31) << 1);
+			m_numPixels = widthInTiles * heightInTiles * 1024;
+			break;
+		}
+		default:
+		{
+			for (uint x = 0; x < m_width; ++x)
+				m_addressX[x] = x;
+			for (uint y = 0; y < m_height; ++y)
+				m_addressY[y] = y * m_width;
+			m_numPixels = m_width * m_height;
+			break;
+		}
+		}
+
+		if (m_layout == TRFrameBufferLayout::TR_LAYOUT_SAMPLE_PLANES)
+		{
+			//Each plane starts at a cache line (64 bytes) boundary
+			//Note: the stride is shared by the color and depth attachments of any texel size (3 bytes for D24),
+			//      so it's rounded up to 64 texels, which is a multiple of 64 bytes for all of them
+			constexpr size_t alignment = 64;
+			m_pixelStride = 1;
+			m_sampleStride = (m_numPixels + alignment - 1) / alignment * alignment;
+		}
+		else
+		{
+			m_pixelStride = m_samplingNum;
+			m_sampleStride = 1;
+		}
+
+		const size_t numSamples = getSampleIndex(m_numPixels - 1, m_samplingNum - 1) + 1;
+		switch (m_depthFormat)
+		{
+		case TRDepthFormat::TR_DEPTH_UNORM24:
+			m_depthBufferD24.resize(numSamples, TRDepthTraits<TRPixelD24>::store(0));
+			break;
+		case TRDepthFormat::TR_DEPTH_UNORM16:
+			m_depthBufferD16.resize(numSamples, 0);
+			break;
+		default:
+			m_depthBuffer.resize(numSamples, 1.0f);
+			break;
+		}
+		switch (m_colorFormat)
+		{
+		case TRColorFormat::TR_COLOR_RGBA16F:
+			m_colorBufferRGBA16F.resize(numSamples, TRColorTraits<TRPixelRGBA16F>::encode(glm::vec4(0.0f)));
+			break;
+		case TRColorFormat::TR_COLOR_R11G11B10F:
+			m_colorBufferR11G11B10F.resize(numSamples, TRColorTraits<TRPixelR11G11B10F>::encode(glm::vec4(0.0f)));
+			break;
+		default:
+			m_colorBuffer.resize(numSamples, trBlack);
+			break;
+		}
+		m_colorCompressed.resize(m_numPixels, 1);
+
+		m_coarseWidth = (m_width + COARSE_DEPTH_BLOCK_SIZE - 1) / COARSE_DEPTH_BLOCK_SIZE;
+		m_coarseHeight = (m_height + COARSE_DEPTH_BLOCK_SIZE - 1) / COARSE_DEPTH_BLOCK_SIZE;
+		m_coarseDepthBuffer.resize(m_coarseWidth * m_coarseHeight, 1.0f);
+		m_coarseDepthDirty.reset(new std::atomic<unsigned char>[m_coarseWidth * m_coarseHeight]);
+
+		m_depthClearStates.reset(new std::atomic<unsigned char>[m_coarseWidth * m_coarseHeight]);
+		m_colorClearStates.reset(new std::atomic<unsigned char>[m_coarseWidth * m_coarseHeight]);
+		for (uint i = 0; i < m_coarseWidth * m_coarseHeight; ++i)
+		{
+			m_coarseDepthDirty[i].store(0);
+			m_depthClearStates[i].store(BLOCK_MATERIALIZED);
+			m_colorClearStates[i].store(BLOCK_MATERIALIZED);
+		}
+	}
+
+	void TRFrameBuffer::setDepthRange(const float &near, const float &far)
+	{
+		//Note: 1/w is in [1/far, 1/near]
+		m_depthOffset = 1.0f / far;
+		m_depthScale = 1.0f / (1.0f / near - 1.0f / far);
 	}
 
 	float TRFrameBuffer::readDepth(const uint &x, const uint &y, const unsigned int &i) const
 	{
 		if (x >= m_width || y >= m_height)
 			return 0.0f;
+		if (isBlockCleared(m_depthClearStates, getBlockIndex(x, y)))
+			return m_clearDepth;
+		switch (m_depthFormat)
+		{
+		case TRDepthFormat::TR_DEPTH_UNORM24: return readDepth_aux(m_depthBufferD24, getPixelIndex(x, y), i);
+		case TRDepthFormat::TR_DEPTH_UNORM16: return readDepth_aux(m_depthBufferD16, getPixelIndex(x, y), i);
+		default: return readDepth_aux(m_depthBuffer, getPixelIndex(x, y), i);
+		}
+	}
+
+	template<typename Buffer>
+	float TRFrameBuffer::readDepth_aux(const Buffer &buffer, const size_t &pixel, const uint &i) const
+	{
 		//Note: i is the sampling point index
-		return m_depthBuffer[y*m_width + x][i];
+		using Depth = TRDepthTraits<typename Buffer::value_type>;
+		return Depth::decode(Depth::load(buffer[getSampleIndex(pixel, i)]), m_depthOffset, m_depthScale);
 	}
 
 	TRPixelRGBA TRFrameBuffer::readColor(const uint &x, const uint &y, const uint &i) const
 	{
 		if (x >= m_width || y >= m_height)
 			return trBlack;
+		if (isBlockCleared(m_colorClearStates, getBlockIndex(x, y)))
+			return m_clearColor;
 		//Note: i is the sampling point index
-		return m_colorBuffer[y*m_width + x][i];
+		const size_t pixel = getPixelIndex(x, y);
+		const size_t index = getSampleIndex(pixel, m_colorCompressed[pixel] ? 0 : i);
+		switch (m_colorFormat)
+		{
+		case TRColorFormat::TR_COLOR_RGBA16F:
+			return TRColorTraits<TRPixelRGBA>::encode(glm::clamp(
+				TRColorTraits<TRPixelRGBA16F>::decode(m_colorBufferRGBA16F[index]), 0.0f, 1.0f));
+		case TRColorFormat::TR_COLOR_R11G11B10F:
+			return TRColorTraits<TRPixelRGBA>::encode(glm::clamp(
+				TRColorTraits<TRPixelR11G11B10F>::decode(m_colorBufferR11G11B10F[index]), 0.0f, 1.0f));
+		default:
+			return m_colorBuffer[index];
+		}
 	}
 
 	void TRFrameBuffer::clearDepth(const float &depth)
 	{
-		parallelFor((size_t)0, (size_t)(m_width * m_height), [&](const size_t &index)
+		m_clearDepth = depth;
+		for (uint i = 0; i < m_coarseWidth * m_coarseHeight; ++i)
 		{
-			m_depthBuffer[index] = depth;
-		});
+			m_depthClearStates[i].store(BLOCK_CLEARED, std::memory_order_relaxed);
+			m_coarseDepthDirty[i].store(0, std::memory_order_relaxed);
+		}
+		std::fill(m_coarseDepthBuffer.begin(), m_coarseDepthBuffer.end(), depth);
 	}
 
 	void TRFrameBuffer::clearColor(const glm::vec4 &color)
@@ -44,147 +331,950 @@ namespace TinyRenderer
 		unsigned char green = static_cast<unsigned char>(255 * color.y);
 		unsigned char blue = static_cast<unsigned char>(255 * color.z);
 		unsigned char alpha = static_cast<unsigned char>(255 * color.w);
-		TRPixelRGBA clearColor = { red, green, blue, alpha };
+		m_clearColor = { red, green, blue, alpha };
+		m_clearColorValue = color;
 
-		parallelFor((size_t)0, (size_t)(m_width * m_height), [&](const size_t &index)
+		for (uint i = 0; i < m_coarseWidth * m_coarseHeight; ++i)
 		{
-			m_colorBuffer[index] = clearColor;
-		});
+			m_colorClearStates[i].store(BLOCK_CLEARED, std::memory_order_relaxed);
+		}
+		std::fill(m_gBufferPending.begin(), m_gBufferPending.end(), 0);
+		m_gBufferAnyPending.store(false, std::memory_order_relaxed);
 	}
 
 	void TRFrameBuffer::clearColorAndDepth(const glm::vec4 &color, const float &depth)
 	{
-		unsigned char red = static_cast<unsigned char>(255 * color.x);
-		unsigned char green = static_cast<unsigned char>(255 * color.y);
-		unsigned char blue = static_cast<unsigned char>(255 * color.z);
-		unsigned char alpha = static_cast<unsigned char>(255 * color.w);
-		TRPixelRGBA clearColor = { red, green, blue, alpha };
+		clearColor(color);
+		clearDepth(depth);
+	}
 
-		parallelFor((size_t)0, (size_t)(m_width * m_height), [&](const size_t &index)
+	template<typename Fill>
+	void TRFrameBuffer::materializeBlock(const BlockClearStates &states, const uint &block, const Fill &fill)
+	{
+		//Note: the first writer fills the block, the others wait until it's done
+		unsigned char expected = BLOCK_CLEARED;
+		if (states[block].compare_exchange_strong(expected, BLOCK_MATERIALIZING, std::memory_order_acq_rel))
 		{
-			m_depthBuffer[index] = depth;
-			m_colorBuffer[index] = clearColor;
+			const uint bx = (block % m_coarseWidth) * COARSE_DEPTH_BLOCK_SIZE;
+			const uint by = (block / m_coarseWidth) * COARSE_DEPTH_BLOCK_SIZE;
+			const uint ex = std::min(bx + COARSE_DEPTH_BLOCK_SIZE, m_width);
+			const uint ey = std::min(by + COARSE_DEPTH_BLOCK_SIZE, m_height);
+			for (uint y = by; y < ey; ++y)
+			{
+				for (uint x = bx; x < ex; ++x)
+				{
+					fill(getPixelIndex(x, y));
+				}
+			}
+			states[block].store(BLOCK_MATERIALIZED, std::memory_order_release);
+			return;
+		}
+		while (states[block].load(std::memory_order_acquire) != BLOCK_MATERIALIZED)
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	void TRFrameBuffer::materializeDepth(const uint &x, const uint &y)
+	{
+		const uint block = getBlockIndex(x, y);
+		if (!isBlockCleared(m_depthClearStates, block))
+			return;
+		switch (m_depthFormat)
+		{
+		case TRDepthFormat::TR_DEPTH_UNORM24: materializeDepth_aux(m_depthBufferD24, block); break;
+		case TRDepthFormat::TR_DEPTH_UNORM16: materializeDepth_aux(m_depthBufferD16, block); break;
+		default: materializeDepth_aux(m_depthBuffer, block); break;
+		}
+	}
+
+	template<typename Buffer>
+	void TRFrameBuffer::materializeDepth_aux(Buffer &buffer, const uint &block)
+	{
+		using Depth = TRDepthTraits<typename Buffer::value_type>;
+		const auto value = Depth::store(Depth::encode(m_clearDepth, m_depthOffset, m_depthScale));
+		materializeBlock(m_depthClearStates, block, [&](const size_t &pixel)
+		{
+			for (uint s = 0; s < m_samplingNum; ++s)
+			{
+				buffer[getSampleIndex(pixel, s)] = value;
+			}
 		});
 	}
 
+	void TRFrameBuffer::materializeColor(const uint &x, const uint &y)
+	{
+		const uint block = getBlockIndex(x, y);
+		if (!isBlockCleared(m_colorClearStates, block))
+			return;
+		//Note: the cleared pixels are compressed
+		switch (m_colorFormat)
+		{
+		case TRColorFormat::TR_COLOR_RGBA16F:
+		{
+			const TRPixelRGBA16F value = TRColorTraits<TRPixelRGBA16F>::encode(m_clearColorValue);
+			materializeBlock(m_colorClearStates, block, [&](const size_t &pixel)
+			{
+				m_colorBufferRGBA16F[getSampleIndex(pixel, 0)] = value;
+				m_colorCompressed[pixel] = 1;
+			});
+			break;
+		}
+		case TRColorFormat::TR_COLOR_R11G11B10F:
+		{
+			const TRPixelR11G11B10F value = TRColorTraits<TRPixelR11G11B10F>::encode(m_clearColorValue);
+			materializeBlock(m_colorClearStates, block, [&](const size_t &pixel)
+			{
+				m_colorBufferR11G11B10F[getSampleIndex(pixel, 0)] = value;
+				m_colorCompressed[pixel] = 1;
+			});
+			break;
+		}
+		default:
+			materializeBlock(m_colorClearStates, block, [&](const size_t &pixel)
+			{
+				m_colorBuffer[getSampleIndex(pixel, 0)] = m_clearColor;
+				m_colorCompressed[pixel] = 1;
+			});
+			break;
+		}
+	}
+
 	void TRFrameBuffer::writeDepth(const uint &x, const uint &y, const uint &i, const float &value)
 	{
 		if (x >= m_width || y >= m_height)
 			return;
+		materializeDepth(x, y);
+		switch (m_depthFormat)
+		{
+		case TRDepthFormat::TR_DEPTH_UNORM24: writeDepth_aux(m_depthBufferD24, getPixelIndex(x, y), i, value); break;
+		case TRDepthFormat::TR_DEPTH_UNORM16: writeDepth_aux(m_depthBufferD16, getPixelIndex(x, y), i, value); break;
+		default: writeDepth_aux(m_depthBuffer, getPixelIndex(x, y), i, value); break;
+		}
+		markCoarseDepthDirty(x, y);
+	}
+
+	template<typename Buffer>
+	void TRFrameBuffer::writeDepth_aux(Buffer &buffer, const size_t &pixel, const uint &i, const float &value)
+	{
 		//Note: i is the sampling point index
-		m_depthBuffer[y * m_width + x][i] = value;
+		using Depth = TRDepthTraits<typename Buffer::value_type>;
+		buffer[getSampleIndex(pixel, i)] = Depth::store(Depth::encode(value, m_depthOffset, m_depthScale));
 	}
 
 	void TRFrameBuffer::writeColor(const uint &x, const uint &y, const uint &i, const glm::vec4 &color)
 	{
 		if (x >= m_width || y >= m_height)
 			return;
+		materializeColor(x, y);
+		switch (m_colorFormat)
+		{
+		case TRColorFormat::TR_COLOR_RGBA16F: writeColor_aux(m_colorBufferRGBA16F, getPixelIndex(x, y), i, color); break;
+		case TRColorFormat::TR_COLOR_R11G11B10F: writeColor_aux(m_colorBufferR11G11B10F, getPixelIndex(x, y), i, color); break;
+		default: writeColor_aux(m_colorBuffer, getPixelIndex(x, y), i, color); break;
+		}
+	}
+
+	template<typename Buffer>
+	void TRFrameBuffer::writeColor_aux(Buffer &buffer, const size_t &pixel, const uint &i, const glm::vec4 &color)
+	{
 		//Note: i is the sampling point index
-		TRPixelRGBA value;
-		value[0] = static_cast<unsigned char>(color.x * 255);//RED
-		value[1] = static_cast<unsigned char>(color.y * 255);//GREEN
-		value[2] = static_cast<unsigned char>(color.z * 255);//BLUE
-		value[3] = static_cast<unsigned char>(glm::min(255 * color.w, 255.0f));//ALPHA
-		int index = y * m_width + x;
-		m_colorBuffer[index][i] = value;
+		using Texel = typename Buffer::value_type;
+		decompressColor(buffer, pixel);
+		buffer[getSampleIndex(pixel, i)] = TRColorTraits<Texel>::encode(glm::vec4(glm::vec3(color), glm::min(color.w, 1.0f)));
 	}
 
-	void TRFrameBuffer::writeColorWithMask(const uint &x, const uint &y, const glm::vec4 &color, const TRMaskPixelSampler &mask)
+	template<int N>
+	void TRFrameBuffer::writeColorWithMask(const uint &x, const uint &y, const glm::vec4 &color, const TRMaskPixelSampler<N> &mask)
 	{
 		if (x >= m_width || y >= m_height)
 			return;
-		TRPixelRGBA value;
-		value[0] = static_cast<unsigned char>(color.x * 255);//RED
-		value[1] = static_cast<unsigned char>(color.y * 255);//GREEN
-		value[2] = static_cast<unsigned char>(color.z * 255);//BLUE
-		value[3] = static_cast<unsigned char>(255 * color.w);//ALPHA
+		materializeColor(x, y);
+		switch (m_colorFormat)
+		{
+		case TRColorFormat::TR_COLOR_RGBA16F: writeColorWithMask_aux<N>(m_colorBufferRGBA16F, getPixelIndex(x, y), color, mask); break;
+		case TRColorFormat::TR_COLOR_R11G11B10F: writeColorWithMask_aux<N>(m_colorBufferR11G11B10F, getPixelIndex(x, y), color, mask); break;
+		default: writeColorWithMask_aux<N>(m_colorBuffer, getPixelIndex(x, y), color, mask); break;
+		}
+	}
+
+	template<int N, typename Buffer>
+	void TRFrameBuffer::writeColorWithMask_aux(Buffer &buffer, const size_t &pixel, const glm::vec4 &color, const TRMaskPixelSampler<N> &mask)
+	{
+		using Texel = typename Buffer::value_type;
+		const Texel value = TRColorTraits<Texel>::encode(color);
+
+		const size_t index = pixel * m_pixelStride;
+		if (isFullyCovered<N>(mask))
+		{
+			//Store the color once for the whole pixel
+			buffer[index] = value;
+			m_colorCompressed[pixel] = 1;
+			return;
+		}
 
-		int index = y * m_width + x;
+		decompressColor(buffer, pixel);
 		//Only write color if the corresponding mask equals to 1
 #pragma unroll
-		for (int s = 0; s < mask.getSamplingNum(); ++s)
+		for (int s = 0; s < N; ++s)
 		{
 			if (mask[s] == 1)
 			{
-				m_colorBuffer[index][s] = value;
+				buffer[index + s * m_sampleStride] = value;
 			}
 		}
 	}
 
-	void TRFrameBuffer::writeColorWithMaskAlphaBlending(const uint &x, const uint &y, const glm::vec4 &color, const TRMaskPixelSampler &mask)
+	template<int N>
+	void TRFrameBuffer::writeColorWithMaskAlphaBlending(const uint &x, const uint &y, const glm::vec4 &color, const TRMaskPixelSampler<N> &mask)
 	{
 		if (x >= m_width || y >= m_height)
 			return;
-		TRPixelRGBA value;
-		value[0] = static_cast<unsigned char>(color.x * 255);//RED
-		value[1] = static_cast<unsigned char>(color.y * 255);//GREEN
-		value[2] = static_cast<unsigned char>(color.z * 255);//BLUE
-		value[3] = static_cast<unsigned char>(255 * color.w);//ALPHA
+		materializeColor(x, y);
+		switch (m_colorFormat)
+		{
+		case TRColorFormat::TR_COLOR_RGBA16F: writeColorWithMaskAlphaBlending_aux<N>(m_colorBufferRGBA16F, getPixelIndex(x, y), color, mask); break;
+		case TRColorFormat::TR_COLOR_R11G11B10F: writeColorWithMaskAlphaBlending_aux<N>(m_colorBufferR11G11B10F, getPixelIndex(x, y), color, mask); break;
+		default: writeColorWithMaskAlphaBlending_aux<N>(m_colorBuffer, getPixelIndex(x, y), color, mask); break;
+		}
+	}
+
+	template<int N, typename Buffer>
+	void TRFrameBuffer::writeColorWithMaskAlphaBlending_aux(Buffer &buffer, const size_t &pixel, const glm::vec4 &color, const TRMaskPixelSampler<N> &mask)
+	{
+		using Texel = typename Buffer::value_type;
+		const Texel value = TRColorTraits<Texel>::encode(color);
 
 		//For alpha blending
 		const float src_alpha = color.a;
-		const float des_alpha = 1.0f - src_alpha;
 
-		int index = y * m_width + x;
+		const size_t index = pixel * m_pixelStride;
+		if (m_colorCompressed[pixel] && isFullyCovered<N>(mask))
+		{
+			//Blend the shared color only, the pixel stays compressed
+			TRColorTraits<Texel>::blend(buffer[index], value, src_alpha);
+			return;
+		}
+
+		decompressColor(buffer, pixel);
 		//Only write color if the corresponding mask equals to 1
 #pragma unroll
-		for (int s = 0; s < mask.getSamplingNum(); ++s)
+		for (int s = 0; s < N; ++s)
 		{
 			if (mask[s] == 1)
 			{
-				m_colorBuffer[index][s][0] = value[0] * src_alpha + m_colorBuffer[index][s][0] * des_alpha;
-				m_colorBuffer[index][s][1] = value[1] * src_alpha + m_colorBuffer[index][s][1] * des_alpha;
-				m_colorBuffer[index][s][2] = value[2] * src_alpha + m_colorBuffer[index][s][2] * des_alpha;
-				m_colorBuffer[index][s][3] = value[3];
+				TRColorTraits<Texel>::blend(buffer[index + s * m_sampleStride], value, src_alpha);
 			}
 		}
 	}
 
-	void TRFrameBuffer::writeDepthWithMask(const uint &x, const uint &y, const TRDepthPixelSampler &depth, const TRMaskPixelSampler &mask)
+	template<int N, TRDepthFormat Format>
+	void TRFrameBuffer::writeDepthWithMask(const uint &x, const uint &y, const TRDepthPixelSampler<N> &depth, const TRMaskPixelSampler<N> &mask)
 	{
 		if (x >= m_width || y >= m_height)
 			return;
-		int index = y * m_width + x;
+		auto &buffer = depthAttachment(DepthFormatTag<Format>());
+		const uint block = getBlockIndex(x, y);
+		if (isBlockCleared(m_depthClearStates, block))
+			materializeDepth_aux(buffer, block);
+		writeDepthWithMask_aux<N>(buffer, getPixelIndex(x, y), depth, mask);
+		markCoarseDepthDirty(x, y);
+	}
+
+	template<int N, typename Buffer>
+	void TRFrameBuffer::writeDepthWithMask_aux(Buffer &buffer, const size_t &pixel, const TRDepthPixelSampler<N> &depth, const TRMaskPixelSampler<N> &mask)
+	{
+		using Depth = TRDepthTraits<typename Buffer::value_type>;
+		const size_t index = pixel * m_pixelStride;
 		//Only write depth if the corresponding mask equals to 1
 #pragma unroll
-		for (int s = 0; s < mask.getSamplingNum(); ++s)
+		for (int s = 0; s < N; ++s)
 		{
 			if (mask[s] == 1)
 			{
-				m_depthBuffer[index][s] = depth[s];
+				buffer[index + s * m_sampleStride] = Depth::store(Depth::encode(depth[s], m_depthOffset, m_depthScale));
+			}
+		}
+	}
+
+	template<int N, TRDepthFormat Format>
+	void TRFrameBuffer::depthTestWithMask(const uint &x, const uint &y, const TRDepthPixelSampler<N> &depth,
+		const TRDepthCompareMode &mode, TRMaskPixelSampler<N> &mask) const
+	{
+		if (x >= m_width || y >= m_height)
+			return;
+		depthTestWithMask_aux<N>(depthAttachment(DepthFormatTag<Format>()), x, y, depth, mode, mask);
+	}
+
+	template<int N, typename Buffer>
+	void TRFrameBuffer::depthTestWithMask_aux(const Buffer &buffer, const uint &x, const uint &y, const TRDepthPixelSampler<N> &depth,
+		const TRDepthCompareMode &mode, TRMaskPixelSampler<N> &mask) const
+	{
+		using Depth = TRDepthTraits<typename Buffer::value_type>;
+		const size_t index = getPixelIndex(x, y) * m_pixelStride;
+		const bool cleared = isBlockCleared(m_depthClearStates, getBlockIndex(x, y));
+		const auto clearValue = Depth::encode(m_clearDepth, m_depthOffset, m_depthScale);
+#pragma unroll
+		for (int s = 0; s < N; ++s)
+		{
+			if (mask[s] == 0)
+				continue;
+			const auto stored = cleared ? clearValue : Depth::load(buffer[index + s * m_sampleStride]);
+			if (!depthTestPassed(mode, Depth::encode(depth[s], m_depthOffset, m_depthScale), stored))
+			{
+				mask[s] = 0;//Occuluded
 			}
 		}
 	}
 
-	const TRColorBuffer &TRFrameBuffer::resolve()
+	void TRFrameBuffer::updateCoarseDepth()
+	{
+		switch (m_depthFormat)
+		{
+		case TRDepthFormat::TR_DEPTH_UNORM24: updateCoarseDepth(m_depthBufferD24); break;
+		case TRDepthFormat::TR_DEPTH_UNORM16: updateCoarseDepth(m_depthBufferD16); break;
+		default: updateCoarseDepth(m_depthBuffer); break;
+		}
+	}
+
+	template<typename Buffer>
+	void TRFrameBuffer::updateCoarseDepth(const Buffer &buffer)
+	{
+		switch (m_samplingNum)
+		{
+		case 1: updateCoarseDepth_aux<1>(buffer); break;
+		case 2: updateCoarseDepth_aux<2>(buffer); break;
+		case 8: updateCoarseDepth_aux<8>(buffer); break;
+		default: updateCoarseDepth_aux<4>(buffer); break;
+		}
+	}
+
+	template<int N, typename Buffer>
+	void TRFrameBuffer::updateCoarseDepth_aux(const Buffer &buffer)
+	{
+		//Recompute the farthest depth of those blocks whose depth had been written
+		using Depth = TRDepthTraits<typename Buffer::value_type>;
+		parallelFor((size_t)0, (size_t)(m_coarseWidth * m_coarseHeight), [&](const size_t &index)
+		{
+			if (m_coarseDepthDirty[index].load(std::memory_order_relaxed) == 0)
+				return;
+			m_coarseDepthDirty[index].store(0, std::memory_order_relaxed);
+
+			const uint bx = (index % m_coarseWidth) * COARSE_DEPTH_BLOCK_SIZE;
+			const uint by = (index / m_coarseWidth) * COARSE_DEPTH_BLOCK_SIZE;
+			const uint ex = std::min(bx + COARSE_DEPTH_BLOCK_SIZE, m_width);
+			const uint ey = std::min(by + COARSE_DEPTH_BLOCK_SIZE, m_height);
+			auto farthest = Depth::load(buffer[getSampleIndex(getPixelIndex(bx, by), 0)]);
+#pragma unroll
+			for (int s = 0; s < N; ++s)
+			{
+				const auto *depth = &buffer[getSampleIndex(0, s)];
+				for (uint y = by; y < ey; ++y)
+				{
+					for (uint x = bx; x < ex; ++x)
+					{
+						farthest = std::min(farthest, Depth::load(depth[getPixelIndex(x, y) * m_pixelStride]));
+					}
+				}
+			}
+			m_coarseDepthBuffer[index] = Depth::decode(farthest, m_depthOffset, m_depthScale);
+		});
+	}
+
+	void TRFrameBuffer::createGBuffer()
+	{
+		if (hasGBuffer())
+			return;
+		m_gBuffer.resize(m_width * m_height);
+		m_gBufferPending.resize(m_width * m_height, 0);
+	}
+
+	void TRFrameBuffer::writeGBuffer(const uint &x, const uint &y, const TRGBufferTexel &texel)
+	{
+		if (x >= m_width || y >= m_height)
+			return;
+		int index = y * m_width + x;
+		m_gBuffer[index] = texel;
+		m_gBufferPending[index] = 1;
+		if (!m_gBufferAnyPending.load(std::memory_order_relaxed))
+			m_gBufferAnyPending.store(true, std::memory_order_relaxed);
+	}
+
+	void TRFrameBuffer::resolve(std::vector<unsigned char> &image) const
+	{
+		image.resize(m_width * m_height * 3);
+		TRPresentTarget target;
+		target.pixels = image.data();
+		target.pitch = m_width * 3;
+		target.format = TRPresentFormat::TR_PRESENT_RGB8;
+		resolve(target);
+	}
+
+	void TRFrameBuffer::resolve(const TRPresentTarget &target) const
+	{
+		if (target.pixels == nullptr)
+			return;
+
+		switch (m_colorFormat)
+		{
+		case TRColorFormat::TR_COLOR_RGBA16F: resolveHDR(m_colorBufferRGBA16F, target); return;
+		case TRColorFormat::TR_COLOR_R11G11B10F: resolveHDR(m_colorBufferR11G11B10F, target); return;
+		default: break;
+		}
+
+		//Tone mapping and gamma encoding only depend on the resolved value of each channel,
+		//so they're precomputed for all the 256 values
+		float encodef[256];
+		unsigned char encode[256];
+		for (int c = 0; c < 256; ++c)
+		{
+			float value = c / 255.0f;
+			if (target.toneMapping)
+				value = 1.0f - std::exp(-value * target.exposure);
+			if (target.gammaCorrection)
+				value = std::pow(value, 1.0f / 2.2f);
+			encodef[c] = value;
+			encode[c] = static_cast<unsigned char>(glm::clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f);
+		}
+		const bool identity = !target.toneMapping && !target.gammaCorrection;
+
+		switch (m_samplingNum)
+		{
+		case 1: resolve_aux<1>(target, identity ? nullptr : encode, encodef); break;
+		case 2: resolve_aux<2>(target, identity ? nullptr : encode, encodef); break;
+		case 8: resolve_aux<8>(target, identity ? nullptr : encode, encodef); break;
+		default: resolve_aux<4>(target, identity ? nullptr : encode, encodef); break;
+		}
+	}
+
+	template<typename Buffer>
+	void TRFrameBuffer::resolveHDR(const Buffer &buffer, const TRPresentTarget &target) const
+	{
+		switch (m_samplingNum)
+		{
+		case 1: resolveHDR_aux<1>(buffer, target); break;
+		case 2: resolveHDR_aux<2>(buffer, target); break;
+		case 8: resolveHDR_aux<8>(buffer, target); break;
+		default: resolveHDR_aux<4>(buffer, target); break;
+		}
+	}
+
+#ifdef TR_SIMD_SSE
+	//The shift dividing the sum of N sampling points by N
+	template<int N>
+	struct TRSamplingShift { static constexpr int value = N == 1 ? 0 : N == 2 ? 1 : N == 4 ? 2 : 3; };
+
+	//Sums of the N contiguous sampling points of two pixels: the 16-bit channels of p0 in the lower half, of p1 in the upper one
+	template<int N>
+	static inline __m128i sumSamples2(const TRPixelRGBA *p0, const TRPixelRGBA *p1)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		if (N == 1)
+		{
+			int bits0, bits1;
+			std::memcpy(&bits0, p0, 4);
+			std::memcpy(&bits1, p1, 4);
+			return _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(bits0), _mm_cvtsi32_si128(bits1)), zero);
+		}
+		if (N == 2)
+		{
+			const __m128i samples = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p0)),
+				_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p1)));
+			const __m128i lo = _mm_unpacklo_epi8(samples, zero);
+			const __m128i hi = _mm_unpackhi_epi8(samples, zero);
+			return _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+		}
+		//Note: 4 sampling points per 16 bytes, the even and odd ones are summed in the two halves
+		__m128i sum0 = zero, sum1 = zero;
+#pragma unroll
+		for (int s = 0; s < N; s += 4)
+		{
+			const __m128i samples0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p0 + s));
+			const __m128i samples1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p1 + s));
+			sum0 = _mm_add_epi16(sum0, _mm_add_epi16(_mm_unpacklo_epi8(samples0, zero), _mm_unpackhi_epi8(samples0, zero)));
+			sum1 = _mm_add_epi16(sum1, _mm_add_epi16(_mm_unpacklo_epi8(samples1, zero), _mm_unpackhi_epi8(samples1, zero)));
+		}
+		return _mm_add_epi16(_mm_unpacklo_epi64(sum0, sum1), _mm_unpackhi_epi64(sum0, sum1));
+	}
+
+	//Swap the red and blue channels of 4 RGBA8 pixels
+	static inline __m128i swizzleBGRA(const __m128i &rgba)
+	{
+		const __m128i mask = _mm_set1_epi32(0x000000FF);
+		const __m128i red = _mm_and_si128(rgba, mask);
+		const __m128i blue = _mm_and_si128(_mm_srli_epi32(rgba, 16), mask);
+		return _mm_or_si128(_mm_and_si128(rgba, _mm_set1_epi32(0xFF00FF00)), _mm_or_si128(_mm_slli_epi32(red, 16), blue));
+	}
+
+	//Drop the alpha channel of 4 RGBA8 pixels: the 12 bytes of RGB at the bottom, followed by zeros
+	static inline __m128i packRGB(const __m128i &rgba)
+	{
+		//Two pixels of each 64-bit lane -> 6 bytes at the bottom of the lane
+		const __m128i lanes = _mm_or_si128(_mm_and_si128(rgba, _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF)),
+			_mm_and_si128(_mm_srli_epi64(rgba, 8), _mm_set_epi32(0x0000FFFF, (int)0xFF000000, 0x0000FFFF, (int)0xFF000000)));
+		//The upper lane is moved right after the lower one
+		return _mm_or_si128(_mm_move_epi64(lanes), _mm_slli_si128(_mm_srli_si128(lanes, 8), 6));
+	}
+#endif
+
+	static inline bool isAligned(const void *ptr, const size_t &alignment)
+	{
+		return (reinterpret_cast<size_t>(ptr) & (alignment - 1)) == 0;
+	}
+
+	//Store a pixel of the RGBA8/BGRA8 target, bypassing the cache if possible
+	static inline void storePixel(unsigned char *dst, const TRPixelRGBA &pixel, const bool &bgra)
+	{
+		const unsigned char value[4] = { pixel[bgra ? 2 : 0], pixel[1], pixel[bgra ? 0 : 2], pixel[3] };
+#ifdef TR_NON_TEMPORAL_STORE
+		if (isAligned(dst, 4))
+		{
+			int bits;
+			std::memcpy(&bits, value, 4);
+			_mm_stream_si32(reinterpret_cast<int*>(dst), bits);
+			return;
+		}
+#endif
+		std::memcpy(dst, value, 4);
+	}
+
+	//Convert a resolved row of pixels to the format of the target
+	//Note: the 8-bit targets are streamed in 16-byte chunks bypassing the cache, since the present target
+	//      is not read back by us. The unaligned head and tail of the row are stored pixel by pixel.
+	//      encodef maps the 8-bit colors to the floats of TR_PRESENT_RGB32F
+	static void storeRow(const TRPresentTarget &target, const uint &y, const uint &bx, const uint &num,
+		const TRPixelRGBA *row, const float *encodef)
+	{
+		unsigned char *dst = static_cast<unsigned char*>(target.pixels) + y * target.pitch;
+		uint i = 0;
+		switch (target.format)
+		{
+		case TRPresentFormat::TR_PRESENT_RGB8:
+			dst += bx * 3;
+#ifdef TR_NON_TEMPORAL_STORE
+			//Note: 16 pixels -> 48 bytes, three chunks
+			for (; i < num && !isAligned(dst, 16); ++i, dst += 3)
+			{
+				dst[0] = row[i][0];
+				dst[1] = row[i][1];
+				dst[2] = row[i][2];
+			}
+			for (; i + 16 <= num; i += 16, dst += 48)
+			{
+				const __m128i *src = reinterpret_cast<const __m128i*>(row + i);
+				const __m128i rgb0 = packRGB(_mm_loadu_si128(src + 0));
+				const __m128i rgb1 = packRGB(_mm_loadu_si128(src + 1));
+				const __m128i rgb2 = packRGB(_mm_loadu_si128(src + 2));
+				const __m128i rgb3 = packRGB(_mm_loadu_si128(src + 3));
+				__m128i *chunks = reinterpret_cast<__m128i*>(dst);
+				_mm_stream_si128(chunks + 0, _mm_or_si128(rgb0, _mm_slli_si128(rgb1, 12)));
+				_mm_stream_si128(chunks + 1, _mm_or_si128(_mm_srli_si128(rgb1, 4), _mm_slli_si128(rgb2, 8)));
+				_mm_stream_si128(chunks + 2, _mm_or_si128(_mm_srli_si128(rgb2, 8), _mm_slli_si128(rgb3, 4)));
+			}
+#endif
+			for (; i < num; ++i, dst += 3)
+			{
+				dst[0] = row[i][0];
+				dst[1] = row[i][1];
+				dst[2] = row[i][2];
+			}
+			break;
+		case TRPresentFormat::TR_PRESENT_RGBA8:
+		case TRPresentFormat::TR_PRESENT_BGRA8:
+		{
+			dst += bx * 4;
+			const bool bgra = target.format == TRPresentFormat::TR_PRESENT_BGRA8;
+#ifdef TR_NON_TEMPORAL_STORE
+			//Note: 4 pixels -> 16 bytes, a chunk
+			for (; i < num && !isAligned(dst, 16); ++i, dst += 4)
+			{
+				storePixel(dst, row[i], bgra);
+			}
+			for (; i + 4 <= num; i += 4, dst += 16)
+			{
+				const __m128i rgba = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+				_mm_stream_si128(reinterpret_cast<__m128i*>(dst), bgra ? swizzleBGRA(rgba) : rgba);
+			}
+#endif
+			for (; i < num; ++i, dst += 4)
+			{
+				storePixel(dst, row[i], bgra);
+			}
+			break;
+		}
+		case TRPresentFormat::TR_PRESENT_RGB32F:
+		{
+			float *dstf = reinterpret_cast<float*>(dst) + bx * 3;
+			for (; i < num; ++i, dstf += 3)
+			{
+				dstf[0] = encodef[row[i][0]];
+				dstf[1] = encodef[row[i][1]];
+				dstf[2] = encodef[row[i][2]];
+			}
+			break;
+		}
+		}
+	}
+
+	template<int N>
+	void TRFrameBuffer::resolveRow(const uint &y, const uint &bx, const uint &ex, TRPixelRGBA *row) const
+	{
+		//Interleaved: the sampling points of each pixel are contiguous
+		const uint num = ex - bx;
+		size_t pixels[COARSE_DEPTH_BLOCK_SIZE];
+		bool compressed = true;
+		for (uint i = 0; i < num; ++i)
+		{
+			pixels[i] = getPixelIndex(bx + i, y);
+			compressed = compressed && m_colorCompressed[pixels[i]];
+		}
+
+		if (!compressed)
+		{
+			uint i = 0;
+#ifdef TR_SIMD_SSE
+			//Average the sampling colors of 4 pixels at once
+			constexpr int shift = TRSamplingShift<N>::value;
+			for (; i + 4 <= num; i += 4)
+			{
+				const __m128i sum01 = sumSamples2<N>(&m_colorBuffer[getSampleIndex(pixels[i + 0], 0)],
+					&m_colorBuffer[getSampleIndex(pixels[i + 1], 0)]);
+				const __m128i sum23 = sumSamples2<N>(&m_colorBuffer[getSampleIndex(pixels[i + 2], 0)],
+					&m_colorBuffer[getSampleIndex(pixels[i + 3], 0)]);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(row + i),
+					_mm_packus_epi16(_mm_srli_epi16(sum01, shift), _mm_srli_epi16(sum23, shift)));
+			}
+#endif
+			for (; i < num; ++i)
+			{
+				//Average the sampling color of the pixel
+				unsigned short sum[4] = { 0 };
+#pragma unroll
+				for (int s = 0; s < N; ++s)
+				{
+					const auto &sample = m_colorBuffer[getSampleIndex(pixels[i], s)];
+					sum[0] += sample[0];//RED
+					sum[1] += sample[1];//GREEN
+					sum[2] += sample[2];//BLUE
+					sum[3] += sample[3];//ALPHA
+				}
+				row[i][0] = static_cast<unsigned char>(sum[0] / N);
+				row[i][1] = static_cast<unsigned char>(sum[1] / N);
+				row[i][2] = static_cast<unsigned char>(sum[2] / N);
+				row[i][3] = static_cast<unsigned char>(sum[3] / N);
+			}
+		}
+
+		//Note: the other sampling points of the compressed pixels are stale
+		for (uint i = 0; i < num; ++i)
+		{
+			if (m_colorCompressed[pixels[i]])
+				row[i] = m_colorBuffer[getSampleIndex(pixels[i], 0)];
+		}
+	}
+
+	template<int N>
+	void TRFrameBuffer::resolveRowPlanes(const uint &y, const uint &bx, const uint &ex, TRPixelRGBA *row) const
+	{
+		//Sample planes: each plane is walked along the row of the block, which is contiguous in the plane
+		//for the linear pixel addresses (and inside a tile for the tiled ones)
+		const uint num = ex - bx;
+		size_t pixels[COARSE_DEPTH_BLOCK_SIZE];
+		bool compressed = true;
+		for (uint i = 0; i < num; ++i)
+		{
+			pixels[i] = getPixelIndex(bx + i, y);
+			compressed = compressed && m_colorCompressed[pixels[i]];
+		}
+
+		//Note: the other planes of the compressed pixels are stale, so a fully compressed row reads the first plane only
+		const TRPixelRGBA *plane0 = &m_colorBuffer[getSampleIndex(0, 0)];
+		if (compressed)
+		{
+			for (uint i = 0; i < num; ++i)
+			{
+				row[i] = plane0[pixels[i]];
+			}
+			return;
+		}
+
+		//Note: the channels are accumulated plane by plane, as a flat array if the row is contiguous (linear addresses)
+		const bool contiguous = pixels[num - 1] - pixels[0] == num - 1;
+#ifdef TR_SIMD_SSE
+		static_assert(COARSE_DEPTH_BLOCK_SIZE == 8, "A row of the block is 32 bytes of a plane");
+		if (contiguous && num == COARSE_DEPTH_BLOCK_SIZE)
+		{
+			const __m128i zero = _mm_setzero_si128();
+			__m128i sum0 = zero, sum1 = zero, sum2 = zero, sum3 = zero;
+#pragma unroll
+			for (int s = 0; s < N; ++s)
+			{
+				const __m128i *channels = reinterpret_cast<const __m128i*>(&m_colorBuffer[getSampleIndex(pixels[0], s)]);
+				const __m128i lo = _mm_loadu_si128(channels + 0);
+				const __m128i hi = _mm_loadu_si128(channels + 1);
+				sum0 = _mm_add_epi16(sum0, _mm_unpacklo_epi8(lo, zero));
+				sum1 = _mm_add_epi16(sum1, _mm_unpackhi_epi8(lo, zero));
+				sum2 = _mm_add_epi16(sum2, _mm_unpacklo_epi8(hi, zero));
+				sum3 = _mm_add_epi16(sum3, _mm_unpackhi_epi8(hi, zero));
+			}
+			constexpr int shift = TRSamplingShift<N>::value;
+			__m128i *dst = reinterpret_cast<__m128i*>(row);
+			_mm_storeu_si128(dst + 0, _mm_packus_epi16(_mm_srli_epi16(sum0, shift), _mm_srli_epi16(sum1, shift)));
+			_mm_storeu_si128(dst + 1, _mm_packus_epi16(_mm_srli_epi16(sum2, shift), _mm_srli_epi16(sum3, shift)));
+			for (uint i = 0; i < num; ++i)
+			{
+				if (m_colorCompressed[pixels[i]])
+					row[i] = plane0[pixels[i]];
+			}
+			return;
+		}
+#endif
+		unsigned short sum[COARSE_DEPTH_BLOCK_SIZE * 4] = { 0 };
+#pragma unroll
+		for (int s = 0; s < N; ++s)
+		{
+			const TRPixelRGBA *plane = &m_colorBuffer[getSampleIndex(0, s)];
+			if (contiguous)
+			{
+				const unsigned char *channels = plane[pixels[0]].data();
+				for (uint c = 0; c < num * 4; ++c)
+				{
+					sum[c] += channels[c];
+				}
+				continue;
+			}
+			for (uint i = 0; i < num; ++i)
+			{
+				const auto &sample = plane[pixels[i]];
+				sum[i * 4 + 0] += sample[0];//RED
+				sum[i * 4 + 1] += sample[1];//GREEN
+				sum[i * 4 + 2] += sample[2];//BLUE
+				sum[i * 4 + 3] += sample[3];//ALPHA
+			}
+		}
+		for (uint i = 0; i < num; ++i)
+		{
+			if (m_colorCompressed[pixels[i]])
+			{
+				row[i] = plane0[pixels[i]];
+				continue;
+			}
+			row[i][0] = static_cast<unsigned char>(sum[i * 4 + 0] / N);
+			row[i][1] = static_cast<unsigned char>(sum[i * 4 + 1] / N);
+			row[i][2] = static_cast<unsigned char>(sum[i * 4 + 2] / N);
+			row[i][3] = static_cast<unsigned char>(sum[i * 4 + 3] / N);
+		}
+	}
+
+	template<int N>
+	void TRFrameBuffer::resolve_aux(const TRPresentTarget &target, const unsigned char *encode, const float *encodef) const
 	{
 		//MSAA Resolve according to coverage mask
 		//Refs: http://www.zwqxin.com/archives/opengl/talk-about-alpha-to-coverage.html
-		parallelFor((size_t)0, (size_t)(m_width * m_height), [&](const size_t &index)
+		//Note: a task resolves a row of blocks scanline by scanline, the blocks flagged as cleared and 
+		//      the compressed pixels are already resolved, i.e. only the pixels on the edges are averaged.
+		//      Each scanline is stored at once, so that it's streamed to the target in 16-byte chunks.
+		const bool planes = m_layout == TRFrameBufferLayout::TR_LAYOUT_SAMPLE_PLANES;
+		parallelFor((size_t)0, (size_t)m_coarseHeight, [&](const size_t &blockRow)
+		{
+			const uint by = blockRow * COARSE_DEPTH_BLOCK_SIZE;
+			const uint ey = std::min(by + COARSE_DEPTH_BLOCK_SIZE, m_height);
+			std::vector<TRPixelRGBA> row(m_width);
+			for (uint y = by; y < ey; ++y)
+			{
+				//Resolve the rows of the blocks
+				for (uint b = 0; b < m_coarseWidth; ++b)
+				{
+					const uint bx = b * COARSE_DEPTH_BLOCK_SIZE;
+					const uint ex = std::min(bx + COARSE_DEPTH_BLOCK_SIZE, m_width);
+					if (isBlockCleared(m_colorClearStates, blockRow * m_coarseWidth + b))
+						std::fill(row.begin() + bx, row.begin() + ex, m_clearColor);
+					else if (planes)
+						resolveRowPlanes<N>(y, bx, ex, &row[bx]);
+					else
+						resolveRow<N>(y, bx, ex, &row[bx]);
+				}
+
+				//Tone mapping & gamma encoding
+				//Note: it's a lookup per channel, SSE2 has no byte shuffle for the table
+				if (encode != nullptr && target.format != TRPresentFormat::TR_PRESENT_RGB32F)
+				{
+					for (auto &pixel : row)
+					{
+						pixel[0] = encode[pixel[0]];
+						pixel[1] = encode[pixel[1]];
+						pixel[2] = encode[pixel[2]];
+					}
+				}
+
+				//Format conversion
+				storeRow(target, y, 0, m_width, row.data(), encodef);
+			}
+#ifdef TR_NON_TEMPORAL_STORE
+			//Make the streaming stores visible to the other threads
+			_mm_sfence();
+#endif
+		}, TRExecutionPolicy::TR_PARALLEL);
+	}
+
+	template<int N, typename Buffer>
+	void TRFrameBuffer::resolveRowPlanesHDR(const Buffer &buffer, const uint &y, const uint &bx, const uint &ex, glm::vec4 *row) const
+	{
+		//Sample planes: each plane is walked along the row of the block, the same as resolveRowPlanes
+		using Texel = typename Buffer::value_type;
+		const uint num = ex - bx;
+		size_t pixels[COARSE_DEPTH_BLOCK_SIZE];
+		bool compressed = true;
+		for (uint i = 0; i < num; ++i)
+		{
+			pixels[i] = getPixelIndex(bx + i, y);
+			compressed = compressed && m_colorCompressed[pixels[i]];
+		}
+
+		const Texel *plane0 = &buffer[getSampleIndex(0, 0)];
+		if (compressed)
+		{
+			for (uint i = 0; i < num; ++i)
+			{
+				row[i] = TRColorTraits<Texel>::decode(plane0[pixels[i]]);
+			}
+			return;
+		}
+
+		for (uint i = 0; i < num; ++i)
 		{
-			auto &currentSamper = m_colorBuffer[index];
-			glm::vec4 sum(0.0f);
-			//Average the sampling color for each shaded pixel.
+			row[i] = glm::vec4(0.0f);
+		}
 #pragma unroll
-			for (int s = 0; s < currentSamper.getSamplingNum(); ++s)
+		for (int s = 0; s < N; ++s)
+		{
+			const Texel *plane = &buffer[getSampleIndex(0, s)];
+			for (uint i = 0; i < num; ++i)
 			{
+				row[i] += TRColorTraits<Texel>::decode(plane[pixels[i]]);
+			}
+		}
+		for (uint i = 0; i < num; ++i)
+		{
+			if (m_colorCompressed[pixels[i]])
+				row[i] = TRColorTraits<Texel>::decode(plane0[pixels[i]]);
+			else
+				row[i] *= (1.0f / N);
+		}
+	}
+
+	template<int N, typename Buffer>
+	void TRFrameBuffer::resolveHDR_aux(const Buffer &buffer, const TRPresentTarget &target) const
+	{
+		//MSAA Resolve of the HDR colors, then tone mapping and gamma encoding per pixel
+		//Note: a task resolves a row of blocks scanline by scanline, the same as resolve_aux
+		using Texel = typename Buffer::value_type;
+		const bool planes = m_layout == TRFrameBufferLayout::TR_LAYOUT_SAMPLE_PLANES;
+		parallelFor((size_t)0, (size_t)m_coarseHeight, [&](const size_t &blockRow)
+		{
+			const uint by = blockRow * COARSE_DEPTH_BLOCK_SIZE;
+			const uint ey = std::min(by + COARSE_DEPTH_BLOCK_SIZE, m_height);
+			std::vector<TRPixelRGBA> row(m_width);
+			for (uint y = by; y < ey; ++y)
+			{
+				for (uint b = 0; b < m_coarseWidth; ++b)
 				{
-					sum.x += currentSamper[s][0];//RED
-					sum.y += currentSamper[s][1];//GREEN
-					sum.z += currentSamper[s][2];//BLUE
-					sum.w += currentSamper[s][3];//ALPHA
+					const uint bx = b * COARSE_DEPTH_BLOCK_SIZE;
+					const uint ex = std::min(bx + COARSE_DEPTH_BLOCK_SIZE, m_width);
+					const uint num = ex - bx;
+					const bool cleared = isBlockCleared(m_colorClearStates, blockRow * m_coarseWidth + b);
+					const bool planar = planes && !cleared;
+
+					//Resolve the row of the block
+					glm::vec4 rowf[COARSE_DEPTH_BLOCK_SIZE];
+					if (planar)
+					{
+						resolveRowPlanesHDR<N>(buffer, y, bx, ex, rowf);
+					}
+					for (uint x = bx; x < ex && !planar; ++x)
+					{
+						auto &dst = rowf[x - bx];
+						const size_t pixel = getPixelIndex(x, y);
+						if (cleared)
+						{
+							dst = m_clearColorValue;
+						}
+						else if (m_colorCompressed[pixel])
+						{
+							dst = TRColorTraits<Texel>::decode(buffer[getSampleIndex(pixel, 0)]);
+						}
+						else
+						{
+							//Average the sampling color of the pixel
+							glm::vec4 sum(0.0f);
+#pragma unroll
+							for (int s = 0; s < N; ++s)
+							{
+								sum += TRColorTraits<Texel>::decode(buffer[getSampleIndex(pixel, s)]);
+							}
+							dst = sum * (1.0f / N);
+						}
+					}
+
+					//Tone mapping: HDR -> LDR
+					//Refs: https://learnopengl.com/Advanced-Lighting/HDR
+					for (uint i = 0; i < num; ++i)
+					{
+						glm::vec3 color(rowf[i]);
+						if (target.toneMapping)
+							color = 1.0f - glm::exp(-color * target.exposure);
+						if (target.gammaCorrection)
+							color = glm::pow(glm::max(color, 0.0f), glm::vec3(1.0f / 2.2f));
+						rowf[i] = glm::vec4(color, rowf[i].a);
+					}
+
+					if (target.format == TRPresentFormat::TR_PRESENT_RGB32F)
+					{
+						float *dstf = reinterpret_cast<float*>(static_cast<unsigned char*>(target.pixels) + y * target.pitch) + bx * 3;
+						for (uint i = 0; i < num; ++i, dstf += 3)
+						{
+							dstf[0] = rowf[i].x;
+							dstf[1] = rowf[i].y;
+							dstf[2] = rowf[i].z;
+						}
+						continue;
+					}
+
+					for (uint i = 0; i < num; ++i)
+					{
+						row[bx + i] = TRColorTraits<TRPixelRGBA>::encode(glm::clamp(rowf[i], 0.0f, 1.0f));
+					}
 				}
+
+				//Format conversion
+				if (target.format != TRPresentFormat::TR_PRESENT_RGB32F)
+					storeRow(target, y, 0, m_width, row.data(), nullptr);
 			}
-			sum /= currentSamper.getSamplingNum();
-			TRPixelRGBA value;
-			value[0] = static_cast<unsigned char>((sum.x));
-			value[1] = static_cast<unsigned char>((sum.y));
-			value[2] = static_cast<unsigned char>((sum.z));
-			value[3] = static_cast<unsigned char>((sum.w));
-			currentSamper[0] = value;
-			
+#ifdef TR_NON_TEMPORAL_STORE
+			//Make the streaming stores visible to the other threads
+			_mm_sfence();
+#endif
 		}, TRExecutionPolicy::TR_PARALLEL);
-		return m_colorBuffer;
 	}
 
-}
+	//Explicit instantiation of the MSAA kernels
+#define TR_INSTANTIATE_DEPTH_KERNELS(N, Format) \
+	template void TRFrameBuffer::writeDepthWithMask<N, Format>(const uint &, const uint &, const TRDepthPixelSampler<N> &, const TRMaskPixelSampler<N> &); \
+	template void TRFrameBuffer::depthTestWithMask<N, Format>(const uint &, const uint &, const TRDepthPixelSampler<N> &, \
+		const TRDepthCompareMode &, TRMaskPixelSampler<N> &) const;
+#define TR_INSTANTIATE_FRAMEBUFFER_KERNELS(N) \
+	template void TRFrameBuffer::writeColorWithMask<N>(const uint &, const uint &, const glm::vec4 &, const TRMaskPixelSampler<N> &); \
+	template void TRFrameBuffer::writeColorWithMaskAlphaBlending<N>(const uint &, const uint &, const glm::vec4 &, const TRMaskPixelSampler<N> &); \
+	TR_INSTANTIATE_DEPTH_KERNELS(N, TRDepthFormat::TR_DEPTH_FLOAT32) \
+	TR_INSTANTIATE_DEPTH_KERNELS(N, TRDepthFormat::TR_DEPTH_UNORM24) \
+	TR_INSTANTIATE_DEPTH_KERNELS(N, TRDepthFormat::TR_DEPTH_UNORM16)
+
+	TR_INSTANTIATE_FRAMEBUFFER_KERNELS(1)
+	TR_INSTANTIATE_FRAMEBUFFER_KERNELS(2)
+	TR_INSTANTIATE_FRAMEBUFFER_KERNELS(4)
+	TR_INSTANTIATE_FRAMEBUFFER_KERNELS(8)
+
+#undef TR_INSTANTIATE_FRAMEBUFFER_KERNELS
+#undef TR_INSTANTIATE_DEPTH_KERNELS
+
+}
\ No newline at end of file
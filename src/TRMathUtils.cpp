@@ -62,4 +62,102 @@ namespace TinyRenderer
 		pMat[3][0] = 0.0f;                pMat[3][1] = 0.0f;              pMat[3][2] = -(far + near) / (far - near); pMat[3][3] = 1.0f;
 		return pMat;
 	}
+
+	//----------------------------------------------TRBoundingBox----------------------------------------------
+
+	TRBoundingBox TRBoundingBox::transform(const glm::mat4 &mat) const
+	{
+		if (isEmpty())
+			return *this;
+
+		//Refs: Transforming Axis-Aligned Bounding Boxes, Jim Arvo, Graphics Gems 1990
+		const glm::vec3 center = glm::vec3(mat * glm::vec4(getCenter(), 1.0f));
+		const glm::vec3 extent = getExtent();
+		glm::vec3 newExtent;
+		for (int i = 0; i < 3; ++i)
+		{
+			newExtent[i] = glm::abs(mat[0][i]) * extent.x + glm::abs(mat[1][i]) * extent.y + glm::abs(mat[2][i]) * extent.z;
+		}
+
+		TRBoundingBox box;
+		box.min = center - newExtent;
+		box.max = center + newExtent;
+		return box;
+	}
+
+	//----------------------------------------------TRFrustum----------------------------------------------
+
+	TRFrustum::TRFrustum(const glm::mat4 &mat)
+	{
+		//Refs: Fast Extraction of Viewing Frustum Planes from the World-View-Projection Matrix, Gribb & Hartmann
+		//Note: the clipping volume is -w <= x, y, z <= w
+		auto row = [&](int i) -> glm::vec4 { return glm::vec4(mat[0][i], mat[1][i], mat[2][i], mat[3][i]); };
+		m_planes[0] = row(3) + row(0);
+		m_planes[1] = row(3) - row(0);
+		m_planes[2] = row(3) + row(1);
+		m_planes[3] = row(3) - row(1);
+		m_planes[4] = row(3) + row(2);
+		m_planes[5] = row(3) - row(2);
+
+		//Normalized for the sphere tests
+		for (auto &plane : m_planes)
+		{
+			const float len = glm::length(glm::vec3(plane));
+			if (len > 0.0f)
+				plane /= len;
+		}
+	}
+
+	bool TRFrustum::isOutside(const TRBoundingBox &box) const
+	{
+		if (box.isEmpty())
+			return false;
+		for (const auto &plane : m_planes)
+		{
+			//The corner of the box farthest along the plane normal
+			const glm::vec3 p(plane.x >= 0.0f ? box.max.x : box.min.x,
+				plane.y >= 0.0f ? box.max.y : box.min.y,
+				plane.z >= 0.0f ? box.max.z : box.min.z);
+			if (glm::dot(glm::vec3(plane), p) + plane.w < 0.0f)
+				return true;
+		}
+		return false;
+	}
+
+	bool TRFrustum::isOutside(const TRBoundingBox &box, unsigned int &planeMask) const
+	{
+		if (box.isEmpty())
+			return false;
+		for (int i = 0; i < 6; ++i)
+		{
+			if ((planeMask & (1u << i)) == 0)
+				continue;
+			const glm::vec4 &plane = m_planes[i];
+			const glm::vec3 pmax(plane.x >= 0.0f ? box.max.x : box.min.x,
+				plane.y >= 0.0f ? box.max.y : box.min.y,
+				plane.z >= 0.0f ? box.max.z : box.min.z);
+			if (glm::dot(glm::vec3(plane), pmax) + plane.w < 0.0f)
+				return true;
+
+			//The nearest corner is inside too
+			const glm::vec3 pmin(plane.x >= 0.0f ? box.min.x : box.max.x,
+				plane.y >= 0.0f ? box.min.y : box.max.y,
+				plane.z >= 0.0f ? box.min.z : box.max.z);
+			if (glm::dot(glm::vec3(plane), pmin) + plane.w >= 0.0f)
+				planeMask &= ~(1u << i);
+		}
+		return false;
+	}
+
+	bool TRFrustum::isOutside(const TRBoundingSphere &sphere) const
+	{
+		if (sphere.isEmpty())
+			return false;
+		for (const auto &plane : m_planes)
+		{
+			if (glm::dot(glm::vec3(plane), sphere.center) + plane.w < -sphere.radius)
+				return true;
+		}
+		return false;
+	}
 }
\ No newline at end of file
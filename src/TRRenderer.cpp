@@ -6,12 +6,19 @@
 #include "TRShaderProgram.h"
 #include "TRMathUtils.h"
 #include "TRParallelWrapper.h"
+#include "TRTracer.h"
 
 #include "tbb/parallel_pipeline.h"
 #include "tbb/task_arena.h"
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+#include "tbb/enumerable_thread_specific.h"
 
 #include <mutex>
+#include <iostream>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <thread>
 
 
@@ -19,9 +26,38 @@ namespace TinyRenderer
 {
 	using MutexType = tbb::spin_mutex;				//TBB thread mutex type
 	static constexpr int PIPELINE_BATCH_SIZE = 512; //The number of faces processed for each batch
+	static constexpr int BINNING_TILE_SIZE = 64;	//The width (height) of a screen tile in binning mode
+	static constexpr int BINNING_CHUNK_SIZE = 256;	//The number of faces binned by a task in binning mode
+	static constexpr int BINNING_BATCH_SIZE = 64 * BINNING_CHUNK_SIZE; //The number of faces binned for each batch
+
+	//Note: a pipeline batch (a binning chunk) is culled by the bounding box of the submesh's face batch it lies in
+	static_assert(PIPELINE_BATCH_SIZE == TRDrawableSubMesh::FACE_BATCH_SIZE, "Pipeline batches must match the face batches");
+	static_assert(TRDrawableSubMesh::FACE_BATCH_SIZE % BINNING_CHUNK_SIZE == 0, "Binning chunks must lie in the face batches");
+	static constexpr int GUARD_BAND_EXTENT = 4096;	//The guard band (in pixels) beyond the screen, keeps edge functions in int range
+
+	//The rasterized results of a face: the triangles after clipping and their fragments
+	struct RasterizedFace
+	{
+		std::array<TRShadingPipeline::TriangleSetup, TRRenderer::ClippingPolygon::MAX_VERTICES - 2> triangles;
+		int numTriangles = 0;
+		TRShadingPipeline::QuadFragmentsBuffer fragments;
+	};
 
 	//The cache for rasterized results. For example: the face i -> FragmentCache[i]
-	using FragmentCache = std::array<std::vector<TRShadingPipeline::QuadFragments>, PIPELINE_BATCH_SIZE>;
+	using FragmentCache = std::array<RasterizedFace, PIPELINE_BATCH_SIZE>;
+
+	//The vertex shader outputs of a draw call. For example: the vertex i -> TransformedVertexBuffer[i]
+	using TransformedVertexBuffer = std::vector<TRShadingPipeline::VertexData>;
+
+	//Per-thread pipeline statistics
+	using FrameStats = tbb::enumerable_thread_specific<TRFrameStats>;
+
+	//Timer for the pipeline statistics
+	using StatsClock = std::chrono::steady_clock;
+	static inline double elapsedMilliseconds(const StatsClock::time_point &start)
+	{
+		return std::chrono::duration<double, std::milli>(StatsClock::now() - start).count();
+	}
 
 	//----------------------------------------------DrawcallSetting----------------------------------------------
 	//Draw call setting which would be utilized in shading parallel pipeline 
@@ -31,16 +67,42 @@ namespace TinyRenderer
 
 		const TRVertexBuffer &vertexBuffer;			//Vertex data buffer
 		const TRIndexBuffer  &indexBuffer;			//Index data buffer
+		const TransformedVertexBuffer &transformedVertices; //Vertex shader outputs
 		TRShadingPipeline *shaderHandler;			//Shader handler
 		const TRShadingState &shadingState;			//Shading state
 		const glm::mat4 &viewportMatrix;			//Viewport transformation matrix
 		float near, far;							//Near plane and far plane of frustum
 		TRFrameBuffer *frameBuffer;					//Framebuffer 
+		glm::vec2 guardBand;						//Guard band clipping planes scale
+		const TRFrustum &frustum;					//View frustum in the model space
+		const std::vector<TRBoundingBox> &faceBatchBoxes; //Bounding boxes of the face batches
+		FrameStats &frameStats;						//Pipeline statistics
+
+		explicit DrawcallSetting(const TRVertexBuffer &vbo, const TRIndexBuffer &ibo, const TransformedVertexBuffer &tvbo,
+			TRShadingPipeline *handler, const TRShadingState &state, const glm::mat4 &viewportMat, float np, float fp, TRFrameBuffer *fb,
+			const TRFrustum &modelFrustum, const std::vector<TRBoundingBox> &batchBoxes, FrameStats &stats)
+			: vertexBuffer(vbo), indexBuffer(ibo), transformedVertices(tvbo), shaderHandler(handler), shadingState(state),
+			viewportMatrix(viewportMat), near(np), far(fp), frameBuffer(fb), frustum(modelFrustum), faceBatchBoxes(batchBoxes),
+			frameStats(stats)
+		{
+			//Screen [-extent, width+extent] -> ndc [-guardBand.x, +guardBand.x]
+			guardBand.x = 1.0f + 2.0f * GUARD_BAND_EXTENT / fb->getWidth();
+			guardBand.y = 1.0f + 2.0f * GUARD_BAND_EXTENT / fb->getHeight();
+		}
 
-		explicit DrawcallSetting(const TRVertexBuffer &vbo, const TRIndexBuffer &ibo, TRShadingPipeline *handler,
-			const TRShadingState &state, const glm::mat4 &viewportMat, float np, float fp, TRFrameBuffer *fb)
-			: vertexBuffer(vbo), indexBuffer(ibo), shaderHandler(handler), shadingState(state),
-			viewportMatrix(viewportMat), near(np), far(fp), frameBuffer(fb) {}
+		//Hierarchical z for early rejection, only available when depth testing
+		//Note: its rejection is not exact for the fragments at the stored depth, so only for the greater compare
+		const TRFrameBuffer *coarseDepth() const
+		{
+			return shadingState.trDepthTestMode == TRDepthTestMode::TR_DEPTH_TEST_ENABLE &&
+				shadingState.trDepthCompareMode == TRDepthCompareMode::TR_DEPTH_COMPARE_GREATER ? frameBuffer : nullptr;
+		}
+
+		//Whether the face batch of the given face is completely outside of the view frustum
+		bool isFaceBatchOutside(int faceIndex) const
+		{
+			return !faceBatchBoxes.empty() && frustum.isOutside(faceBatchBoxes[faceIndex / TRDrawableSubMesh::FACE_BATCH_SIZE]);
+		}
 	};
 
 	//----------------------------------------------FramebufferMutex----------------------------------------------
@@ -78,92 +140,99 @@ namespace TinyRenderer
 		MutexBuffer mutexBuffer;
 	};
 
-	//----------------------------------------------TBBVertexRastFilter----------------------------------------------
-	//Vertex transformation, cliping, culling and rasterization.
-	class TBBVertexRastFilter final
+	//----------------------------------------------VertexStage----------------------------------------------
+	//Vertex shading of a draw call: each unique vertex is transformed exactly once, no matter
+	//how many faces share it, before the primitive assembly.
+	class VertexStage final
 	{
 	public:
-		explicit TBBVertexRastFilter(int bs, int startIndex, int overIndex, const DrawcallSetting &drawcall,
-			FragmentCache &cache) : batchSize(bs), startIndex(startIndex), overIndex(overIndex),
-			drawCall(drawcall), fragmentCache(cache) 
+		static void process(const TRVertexBuffer &vertexBuffer, const TRShadingPipeline *shaderHandler,
+			TransformedVertexBuffer &transformedVertices, FrameStats &frameStats)
 		{
-			currIndex.store(startIndex);
-		}
-
-		int operator()(tbb::flow_control &fc) const
-		{
-			//Note: process the faces in [startIndex, overIndex) parallely
-			int faceIndex = 0;
-			//Fetch the face index that needs to be processed.
+			transformedVertices.resize(vertexBuffer.size());
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, vertexBuffer.size()), [&](const tbb::blocked_range<size_t> &range)
 			{
-				//Note: an atomic add herein for excusively accesing the face
-				if ((faceIndex = currIndex.fetch_add(1)) >= overIndex)
+				TRTraceScope trace("Vertex shading", "pipeline", range.begin());
+				const auto start = StatsClock::now();
+				for (size_t index = range.begin(); index != range.end(); ++index)
 				{
-					fc.stop();//Exceed range, stop the processing flow
-					return -1;
+					TRShadingPipeline::VertexData v;
+					v.pos = vertexBuffer[index].vpositions;
+					v.nor = vertexBuffer[index].vnormals;
+					v.tex = vertexBuffer[index].vtexcoords;
+					v.TBN[0] = vertexBuffer[index].vtangent;
+					v.TBN[1] = vertexBuffer[index].vbitangent;
+
+					//Vertex shader stage
+					shaderHandler->vertexShader(v);
+					transformedVertices[index] = v;
 				}
-			}
+				auto &stats = frameStats.local();
+				stats.numVerticesShaded += range.size();
+				stats.vertexRasterTime += elapsedMilliseconds(start);
+			});
+		}
+	};
 
-			//The fragment cache index
-			int order = faceIndex - startIndex;
+	//----------------------------------------------GeometryStage----------------------------------------------
+	//Primitive assembly, cliping, perspective division, viewport transformation and culling of a face.
+	class GeometryStage final
+	{
+	public:
+		//Note: func is invoked with the screen space vertices of each triangle that survives
+		template<typename Function>
+		static void process(const DrawcallSetting &drawCall, int faceIndex, TRFrameStats &stats, const Function &func)
+		{
 			faceIndex *= 3;
 
-			TRShadingPipeline::VertexData v[3];
+			//Primitive assembly from the transformed vertices
 			const auto &indexBuffer = drawCall.indexBuffer;
-			const auto &vertexBuffer = drawCall.vertexBuffer;
-#pragma unroll 3
-			for (int i = 0; i < 3; ++i)
-			{
-				v[i].pos = vertexBuffer[indexBuffer[faceIndex + i]].vpositions;
-				v[i].nor = vertexBuffer[indexBuffer[faceIndex + i]].vnormals;
-				v[i].tex = vertexBuffer[indexBuffer[faceIndex + i]].vtexcoords;
-				v[i].TBN[0] = vertexBuffer[indexBuffer[faceIndex + i]].vtangent;
-				v[i].TBN[1] = vertexBuffer[indexBuffer[faceIndex + i]].vbitangent;
-			}
-
-			//Vertex shader stage
-			drawCall.shaderHandler->vertexShader(v[0]);
-			drawCall.shaderHandler->vertexShader(v[1]);
-			drawCall.shaderHandler->vertexShader(v[2]);
+			const auto &transformedVertices = drawCall.transformedVertices;
+			const auto &v0 = transformedVertices[indexBuffer[faceIndex + 0]];
+			const auto &v1 = transformedVertices[indexBuffer[faceIndex + 1]];
+			const auto &v2 = transformedVertices[indexBuffer[faceIndex + 2]];
 
 			//Homogeneous space cliping
-			std::vector<TRShadingPipeline::VertexData> clipped_vertices;
-			clipped_vertices = TRRenderer::clipingSutherlandHodgeman(v[0], v[1], v[2], drawCall.near, drawCall.far);
-			if (clipped_vertices.empty())
+			TRRenderer::ClippingPolygon clipped_polygon;
+			const bool clipped = TRRenderer::clipingSutherlandHodgeman(v0, v1, v2, drawCall.near, drawCall.far,
+				clipped_polygon, drawCall.guardBand);
+			if (clipped_polygon.empty())
 			{
-				return -1; //Totally outside
+				++stats.numTrianglesOutside;
+				return; //Totally outside
 			}
+			stats.numTrianglesClipped += clipped ? 1 : 0;
 
 			//Perspective division: from clip space -> ndc space
-			for (auto &vert : clipped_vertices)
+			auto *clipped_vertices = clipped_polygon.vertices;
+			int num_verts = clipped_polygon.size;
+			for (int i = 0; i < num_verts; ++i)
 			{
-				TRShadingPipeline::VertexData::prePerspCorrection(vert);
-				vert.cpos *= vert.rhw;
+				TRShadingPipeline::VertexData::prePerspCorrection(clipped_vertices[i]);
+				clipped_vertices[i].cpos *= clipped_vertices[i].rhw;
 			}
 
-			int num_verts = clipped_vertices.size();
 			for (int i = 0; i < num_verts - 2; ++i)
 			{
 				//Triangle assembly
 				TRShadingPipeline::VertexData vert[3] = { clipped_vertices[0], clipped_vertices[i + 1], clipped_vertices[i + 2] };
 
 				//Transform to screen space
-				vert[0].spos = glm::ivec2(drawCall.viewportMatrix * vert[0].cpos + glm::vec4(0.5f));
-				vert[1].spos = glm::ivec2(drawCall.viewportMatrix * vert[1].cpos + glm::vec4(0.5f));
-				vert[2].spos = glm::ivec2(drawCall.viewportMatrix * vert[2].cpos + glm::vec4(0.5f));
+				//Note: vertices in the guard band could be off screen, so round down rather than toward zero
+				vert[0].spos = glm::ivec2(glm::floor(drawCall.viewportMatrix * vert[0].cpos + glm::vec4(0.5f)));
+				vert[1].spos = glm::ivec2(glm::floor(drawCall.viewportMatrix * vert[1].cpos + glm::vec4(0.5f)));
+				vert[2].spos = glm::ivec2(glm::floor(drawCall.viewportMatrix * vert[2].cpos + glm::vec4(0.5f)));
 
 				//Backface culling
 				if (shouldCulled(vert[0].spos, vert[1].spos, vert[2].spos, drawCall.shadingState.trCullFaceMode))
 				{
+					++stats.numTrianglesCulled;
 					continue;
 				}
 
-				//Rasterization
-				TRShadingPipeline::rasterize_fill_edge_function(vert[0], vert[1], vert[2],
-					drawCall.frameBuffer->getWidth(), drawCall.frameBuffer->getHeight(), fragmentCache[order]);
+				++stats.numTrianglesRasterized;
+				func(vert);
 			}
-
-			return order;
 		}
 
 	private:
@@ -178,141 +247,354 @@ namespace TinyRenderer
 			int orient = e1.x * e2.y - e1.y * e2.x;
 			return (mode == TRCullFaceMode::TR_CULL_BACK) ? orient > 0 : orient < 0;
 		}
+	};
 
-	private:
-		int batchSize;
-		const int startIndex;
-		const int overIndex;
-		const DrawcallSetting &drawCall;
+	//----------------------------------------------FragmentStage----------------------------------------------
+	//Depth testing, fragment shader execution and framebuffer writing of the 2x2 fragments blocks
+	class FragmentStage final
+	{
+	public:
+		//Process the blocks [begin, end) of the rasterized fragments
+		//Note: framebufferMutex could be nullptr if the caller accesses the pixels exclusively
+		static void process(const DrawcallSetting &drawCall, TRShadingPipeline::QuadFragmentsBuffer &fragments,
+			const size_t &begin, const size_t &end, FramebufferMutex *framebufferMutex, TRFrameStats &stats)
+		{
+			switch (drawCall.frameBuffer->getSamplingNum())
+			{
+			case 1: process_aux<1>(drawCall, fragments.blocks<1>(), begin, end, framebufferMutex, stats); break;
+			case 2: process_aux<2>(drawCall, fragments.blocks<2>(), begin, end, framebufferMutex, stats); break;
+			case 8: process_aux<8>(drawCall, fragments.blocks<8>(), begin, end, framebufferMutex, stats); break;
+			default: process_aux<4>(drawCall, fragments.blocks<4>(), begin, end, framebufferMutex, stats); break;
+			}
+		}
 
-		//this is for excessively accessing to face among threads
-		static std::atomic<int> currIndex;
+	private:
 
-		FragmentCache &fragmentCache;
-	};
+		struct QuadDerivatives
+		{
+			bool ready = false;
+			glm::vec2 dUVdx, dUVdy;
+		};
+
+		//Specialized for MSAA NX
+		//Note: the depth format is dispatched here once for the blocks, rather than by each depth access
+		template<int N>
+		static void process_aux(const DrawcallSetting &drawCall, std::vector<TRShadingPipeline::QuadFragments<N>> &blocks,
+			const size_t &begin, const size_t &end, FramebufferMutex *framebufferMutex, TRFrameStats &stats)
+		{
+			switch (drawCall.frameBuffer->getDepthFormat())
+			{
+			case TRDepthFormat::TR_DEPTH_UNORM24:
+				processBlocks<N, TRDepthFormat::TR_DEPTH_UNORM24>(drawCall, blocks, begin, end, framebufferMutex, stats); break;
+			case TRDepthFormat::TR_DEPTH_UNORM16:
+				processBlocks<N, TRDepthFormat::TR_DEPTH_UNORM16>(drawCall, blocks, begin, end, framebufferMutex, stats); break;
+			default:
+				processBlocks<N, TRDepthFormat::TR_DEPTH_FLOAT32>(drawCall, blocks, begin, end, framebufferMutex, stats); break;
+			}
+		}
 
-	std::atomic<int> TBBVertexRastFilter::currIndex;
+		//Specialized for MSAA NX and the depth format
+		template<int N, TRDepthFormat Format>
+		static void processBlocks(const DrawcallSetting &drawCall, std::vector<TRShadingPipeline::QuadFragments<N>> &blocks,
+			const size_t &begin, const size_t &end, FramebufferMutex *framebufferMutex, TRFrameStats &stats)
+		{
+			for (size_t b = begin; b != end; ++b)
+			{
+				//Note: dUVdx, dUVdy for mipmap are calculated lazily, once a fragment passes the depth test
+				auto &block = blocks[b];
+				QuadDerivatives derivatives;
+				++stats.numQuadsGenerated;
+				processFragment<N, Format>(drawCall, block, 0, derivatives, framebufferMutex, stats);
+				processFragment<N, Format>(drawCall, block, 1, derivatives, framebufferMutex, stats);
+				processFragment<N, Format>(drawCall, block, 2, derivatives, framebufferMutex, stats);
+				processFragment<N, Format>(drawCall, block, 3, derivatives, framebufferMutex, stats);
+			}
+		}
 
-	//----------------------------------------------TBBFragmentFilter----------------------------------------------
-	//Fragment shader execution
-	class TBBFragmentFilter final
-	{
-	public:
-		explicit TBBFragmentFilter(int bs, const DrawcallSetting &drawcall, FragmentCache &cache, FramebufferMutex &fbMutex)
-			: batchSize(bs), drawCall(drawcall), fragmentCache(cache), framebufferMutex(fbMutex) {}
+		//Number of the covered sampling points
+		template<int N>
+		static int numCoveredSamples(const TRMaskPixelSampler<N> &coverage)
+		{
+			int num_covered = 0;
+#pragma unroll
+			for (int s = 0; s < N; ++s)
+			{
+				num_covered += coverage[s];
+			}
+			return num_covered;
+		}
 
-		void operator()(int index) const
+		//Fragment shader & Depth testing
+		template<int N, TRDepthFormat Format>
+		static void processFragment(const DrawcallSetting &drawCall, TRShadingPipeline::QuadFragments<N> &block,
+			const int &index, QuadDerivatives &derivatives, FramebufferMutex *framebufferMutex, TRFrameStats &stats)
 		{
-			//No fragments
-			if (index == -1 || fragmentCache[index].empty())
+			auto &coverage = block.coverage[index];
+			const auto fragCoord = block.fragmentPos(index);
+			auto &framebuffer = drawCall.frameBuffer;
+			const auto &shadingState = drawCall.shadingState;
+			constexpr int samplingNum = N;
+
+			//Invalid fragment (helper lane)
+			const int num_covered = numCoveredSamples<N>(coverage);
+			if (num_covered == 0)
 				return;
+			++stats.numFragmentsGenerated;
 
-			//Fragment shader & Depth testing
-			auto fragment_func = [&](TRShadingPipeline::FragmentData &fragment, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy)
+			//A mutex locker herein for (x,y) to prevent from simultanenously accessing depth buffer at the same place
+			MutexType::scoped_lock lock;
+			if (framebufferMutex != nullptr)
 			{
-				//Note: spos.x equals -1 -> invalid fragment
-				if (fragment.spos.x == -1)
-					return;
+				lock.acquire(framebufferMutex->getLocker(fragCoord.x, fragCoord.y));
+			}
+
+			int num_failed = 0;
+			//Depth testing for each sampling point (Early Z strategy herein)
+			if (shadingState.trDepthTestMode == TRDepthTestMode::TR_DEPTH_TEST_ENABLE)
+			{
+				framebuffer->depthTestWithMask<N, Format>(fragCoord.x, fragCoord.y, block.coverage_depth[index],
+					shadingState.trDepthCompareMode, coverage);
+#pragma unroll
+				for (int s = 0; s < samplingNum; ++s)
+				{
+					num_failed += (coverage[s] == 0);
+				}
+			}
 
-				auto &coverage = fragment.coverage;
-				const auto &fragCoord = fragment.spos;
-				auto &framebuffer = drawCall.frameBuffer;
-				const auto &shadingState = drawCall.shadingState;
+			//No valid mask, just discard.
+			if (num_failed == samplingNum)
+			{
+				++stats.numFragmentsDepthRejected;
+				return;
+			}
 
-				//A mutex locker herein for (x,y) to prevent from simultanenously accessing depth buffer at the same place
-				MutexType::scoped_lock lock(framebufferMutex.getLocker(fragCoord.x, fragCoord.y));
+			//Depth-only fast path: neither interpolation nor fragment shader
+			if (shadingState.trColorWriteMode == TRColorWriteMode::TR_COLOR_WRITE_DISABLE)
+			{
+				if (shadingState.trDepthWriteMode == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE)
+				{
+					framebuffer->writeDepthWithMask<N, Format>(fragCoord.x, fragCoord.y, block.coverage_depth[index], coverage);
+				}
+				return;
+			}
 
-				const int samplingNum = TRMaskPixelSampler::getSamplingNum();
+			//Lazy interpolation of the varyings
+			if (!derivatives.ready)
+			{
+				block.dUVdxy(derivatives.dUVdx, derivatives.dUVdy);
+				derivatives.ready = true;
+			}
+			TRShadingPipeline::FragmentData fragment;
+			block.triangle->interpolate(fragCoord, fragment);
 
-				int num_failed = 0;
-				//Depth testing for each sampling point (Early Z strategy herein)
-				if (shadingState.trDepthTestMode == TRDepthTestMode::TR_DEPTH_TEST_ENABLE)
+			//Deferred shading
+			//Note: only the opaque fragments fully covering the pixel are deferred,
+			//      the others (MSAA edges, blending) are shaded right now as usual.
+			if (framebuffer->hasGBuffer())
+			{
+				if (shadingState.trShadingMode == TRShadingMode::TR_SHADING_DEFERRED &&
+					shadingState.trAlphaBlendMode == TRAlphaBlendingMode::TR_ALPHA_DISABLE &&
+					num_covered == samplingNum && num_failed == 0)
 				{
-					const auto &coverageDepth = fragment.coverage_depth;
-#pragma unroll
-					for (int s = 0; s < samplingNum; ++s)
+					TRGBufferTexel texel;
+					++stats.numFragmentShaderInvocations;
+					if (drawCall.shaderHandler->materialShader(fragment, texel, derivatives.dUVdx, derivatives.dUVdy))
 					{
-						if (coverage[s] == 1 &&
-							framebuffer->readDepth(fragCoord.x, fragCoord.y, s) >= coverageDepth[s])
+						//Note: all the sampling points are to be written by the lighting stage
+						stats.numSamplesWritten += samplingNum;
+						framebuffer->writeGBuffer(fragCoord.x, fragCoord.y, texel);
+						if (shadingState.trDepthWriteMode == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE)
 						{
-							coverage[s] = 0;//Occuluded
-							++num_failed;
-						}
-						else if (coverage[s] == 0)
-						{
-							++num_failed;
+							framebuffer->writeDepthWithMask<N, Format>(fragCoord.x, fragCoord.y, block.coverage_depth[index], coverage);
 						}
+						return;
 					}
 				}
 
-				//No valid mask, just discard.
-				if (num_failed == samplingNum)
-					return;
+				//The pending material would be partially covered, so light it in advance
+				if (framebuffer->isGBufferPending(fragCoord.x, fragCoord.y))
+				{
+					static const TRMaskPixelSampler<N> fullMask(1);
+					framebuffer->writeColorWithMask<N>(fragCoord.x, fragCoord.y,
+						TRShadingPipeline::blinnPhongLighting(framebuffer->readGBuffer(fragCoord.x, fragCoord.y), !framebuffer->isHDR()), fullMask);
+					framebuffer->discardGBuffer(fragCoord.x, fragCoord.y);
+				}
+			}
 
-				//Execute fragment shader, and save the result to frame buffer
-				glm::vec4 fragColor;
-				drawCall.shaderHandler->fragmentShader(fragment, fragColor, dUVdx, dUVdy);
+			//Execute fragment shader, and save the result to frame buffer
+			glm::vec4 fragColor;
+			++stats.numFragmentShaderInvocations;
+			drawCall.shaderHandler->fragmentShader(fragment, fragColor, derivatives.dUVdx, derivatives.dUVdy);
 
-				//Alpha to coverage
-				//Note: alpha to coverage only work with MSAA
-				//Refs: http://www.zwqxin.com/archives/opengl/talk-about-alpha-to-coverage.html
-				if (shadingState.trAlphaBlendMode == TRAlphaBlendingMode::TR_ALPHA_TO_COVERAGE && samplingNum >= 4)
+			//Alpha to coverage
+			//Note: alpha to coverage only work with MSAA
+			//Refs: http://www.zwqxin.com/archives/opengl/talk-about-alpha-to-coverage.html
+			if (shadingState.trAlphaBlendMode == TRAlphaBlendingMode::TR_ALPHA_TO_COVERAGE && samplingNum >= 4)
+			{
+				int num_cancle = samplingNum - int(samplingNum * fragColor.a);
+				//None left, just discard in advance
+				if (num_cancle == samplingNum)
 				{
-					int num_cancle = samplingNum  - int(samplingNum * fragColor.a);
-					//None left, just discard in advance
-					if (num_cancle == samplingNum)
-					{
-						return;
-					}
-					for (int c = 0; c < num_cancle; ++c)
-					{
-						coverage[c] = 0;
-					}
+					++stats.numFragmentsCoverageRejected;
+					return;
 				}
-
-				//Save the rendered result to frame buffer
-				switch (shadingState.trAlphaBlendMode)
+				for (int c = 0; c < num_cancle; ++c)
 				{
-				case TRAlphaBlendingMode::TR_ALPHA_DISABLE://No alpha blending
-				case TRAlphaBlendingMode::TR_ALPHA_TO_COVERAGE://Or alpha to coverage
-					framebuffer->writeColorWithMask(fragCoord.x, fragCoord.y, fragColor, coverage);
-					break;
-				case TRAlphaBlendingMode::TR_ALPHA_BLENDING://Alpha blending
-					framebuffer->writeColorWithMaskAlphaBlending(fragCoord.x, fragCoord.y, fragColor, coverage);
-					break;
-				default:
-					framebuffer->writeColorWithMask(fragCoord.x, fragCoord.y, fragColor, coverage);
-					break;
+					coverage[c] = 0;
 				}
+			}
 
-				//Depth writing
-				if (shadingState.trDepthWriteMode == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE)
+			//Save the rendered result to frame buffer
+			stats.numSamplesWritten += numCoveredSamples<N>(coverage);
+			switch (shadingState.trAlphaBlendMode)
+			{
+			case TRAlphaBlendingMode::TR_ALPHA_DISABLE://No alpha blending
+			case TRAlphaBlendingMode::TR_ALPHA_TO_COVERAGE://Or alpha to coverage
+				framebuffer->writeColorWithMask<N>(fragCoord.x, fragCoord.y, fragColor, coverage);
+				break;
+			case TRAlphaBlendingMode::TR_ALPHA_BLENDING://Alpha blending
+				framebuffer->writeColorWithMaskAlphaBlending<N>(fragCoord.x, fragCoord.y, fragColor, coverage);
+				break;
+			default:
+				framebuffer->writeColorWithMask<N>(fragCoord.x, fragCoord.y, fragColor, coverage);
+				break;
+			}
+
+			//Depth writing
+			if (shadingState.trDepthWriteMode == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE)
+			{
+				framebuffer->writeDepthWithMask<N, Format>(fragCoord.x, fragCoord.y, block.coverage_depth[index], coverage);
+			}
+		}
+	};
+
+	//----------------------------------------------LightingStage----------------------------------------------
+	//Deferred lighting: each pixel with a pending G-buffer texel is lit exactly once, after all the meshes
+	//Note: nothing to do if no pixel is pending, e.g. it has already been processed after rendering the meshes
+	class LightingStage final
+	{
+	public:
+		static void process(TRFrameBuffer *frameBuffer)
+		{
+			if (!frameBuffer->hasGBuffer() || !frameBuffer->hasPendingGBuffer())
+				return;
+			TRTraceScope trace("Deferred lighting", "pipeline");
+			switch (frameBuffer->getSamplingNum())
+			{
+			case 1: process_aux<1>(frameBuffer); break;
+			case 2: process_aux<2>(frameBuffer); break;
+			case 8: process_aux<8>(frameBuffer); break;
+			default: process_aux<4>(frameBuffer); break;
+			}
+			frameBuffer->markGBufferLit();
+		}
+
+	private:
+
+		template<int N>
+		static void process_aux(TRFrameBuffer *frameBuffer)
+		{
+			static const TRMaskPixelSampler<N> fullMask(1);
+			const int width = frameBuffer->getWidth();
+			const bool toneMapping = !frameBuffer->isHDR();
+			parallelFor((size_t)0, (size_t)(width * frameBuffer->getHeight()), [&](const size_t &index)
+			{
+				int x = index % width, y = index / width;
+				if (!frameBuffer->isGBufferPending(x, y))
+					return;
+				frameBuffer->writeColorWithMask<N>(x, y, TRShadingPipeline::blinnPhongLighting(frameBuffer->readGBuffer(x, y), toneMapping), fullMask);
+				frameBuffer->discardGBuffer(x, y);
+			});
+		}
+	};
+
+	//----------------------------------------------TBBVertexRastFilter----------------------------------------------
+	//Vertex transformation, cliping, culling and rasterization.
+	class TBBVertexRastFilter final
+	{
+	public:
+		//Note: the face counter is reset for each pipeline, the copies of the filter share it
+		explicit TBBVertexRastFilter(int bs, int startIndex, int overIndex, const DrawcallSetting &drawcall,
+			FragmentCache &cache, std::atomic<int> &counter) : batchSize(bs), startIndex(startIndex), overIndex(overIndex),
+			drawCall(drawcall), currIndex(counter), fragmentCache(cache) 
+		{
+			currIndex.store(startIndex);
+		}
+
+		int operator()(tbb::flow_control &fc) const
+		{
+			//Note: process the faces in [startIndex, overIndex) parallely
+			int faceIndex = 0;
+			//Fetch the face index that needs to be processed.
+			{
+				//Note: an atomic add herein for excusively accesing the face
+				if ((faceIndex = currIndex.fetch_add(1)) >= overIndex)
 				{
-					framebuffer->writeDepthWithMask(fragCoord.x, fragCoord.y, fragment.coverage_depth, coverage);
+					fc.stop();//Exceed range, stop the processing flow
+					return -1;
 				}
-				
-			};
+			}
 
-			//Note: 2x2 fragment block as an execution unit for calculating dFdx, dFdy.
-			parallelFor((size_t)0, (size_t)fragmentCache[index].size(), [&](const size_t &f)
+			//The fragment cache index
+			int order = faceIndex - startIndex;
+
+			TRTraceScope trace("Vertex & raster filter", "pipeline", faceIndex);
+			const auto start = StatsClock::now();
+			auto &stats = drawCall.frameStats.local();
+			auto &face = fragmentCache[order];
+			face.numTriangles = 0;
+			GeometryStage::process(drawCall, faceIndex, stats, [&](const TRShadingPipeline::VertexData *vert)
 			{
-				auto &block = fragmentCache[index][f];
+				//Triangle setup & Rasterization
+				auto &triangle = face.triangles[face.numTriangles++];
+				triangle = TRShadingPipeline::TriangleSetup(vert[0], vert[1], vert[2]);
+				TRShadingPipeline::rasterize_fill_edge_function(triangle,
+					drawCall.frameBuffer->getWidth(), drawCall.frameBuffer->getHeight(), face.fragments,
+					drawCall.frameBuffer->getSamplingNum(), drawCall.coarseDepth());
+			});
+			stats.vertexRasterTime += elapsedMilliseconds(start);
 
-				//Perspective correction restore
-				block.aftPrespCorrectionForBlocks();
+			return order;
+		}
 
-				//Calculate dUVdx, dUVdy for mipmap
-				glm::vec2 dUVdx(block.dUdx(), block.dVdx());
-				glm::vec2 dUVdy(block.dUdy(), block.dVdy());
+	private:
+		int batchSize;
+		const int startIndex;
+		const int overIndex;
+		const DrawcallSetting &drawCall;
 
-				fragment_func(block.fragments[0], dUVdx, dUVdy);
-				fragment_func(block.fragments[1], dUVdx, dUVdy);
-				fragment_func(block.fragments[2], dUVdx, dUVdy);
-				fragment_func(block.fragments[3], dUVdx, dUVdy);
+		//this is for excessively accessing to face among threads
+		std::atomic<int> &currIndex;
 
-			}, TRExecutionPolicy::TR_PARALLEL);
+		FragmentCache &fragmentCache;
+	};
 
-			fragmentCache[index].clear();
+	//----------------------------------------------TBBFragmentFilter----------------------------------------------
+	//Fragment shader execution
+	class TBBFragmentFilter final
+	{
+	public:
+		explicit TBBFragmentFilter(int bs, const DrawcallSetting &drawcall, FragmentCache &cache, FramebufferMutex &fbMutex)
+			: batchSize(bs), drawCall(drawcall), fragmentCache(cache), framebufferMutex(fbMutex) {}
+
+		void operator()(int index) const
+		{
+			//No fragments
+			if (index == -1 || fragmentCache[index].fragments.empty())
+				return;
+
+			//Note: 2x2 fragment block as an execution unit for calculating dFdx, dFdy.
+			TRTraceScope trace("Fragment filter", "pipeline", index);
+			auto &fragments = fragmentCache[index].fragments;
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, fragments.size()), [&](const tbb::blocked_range<size_t> &range)
+			{
+				const auto start = StatsClock::now();
+				auto &stats = drawCall.frameStats.local();
+				FragmentStage::process(drawCall, fragments, range.begin(), range.end(), &framebufferMutex, stats);
+				stats.fragmentTime += elapsedMilliseconds(start);
+			});
+
+			fragments.clear();
 		}
 
 	private:
@@ -322,28 +604,176 @@ namespace TinyRenderer
 		FramebufferMutex &framebufferMutex;
 	};
 
+	//----------------------------------------------StreamingPipelineCache----------------------------------------------
+	//Rasterized faces of a pipeline batch and the per-pixel mutexes in streaming mode
+	class StreamingPipelineCache final
+	{
+	public:
+		void resize(int w, int h)
+		{
+			if (framebufferMutex != nullptr && framebufferMutex->width == w && framebufferMutex->height == h)
+				return;
+			framebufferMutex.reset(new FramebufferMutex(w, h));
+		}
+
+	public:
+		FragmentCache fragmentCache;
+		std::unique_ptr<FramebufferMutex> framebufferMutex;
+		std::atomic<int> currIndex{ 0 };	//The next face of the batch to be rasterized
+	};
+
+	//----------------------------------------------TileBinningCache----------------------------------------------
+	//Screen space triangles binned into tiles.
+	//Note: faces are split into chunks, each chunk owns its triangles and its per-tile bins,
+	//      so that chunks could be binned parallely without any locking.
+	class TileBinningCache final
+	{
+	public:
+		void resize(int w, int h)
+		{
+			if (w == width && h == height)
+				return;
+			width = w;
+			height = h;
+			numTilesX = (width + BINNING_TILE_SIZE - 1) / BINNING_TILE_SIZE;
+			numTilesY = (height + BINNING_TILE_SIZE - 1) / BINNING_TILE_SIZE;
+			chunkTriangles.resize(BINNING_BATCH_SIZE / BINNING_CHUNK_SIZE);
+			std::vector<std::vector<int>>(chunkTriangles.size() * numTilesX * numTilesY).swap(chunkBins);
+		}
+
+		int getNumTiles() const { return numTilesX * numTilesY; }
+
+	public:
+		int width = 0, height = 0;
+		int numTilesX = 0, numTilesY = 0;
+		std::vector<std::vector<TRShadingPipeline::TriangleSetup>> chunkTriangles;	//chunk -> screen space triangles
+		std::vector<std::vector<int>> chunkBins;					//chunk * numTiles + tile -> triangle indices
+		tbb::enumerable_thread_specific<TRShadingPipeline::QuadFragmentsBuffer> fragments;
+	};
+
+	//----------------------------------------------TileBinningPipeline----------------------------------------------
+	//Sort-middle rendering: geometry is transformed and binned into screen tiles first, and then 
+	//each tile is rasterized and shaded by exactly one worker. No framebuffer locking is needed.
+	class TileBinningPipeline final
+	{
+	public:
+		static void draw(const DrawcallSetting &drawCall, TileBinningCache &cache, int faceNum)
+		{
+			const int numTiles = cache.getNumTiles();
+			for (int f = 0; f < faceNum; f += BINNING_BATCH_SIZE)
+			{
+				const int startIndex = f;
+				const int overIndex = glm::min(f + BINNING_BATCH_SIZE, faceNum);
+				const int numChunks = (overIndex - startIndex + BINNING_CHUNK_SIZE - 1) / BINNING_CHUNK_SIZE;
+				TRTraceScope trace("Binning batch", "pipeline", startIndex);
+
+				//Binning stage: vertex processing and binning of each chunk
+				parallelFor((size_t)0, (size_t)numChunks, [&](const size_t &c)
+				{
+					TRTraceScope trace("Binning chunk", "pipeline", c);
+					const auto start = StatsClock::now();
+					auto &stats = drawCall.frameStats.local();
+					auto &triangles = cache.chunkTriangles[c];
+					auto *bins = &cache.chunkBins[c * numTiles];
+					triangles.clear();
+
+					const int chunkStart = startIndex + (int)c * BINNING_CHUNK_SIZE;
+					const int chunkOver = glm::min(chunkStart + BINNING_CHUNK_SIZE, overIndex);
+					const bool outside = drawCall.isFaceBatchOutside(chunkStart);
+					stats.numTrianglesFrustumCulled += outside ? chunkOver - chunkStart : 0;
+					for (int faceIndex = chunkStart; faceIndex < chunkOver && !outside; ++faceIndex)
+					{
+						GeometryStage::process(drawCall, faceIndex, stats, [&](const TRShadingPipeline::VertexData *vert)
+						{
+							//Screen space bounding box -> covered tiles
+							glm::ivec2 bounding_min = glm::max(glm::min(vert[0].spos, glm::min(vert[1].spos, vert[2].spos)), glm::ivec2(0));
+							glm::ivec2 bounding_max = glm::min(glm::max(vert[0].spos, glm::max(vert[1].spos, vert[2].spos)),
+								glm::ivec2(cache.width - 1, cache.height - 1));
+							if (bounding_min.x > bounding_max.x || bounding_min.y > bounding_max.y)
+								return;
+
+							const int id = triangles.size();
+							triangles.push_back(TRShadingPipeline::TriangleSetup(vert[0], vert[1], vert[2]));
+							const glm::ivec2 tile_min = bounding_min / BINNING_TILE_SIZE;
+							const glm::ivec2 tile_max = bounding_max / BINNING_TILE_SIZE;
+							for (int ty = tile_min.y; ty <= tile_max.y; ++ty)
+							{
+								for (int tx = tile_min.x; tx <= tile_max.x; ++tx)
+								{
+									bins[ty * cache.numTilesX + tx].push_back(id);
+								}
+							}
+						});
+					}
+					stats.vertexRasterTime += elapsedMilliseconds(start);
+				});
+
+				//Tile stage: rasterization and fragment shading of each tile
+				//Note: triangles of a tile are consumed in submission order, which keeps alpha blending correct
+				parallelFor((size_t)0, (size_t)numTiles, [&](const size_t &t)
+				{
+					TRTraceScope trace("Tile", "pipeline", t);
+					const glm::ivec2 tile_min = glm::ivec2(t % cache.numTilesX, t / cache.numTilesX) * BINNING_TILE_SIZE;
+					const glm::ivec2 tile_max = glm::min(tile_min + glm::ivec2(BINNING_TILE_SIZE - 1),
+						glm::ivec2(cache.width - 1, cache.height - 1));
+
+					auto &fragments = cache.fragments.local();
+					auto &stats = drawCall.frameStats.local();
+					auto start = StatsClock::now();
+					for (int c = 0; c < numChunks; ++c)
+					{
+						auto &bin = cache.chunkBins[c * numTiles + t];
+						const auto &triangles = cache.chunkTriangles[c];
+						for (const auto &id : bin)
+						{
+							TRShadingPipeline::rasterize_fill_edge_function(triangles[id],
+								tile_min, tile_max, fragments, drawCall.frameBuffer->getSamplingNum(), drawCall.coarseDepth());
+							const auto rasterized = StatsClock::now();
+							stats.vertexRasterTime += std::chrono::duration<double, std::milli>(rasterized - start).count();
+							FragmentStage::process(drawCall, fragments, 0, fragments.size(), nullptr, stats);
+							fragments.clear();
+							start = StatsClock::now();
+							stats.fragmentTime += std::chrono::duration<double, std::milli>(start - rasterized).count();
+						}
+						bin.clear();
+					}
+				});
+			}
+		}
+	};
+
 	//----------------------------------------------TRRenderer----------------------------------------------
 
-	TRRenderer::TRRenderer(int width, int height)
-		: m_backBuffer(nullptr), m_frontBuffer(nullptr)
+	TRRenderer::TRRenderer(int width, int height, int samplingNum, TRFrameBufferLayout layout,
+		TRPixelAddressMode addressMode, TRColorFormat colorFormat, TRDepthFormat depthFormat) : m_backBuffer(nullptr)
 	{
-		//Double buffer to avoid flickering
-		m_backBuffer = std::make_shared<TRFrameBuffer>(width, height);
-		m_frontBuffer = std::make_shared<TRFrameBuffer>(width, height);
+		//Only the resolved image is presented, so a single MSAA framebuffer is enough
+		m_backBuffer = std::make_shared<TRFrameBuffer>(width, height, samplingNum, layout, addressMode, colorFormat, depthFormat);
 		m_renderedImg.resize(width * height * 3, 0);
 
+		//Bins of the screen tiles in binning mode, and the rasterized faces & pixel mutexes in streaming mode
+		m_tileBinningCache.reset(new TileBinningCache());
+		m_tileBinningCache->resize(width, height);
+		m_streamingCache.reset(new StreamingPipelineCache());
+		m_streamingCache->resize(width, height);
+
 		//Setup viewport matrix (ndc space -> screen space)
 		m_viewportMatrix = TRMathUtils::calcViewPortMatrix(width, height);
 	}
 
+	//Note: defined here where the pipeline caches are complete
+	TRRenderer::~TRRenderer() = default;
+
 	void TRRenderer::addDrawableMesh(TRDrawableMesh::ptr mesh)
 	{
 		m_drawableMeshes.push_back(mesh);
+		m_sceneBVH.invalidate();
 	}
 
 	void TRRenderer::addDrawableMesh(const std::vector<TRDrawableMesh::ptr> &meshes)
 	{
 		m_drawableMeshes.insert(m_drawableMeshes.end(), meshes.begin(), meshes.end());
+		m_sceneBVH.invalidate();
 	}
 
 	void TRRenderer::unloadDrawableMesh()
@@ -353,6 +783,60 @@ namespace TinyRenderer
 			m_drawableMeshes[i]->clear();
 		}
 		std::vector<TRDrawableMesh::ptr>().swap(m_drawableMeshes);
+		m_sceneBVH.invalidate();
+	}
+
+	void TRRenderer::queryLightInfluencedMeshes(const int &lightIndex, const float &threshold, std::vector<size_t> &meshes)
+	{
+		meshes.clear();
+		if (lightIndex < 0 || lightIndex >= TRShadingPipeline::getNumLights())
+		{
+			std::cerr << "Invalid light source index: " << lightIndex << std::endl;
+			return;
+		}
+		TRLight::ptr light = TRShadingPipeline::getLight(lightIndex);
+		if (light == nullptr)
+			return;
+
+		//Unbounded light source, e.g. the directional light
+		TRBoundingSphere bounds;
+		if (!light->influenceBounds(threshold, bounds))
+		{
+			for (size_t m = 0; m < m_drawableMeshes.size(); ++m)
+			{
+				meshes.push_back(m);
+			}
+			return;
+		}
+
+		if (bounds.isEmpty())
+			return;
+
+		updateSceneBVH();
+		std::vector<TRSceneBVH::Item> items;
+		m_sceneBVH.querySphere(bounds, items);
+		for (const auto &item : items)
+		{
+			meshes.push_back(item.meshIndex);
+		}
+		std::sort(meshes.begin(), meshes.end());
+		meshes.erase(std::unique(meshes.begin(), meshes.end()), meshes.end());
+	}
+
+	bool TRRenderer::pickDrawableMesh(const int &x, const int &y, TRRayHit &hit)
+	{
+		updateSceneBVH();
+
+		//Screen space -> ndc, the ray passes through the pixel center from the near plane to the far plane
+		const glm::vec2 ndc(2.0f * (x + 0.5f) / m_backBuffer->getWidth() - 1.0f,
+			1.0f - 2.0f * (y + 0.5f) / m_backBuffer->getHeight());
+		const glm::mat4 invViewProject = glm::inverse(m_projectMatrix * m_viewMatrix);
+		const glm::vec4 nearPos = invViewProject * glm::vec4(ndc, -1.0f, 1.0f);
+		const glm::vec4 farPos = invViewProject * glm::vec4(ndc, +1.0f, 1.0f);
+		const glm::vec3 origin = glm::vec3(nearPos) / nearPos.w;
+		const glm::vec3 dir = glm::normalize(glm::vec3(farPos) / farPos.w - origin);
+
+		return m_sceneBVH.raycast(m_drawableMeshes, origin, dir, hit);
 	}
 
 	void TRRenderer::setViewerPos(const glm::vec3 &viewer)
@@ -366,10 +850,14 @@ namespace TinyRenderer
 
 	TRLight::ptr TRRenderer::getLightSource(const int &index) { return TRShadingPipeline::getLight(index); }
 
+	void TRRenderer::unloadLightSources() { TRShadingPipeline::clearLights(); }
+
 	void TRRenderer::setExposure(const float &exposure) { TRShadingPipeline::setExposure(exposure); }
 
 	unsigned int TRRenderer::renderAllDrawableMeshes()
 	{
+		TRTraceScope trace("Render", "frame");
+
 		if (m_shader_handler == nullptr)
 		{
 			m_shader_handler = std::make_shared<TR3DShadingPipeline>();
@@ -379,30 +867,83 @@ namespace TinyRenderer
 		m_shader_handler->setModelMatrix(m_modelMatrix);
 		m_shader_handler->setViewProjectMatrix(m_projectMatrix * m_viewMatrix);
 
+		//G-buffer for deferred shading
+		if (m_shading_state.trShadingMode == TRShadingMode::TR_SHADING_DEFERRED)
+		{
+			m_backBuffer->createGBuffer();
+		}
+
 		//Draw a mesh step by step
 		unsigned int num_triangles = 0;
+		resetFrameStats();
 
-		for (size_t m = 0; m < m_drawableMeshes.size(); ++m)
+		//Potentially visible meshes by the scene hierarchy, so that the invisible ones cost nothing
+		//Note: the submeshes of a visible mesh are culled one by one afterwards
+		updateSceneBVH();
+		const unsigned int numVisibleFaces = m_sceneBVH.queryVisibleMeshes(TRFrustum(m_projectMatrix * m_viewMatrix), m_visibleMeshes);
 		{
-			num_triangles += renderDrawableMesh(m);
+			const unsigned int numCulledFaces = m_sceneBVH.getNumFaces() - numVisibleFaces;
+			auto &stats = m_frameStats.local();
+			stats.numTrianglesSubmitted += numCulledFaces;
+			stats.numTrianglesFrustumCulled += numCulledFaces;
+			num_triangles += numCulledFaces;
 		}
 
-		//MSAA resolve stage
-		m_backBuffer->resolve();
+		if (m_depth_prepass_mode == TRDepthPrepassMode::TR_DEPTH_PREPASS_ENABLE)
+		{
+			//Depth-only pass for the opaque meshes
+			for (const auto &m : m_visibleMeshes)
+			{
+				if (isOpaqueDrawableMesh(m))
+				{
+					renderDrawableMesh(m, RenderPass::DEPTH_ONLY_PASS);
+				}
+			}
 
-		//Swap double buffers
+			//Shading pass: each visible sample of the opaque meshes is shaded exactly once
+			for (const auto &m : m_visibleMeshes)
+			{
+				num_triangles += renderDrawableMesh(m, isOpaqueDrawableMesh(m) ?
+					RenderPass::EQUAL_DEPTH_PASS : RenderPass::FORWARD_PASS);
+			}
+		}
+		else
 		{
-			std::swap(m_backBuffer, m_frontBuffer);
+			for (const auto &m : m_visibleMeshes)
+			{
+				num_triangles += renderDrawableMesh(m);
+			}
 		}
 
+		//Deferred lighting stage
+		const auto start = StatsClock::now();
+		LightingStage::process(m_backBuffer.get());
+		m_frameStats.local().fragmentTime += elapsedMilliseconds(start);
+
 		return num_triangles;
 	}
 
+	bool TRRenderer::isOpaqueDrawableMesh(const size_t &index) const
+	{
+		//Note: only the meshes writing their depth and without blending could be rendered in the depth prepass
+		const auto &drawable = m_drawableMeshes[index];
+		return drawable->getAlphablendMode() == TRAlphaBlendingMode::TR_ALPHA_DISABLE &&
+			drawable->getDepthtestMode() == TRDepthTestMode::TR_DEPTH_TEST_ENABLE &&
+			drawable->getDepthwriteMode() == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE;
+	}
+
 	unsigned int TRRenderer::renderDrawableMesh(const size_t &index)
+	{
+		return renderDrawableMesh(index, RenderPass::FORWARD_PASS);
+	}
+
+	unsigned int TRRenderer::renderDrawableMesh(const size_t &index, const RenderPass &pass)
 	{
 		if (index >= m_drawableMeshes.size())
 			return 0;
 
+		TRTraceScope trace(pass == RenderPass::DEPTH_ONLY_PASS ? "Mesh (depth only)" : "Mesh", "pipeline", index);
+
 		unsigned int num_triangles = 0;
 		const auto &drawable = m_drawableMeshes[index];
 		const auto &submeshes = drawable->getDrawableSubMeshes();
@@ -412,6 +953,21 @@ namespace TinyRenderer
 		m_shading_state.trDepthTestMode = drawable->getDepthtestMode();
 		m_shading_state.trDepthWriteMode = drawable->getDepthwriteMode();
 		m_shading_state.trAlphaBlendMode = drawable->getAlphablendMode();
+		m_shading_state.trDepthCompareMode = TRDepthCompareMode::TR_DEPTH_COMPARE_GREATER;
+		m_shading_state.trColorWriteMode = TRColorWriteMode::TR_COLOR_WRITE_ENABLE;
+		switch (pass)
+		{
+		case RenderPass::DEPTH_ONLY_PASS:
+			m_shading_state.trColorWriteMode = TRColorWriteMode::TR_COLOR_WRITE_DISABLE;
+			break;
+		case RenderPass::EQUAL_DEPTH_PASS:
+			//Note: the depth buffer is already filled by the depth-only pass
+			m_shading_state.trDepthCompareMode = TRDepthCompareMode::TR_DEPTH_COMPARE_EQUAL;
+			m_shading_state.trDepthWriteMode = TRDepthWriteMode::TR_DEPTH_WRITE_DISABLE;
+			break;
+		default:
+			break;
+		}
 
 		//Setup the shading options
 		m_shader_handler->setModelMatrix(drawable->getModelMatrix());
@@ -422,6 +978,7 @@ namespace TinyRenderer
 		m_shader_handler->setEmissionColor(drawable->getEmissionCoff());
 		m_shader_handler->setShininess(drawable->getSpecularExponent());
 		m_shader_handler->setTransparency(drawable->getTransparency());
+		m_shader_handler->setToneMapping(!m_backBuffer->isHDR());
 
 		//Note: For those drawables which need the alpha blending, we should make sure the faces rendered in a fixed order 
 		tbb::filter_mode executeMopde = m_shading_state.trAlphaBlendMode == TRAlphaBlendingMode::TR_ALPHA_DISABLE ?
@@ -429,14 +986,25 @@ namespace TinyRenderer
 
 		//Setting for drawcall
 		static int ntokens = tbb::this_task_arena::max_concurrency() * 128;
-		static FragmentCache fragmentCache;
-		static FramebufferMutex framebufferMutex(m_backBuffer->getWidth(), m_backBuffer->getHeight());
+
+		//View frustum in the model space for culling the bounding volumes
+		const TRFrustum frustum(m_projectMatrix * m_viewMatrix * drawable->getModelMatrix());
 
 		for (size_t s = 0; s < submeshes.size(); ++s)
 		{
+			TRTraceScope submeshTrace("Submesh", "pipeline", s);
 			const auto &submesh = submeshes[s];
 			int faceNum = submesh.getIndices().size() / 3;
 			num_triangles += faceNum;
+			auto &stats = m_frameStats.local();
+			stats.numTrianglesSubmitted += faceNum;
+
+			//Invisible submesh, skip it before any vertex shading
+			if (frustum.isOutside(submesh.getBoundingSphere()) || frustum.isOutside(submesh.getBoundingBox()))
+			{
+				stats.numTrianglesFrustumCulled += faceNum;
+				continue;
+			}
 
 			//Texture setting
 			m_shader_handler->setDiffuseTexId(submesh.getDiffuseMapTexId());
@@ -444,24 +1012,55 @@ namespace TinyRenderer
 			m_shader_handler->setNormalTexId(submesh.getNormalMapTexId());
 			m_shader_handler->setGlowTexId(submesh.getGlowMapTexId());
 
+			//Vertex shading of the unique vertices
+			VertexStage::process(submesh.getVertices(), m_shader_handler.get(), m_transformedVertices, m_frameStats);
+
 			//Draw call setting
-			DrawcallSetting drawCall(submesh.getVertices(), submesh.getIndices(), m_shader_handler.get(),
-				m_shading_state, m_viewportMatrix, m_frustum_near_far.x, m_frustum_near_far.y, m_backBuffer.get());
+			DrawcallSetting drawCall(submesh.getVertices(), submesh.getIndices(), m_transformedVertices, m_shader_handler.get(),
+				m_shading_state, m_viewportMatrix, m_frustum_near_far.x, m_frustum_near_far.y, m_backBuffer.get(),
+				frustum, submesh.getFaceBatchBoundingBoxes(), m_frameStats);
 
-			for (int f = 0; f < faceNum; f += PIPELINE_BATCH_SIZE)
+			//Sort-middle tile binning
+			if (m_raster_mode == TRRasterizationMode::TR_RASTER_TILE_BINNING)
 			{
-				int startIndex = f;
-				int overIndex = glm::min(f + PIPELINE_BATCH_SIZE, faceNum);
-				tbb::parallel_pipeline(ntokens, //Number of tokens
-					//Note: Vertex shader and rasterization could be parallelized
-					tbb::make_filter<void, int>(executeMopde,
-						TBBVertexRastFilter(PIPELINE_BATCH_SIZE, startIndex, overIndex, drawCall, fragmentCache)) &
-					//Note: Fragment shaders between different faces could parallelized
-					//      because a mutex lock for framebuffer could avoid conflicts
-					tbb::make_filter<int, void>(executeMopde,
-						TBBFragmentFilter(PIPELINE_BATCH_SIZE, drawCall, fragmentCache, framebufferMutex)));
+				TileBinningPipeline::draw(drawCall, *m_tileBinningCache, faceNum);
 			}
+			else
+			{
+				//Note: per-pixel mutexes are only needed by streaming mode
+				auto &cache = *m_streamingCache;
+				cache.resize(m_backBuffer->getWidth(), m_backBuffer->getHeight());
+				for (int f = 0; f < faceNum; f += PIPELINE_BATCH_SIZE)
+				{
+					//Invisible batch, no pipeline launched
+					if (drawCall.isFaceBatchOutside(f))
+					{
+						stats.numTrianglesFrustumCulled += glm::min(PIPELINE_BATCH_SIZE, faceNum - f);
+						continue;
+					}
 
+					//Note: the alpha blending drawables are traced apart for the cost of the serial in order filters
+					TRTraceScope batchTrace(executeMopde == tbb::filter_mode::parallel ? "Pipeline batch" :
+						"Pipeline batch (serial in order)", "pipeline", f);
+					int startIndex = f;
+					int overIndex = glm::min(f + PIPELINE_BATCH_SIZE, faceNum);
+					tbb::parallel_pipeline(ntokens, //Number of tokens
+						//Note: Vertex shader and rasterization could be parallelized
+						tbb::make_filter<void, int>(executeMopde,
+							TBBVertexRastFilter(PIPELINE_BATCH_SIZE, startIndex, overIndex, drawCall,
+								cache.fragmentCache, cache.currIndex)) &
+						//Note: Fragment shaders between different faces could parallelized
+						//      because a mutex lock for framebuffer could avoid conflicts
+						tbb::make_filter<int, void>(executeMopde,
+							TBBFragmentFilter(PIPELINE_BATCH_SIZE, drawCall, cache.fragmentCache, *cache.framebufferMutex)));
+				}
+			}
+
+			//Refresh the hierarchical z for the following draw calls
+			if (m_shading_state.trDepthWriteMode == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE)
+			{
+				m_backBuffer->updateCoarseDepth();
+			}
 		}
 
 		return num_triangles;
@@ -469,157 +1068,216 @@ namespace TinyRenderer
 
 	unsigned char* TRRenderer::commitRenderedColorBuffer()
 	{
-		const auto &pixelBuffer = m_frontBuffer->getColorBuffer();
-		parallelFor((size_t)0, (size_t)(m_frontBuffer->getWidth() * m_frontBuffer->getHeight()), [&](const size_t &index)
-		{
-			const auto &pixel = pixelBuffer[index];
-			m_renderedImg[index * 3 + 0] = pixel[0][0];
-			m_renderedImg[index * 3 + 1] = pixel[0][1];
-			m_renderedImg[index * 3 + 2] = pixel[0][2];
-		});
+		//MSAA resolve stage
+		//Note: the back buffer is free to be cleared and rendered again right after resolving
+		TRPresentTarget target;
+		target.pixels = m_renderedImg.data();
+		target.pitch = m_backBuffer->getWidth() * 3;
+		target.format = TRPresentFormat::TR_PRESENT_RGB8;
+		commitRenderedColorBuffer(target);
 		return m_renderedImg.data();
 	}
 
-	std::vector<TRShadingPipeline::VertexData> TRRenderer::clipingSutherlandHodgeman(
+	void TRRenderer::commitRenderedColorBuffer(const TRPresentTarget &target)
+	{
+		TRTraceScope trace("Commit", "frame");
+		const auto start = StatsClock::now();
+
+		//Deferred lighting of the pixels left pending, e.g. by renderDrawableMesh() called directly
+		LightingStage::process(m_backBuffer.get());
+
+		//MSAA resolve stage, fused with the format conversion of the target
+		//Note: the HDR colors are tone mapped herein instead of the fragment shaders,
+		//      except for the float target which keeps the HDR values (e.g. for saving EXR)
+		TRPresentTarget resolveTarget = target;
+		if (m_backBuffer->isHDR() && target.format != TRPresentFormat::TR_PRESENT_RGB32F)
+		{
+			resolveTarget.toneMapping = true;
+			resolveTarget.exposure = TRShadingPipeline::getExposure();
+		}
+		const auto resolveStart = StatsClock::now();
+		{
+			TRTraceScope resolveTrace("Resolve", "frame");
+			m_backBuffer->resolve(resolveTarget);
+		}
+
+		auto &stats = m_frameStats.local();
+		stats.resolveTime += elapsedMilliseconds(resolveStart);
+		stats.commitTime += elapsedMilliseconds(start);
+	}
+
+	TRFrameStats &TRFrameStats::operator+=(const TRFrameStats &stats)
+	{
+		numVerticesShaded += stats.numVerticesShaded;
+		numTrianglesSubmitted += stats.numTrianglesSubmitted;
+		numTrianglesClipped += stats.numTrianglesClipped;
+		numTrianglesOutside += stats.numTrianglesOutside;
+		numTrianglesCulled += stats.numTrianglesCulled;
+		numTrianglesFrustumCulled += stats.numTrianglesFrustumCulled;
+		numTrianglesRasterized += stats.numTrianglesRasterized;
+		numQuadsGenerated += stats.numQuadsGenerated;
+		numFragmentsGenerated += stats.numFragmentsGenerated;
+		numFragmentsDepthRejected += stats.numFragmentsDepthRejected;
+		numFragmentsCoverageRejected += stats.numFragmentsCoverageRejected;
+		numFragmentShaderInvocations += stats.numFragmentShaderInvocations;
+		numSamplesWritten += stats.numSamplesWritten;
+		vertexRasterTime += stats.vertexRasterTime;
+		fragmentTime += stats.fragmentTime;
+		resolveTime += stats.resolveTime;
+		commitTime += stats.commitTime;
+		return *this;
+	}
+
+	TRFrameStats TRRenderer::getFrameStats() const
+	{
+		TRFrameStats total;
+		for (const auto &stats : m_frameStats)
+		{
+			total += stats;
+		}
+		return total;
+	}
+
+	void TRRenderer::resetFrameStats()
+	{
+		//Note: keep the thread local storages, only reset their counters
+		for (auto &stats : m_frameStats)
+		{
+			stats = TRFrameStats();
+		}
+	}
+
+	//Clipping planes: w=x, w=-x, w=y, w=-y, w=z, w=-z and w=1e-5
+	enum ClippingPlane { PositiveX = 0, NegativeX, PositiveY, NegativeY, PositiveZ, NegativeZ, PositiveW, ClippingPlaneNum };
+	static constexpr float W_CLIPPING_PLANE = 1e-5f;
+
+	//Signed distance to the clipping plane, the point is inside if it's not negative
+	static inline float clippingPlaneDistance(const glm::vec4 &p, const int &plane, const glm::vec2 &guard_band)
+	{
+		switch (plane)
+		{
+		case PositiveX: return guard_band.x * p.w - p.x;
+		case NegativeX: return guard_band.x * p.w + p.x;
+		case PositiveY: return guard_band.y * p.w - p.y;
+		case NegativeY: return guard_band.y * p.w + p.y;
+		case PositiveZ: return p.w - p.z;
+		case NegativeZ: return p.w + p.z;
+		default:		return p.w - W_CLIPPING_PLANE;
+		}
+	}
+
+	bool TRRenderer::clipingSutherlandHodgeman(
 		const TRShadingPipeline::VertexData &v0,
 		const TRShadingPipeline::VertexData &v1,
 		const TRShadingPipeline::VertexData &v2,
 		const float &near,
-		const float &far)
+		const float &far,
+		ClippingPolygon &clipped_polygon,
+		const glm::vec2 &guard_band)
 	{
 		//Clipping in the homogeneous clipping space
 		//Refs:
 		//https://fabiensanglard.net/polygon_codec/clippingdocument/Clipping.pdf
 		//https://fabiensanglard.net/polygon_codec/
 
-		//Optimization: complete outside or complete inside
-		//Note: in the following situation, we could return the answer without complicate cliping,
-		//      and this optimization should be very important.
-		{
-			auto isPointInsideInClipingFrustum = [](const glm::vec4 &p, const float &near, const float &far) -> bool
-			{
-				return (p.x <= p.w && p.x >= -p.w) && (p.y <= p.w && p.y >= -p.w)
-					&& (p.z <= p.w && p.z >= -p.w) && (p.w <= far && p.w >= near);
-			};
+		clipped_polygon.size = 0;
 
-			//Totally inside
-			if (isPointInsideInClipingFrustum(v0.cpos, near, far) &&
-				isPointInsideInClipingFrustum(v1.cpos, near, far) &&
-				isPointInsideInClipingFrustum(v2.cpos, near, far))
+		//Outcodes: one bit for each clipping plane
+		auto outcode = [&](const glm::vec4 &p, const glm::vec2 &scale) -> int
+		{
+			int code = 0;
+			for (int plane = 0; plane < ClippingPlaneNum; ++plane)
 			{
-				return { v0,v1,v2 };
+				code |= (clippingPlaneDistance(p, plane, scale) < 0) ? (1 << plane) : 0;
 			}
+			return code;
+		};
 
-			//Totally outside
-			if (v0.cpos.w < near && v1.cpos.w < near && v2.cpos.w < near)
-				return{};
-			if (v0.cpos.w > far && v1.cpos.w > far && v2.cpos.w > far)
-				return{};
-			if (v0.cpos.x > v0.cpos.w && v1.cpos.x > v1.cpos.w && v2.cpos.x > v2.cpos.w)
-				return{};
-			if (v0.cpos.x < -v0.cpos.w && v1.cpos.x < -v1.cpos.w && v2.cpos.x < -v2.cpos.w)
-				return{};
-			if (v0.cpos.y > v0.cpos.w && v1.cpos.y > v1.cpos.w && v2.cpos.y > v2.cpos.w)
-				return{};
-			if (v0.cpos.y < -v0.cpos.w && v1.cpos.y < -v1.cpos.w && v2.cpos.y < -v2.cpos.w)
-				return{};
-			if (v0.cpos.z > v0.cpos.w && v1.cpos.z > v1.cpos.w && v2.cpos.z > v2.cpos.w)
-				return{};
-			if (v0.cpos.z < -v0.cpos.w && v1.cpos.z < -v1.cpos.w && v2.cpos.z < -v2.cpos.w)
-				return{};
-		}
-
-		std::vector<TRShadingPipeline::VertexData> inside_vertices;
-		std::vector<TRShadingPipeline::VertexData> tmp = { v0, v1, v2 };
-		enum Axis { X = 0, Y = 1, Z = 2 };
+		//Optimization: complete outside or complete inside
+		//Note: in the following situation, we could return the answer without complicate cliping,
+		//      and this optimization should be very important.
 
-		//w=x plane & w=-x plane
+		//Totally outside of the view frustum (rather than the guard band), plus the near and far range of w
 		{
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::X, +1);
-			tmp = inside_vertices;
-
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::X, -1);
-			tmp = inside_vertices;
+			auto frustumOutcode = [&](const glm::vec4 &p) -> int
+			{
+				return outcode(p, glm::vec2(1.0f)) | ((p.w < near) ? (1 << ClippingPlaneNum) : 0)
+					| ((p.w > far) ? (1 << (ClippingPlaneNum + 1)) : 0);
+			};
+			if ((frustumOutcode(v0.cpos) & frustumOutcode(v1.cpos) & frustumOutcode(v2.cpos)) != 0)
+				return false;
 		}
 
-		//w=y plane & w=-y plane
+		//Totally inside the guard band
+		const int code0 = outcode(v0.cpos, guard_band);
+		const int code1 = outcode(v1.cpos, guard_band);
+		const int code2 = outcode(v2.cpos, guard_band);
+		if ((code0 | code1 | code2) == 0)
 		{
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Y, +1);
-			tmp = inside_vertices;
-
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Y, -1);
-			tmp = inside_vertices;
+			clipped_polygon.push_back(v0);
+			clipped_polygon.push_back(v1);
+			clipped_polygon.push_back(v2);
+			return false;
 		}
 
-		//w=z plane & w=-z plane
+		//Only clip against those planes that are actually crossed
+		//Note: the polygon is clipped back and forth between two buffers on the stack
+		ClippingPolygon tmp;
+		ClippingPolygon *src = &clipped_polygon, *dst = &tmp;
+		src->push_back(v0);
+		src->push_back(v1);
+		src->push_back(v2);
+		const int crossed = code0 | code1 | code2;
+		for (int plane = 0; plane < ClippingPlaneNum && !src->empty(); ++plane)
 		{
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Z, +1);
-			tmp = inside_vertices;
-
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Z, -1);
-			tmp = inside_vertices;
+			if ((crossed & (1 << plane)) == 0)
+				continue;
+			clipingSutherlandHodgeman_aux(*src, plane, guard_band, *dst);
+			std::swap(src, dst);
 		}
 
-		//w=1e-5 plane
+		if (src != &clipped_polygon)
 		{
-			inside_vertices = {};
-			int num_verts = tmp.size();
-			constexpr float w_clipping_plane = 1e-5;
-			for (int i = 0; i < num_verts; ++i)
+			clipped_polygon.size = 0;
+			for (int i = 0; i < src->size; ++i)
 			{
-				const auto &beg_vert = tmp[(i - 1 + num_verts) % num_verts];
-				const auto &end_vert = tmp[i];
-				float beg_is_inside = (beg_vert.cpos.w < w_clipping_plane) ? -1 : 1;
-				float end_is_inside = (end_vert.cpos.w < w_clipping_plane) ? -1 : 1;
-				//One of them is outside
-				if (beg_is_inside * end_is_inside < 0)
-				{
-					// t = (w_clipping_plane-w1)/((w1-w2)
-					float t = (w_clipping_plane - beg_vert.cpos.w) / (beg_vert.cpos.w - end_vert.cpos.w);
-					auto intersected_vert = TRShadingPipeline::VertexData::lerp(beg_vert, end_vert, t);
-					inside_vertices.push_back(intersected_vert);
-				}
-				//If current vertices is inside
-				if (end_is_inside > 0)
-				{
-					inside_vertices.push_back(end_vert);
-				}
+				clipped_polygon.push_back(src->vertices[i]);
 			}
 		}
 
-		return inside_vertices;
+		return true;
 	}
 
-	std::vector<TRShadingPipeline::VertexData> TRRenderer::clipingSutherlandHodgeman_aux(
-		const std::vector<TRShadingPipeline::VertexData> &polygon,
-		const int &axis,
-		const int &side)
+	void TRRenderer::clipingSutherlandHodgeman_aux(
+		const ClippingPolygon &polygon,
+		const int &plane,
+		const glm::vec2 &guard_band,
+		ClippingPolygon &inside_polygon)
 	{
-		std::vector<TRShadingPipeline::VertexData> inside_polygon;
+		inside_polygon.size = 0;
 
-		int num_verts = polygon.size();
+		int num_verts = polygon.size;
 		for (int i = 0; i < num_verts; ++i)
 		{
-			const auto &beg_vert = polygon[(i - 1 + num_verts) % num_verts];
-			const auto &end_vert = polygon[i];
-			char beg_is_inside = ((side * (beg_vert.cpos[axis]) <= beg_vert.cpos.w) ? 1 : -1);
-			char end_is_inside = ((side * (end_vert.cpos[axis]) <= end_vert.cpos.w) ? 1 : -1);
+			const auto &beg_vert = polygon.vertices[(i - 1 + num_verts) % num_verts];
+			const auto &end_vert = polygon.vertices[i];
+			const float beg_dist = clippingPlaneDistance(beg_vert.cpos, plane, guard_band);
+			const float end_dist = clippingPlaneDistance(end_vert.cpos, plane, guard_band);
+			const bool beg_is_inside = beg_dist >= 0;
+			const bool end_is_inside = end_dist >= 0;
 			//One of them is outside
-			if (beg_is_inside * end_is_inside < 0)
+			if (beg_is_inside != end_is_inside)
 			{
-				// t = (w1 - y1)/((w1-y1)-(w2-y2))
-				float t = (beg_vert.cpos.w - side * beg_vert.cpos[axis])
-					/ ((beg_vert.cpos.w - side * beg_vert.cpos[axis]) - (end_vert.cpos.w - side * end_vert.cpos[axis]));
-				auto intersected_vert = TRShadingPipeline::VertexData::lerp(beg_vert, end_vert, t);
-				inside_polygon.push_back(intersected_vert);
+				// t = d1/(d1-d2)
+				float t = beg_dist / (beg_dist - end_dist);
+				inside_polygon.push_back(TRShadingPipeline::VertexData::lerp(beg_vert, end_vert, t));
 			}
 			//If current vertices is inside
-			if (end_is_inside > 0)
+			if (end_is_inside)
 			{
 				inside_polygon.push_back(end_vert);
 			}
 		}
-		return inside_polygon;
 	}
 
 }
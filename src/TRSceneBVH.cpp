@@ -0,0 +1,348 @@
+#include "TRSceneBVH.h"
+
+#include <algorithm>
+
+namespace TinyRenderer
+{
+	//World space bounding box of a submesh
+	//Note: a submesh without bounding volumes computed is never culled
+	static TRBoundingBox calcSubMeshWorldBox(const TRDrawableMesh &mesh, const TRDrawableSubMesh &submesh)
+	{
+		if (submesh.getBoundingBox().isEmpty() && !submesh.getIndices().empty())
+		{
+			TRBoundingBox box;
+			box.min = glm::vec3(-FLT_MAX);
+			box.max = glm::vec3(+FLT_MAX);
+			return box;
+		}
+		return submesh.getBoundingBox().transform(mesh.getModelMatrix());
+	}
+
+	static inline bool isSameBox(const TRBoundingBox &a, const TRBoundingBox &b)
+	{
+		return a.min == b.min && a.max == b.max;
+	}
+
+	//Half of the surface area, the unbounded boxes are left out
+	static inline float calcHalfArea(const TRBoundingBox &box)
+	{
+		if (box.isEmpty())
+			return 0.0f;
+		const glm::vec3 size = box.max - box.min;
+		const float area = size.x * size.y + size.y * size.z + size.z * size.x;
+		return area < FLT_MAX ? area : 0.0f;
+	}
+
+	//----------------------------------------------TRSceneBVH----------------------------------------------
+
+	void TRSceneBVH::update(const std::vector<TRDrawableMesh::ptr> &meshes)
+	{
+		if (!m_valid || meshes.size() != m_meshes.size())
+		{
+			build(meshes);
+			return;
+		}
+
+		//Note: only the moved meshes are refitted, which is much cheaper than rebuilding
+		for (size_t m = 0; m < meshes.size(); ++m)
+		{
+			auto &record = m_meshes[m];
+			const TRDrawableMesh &mesh = *meshes[m];
+			if (record.mesh != &mesh || record.count != static_cast<int>(mesh.getDrawableSubMeshes().size()))
+			{
+				build(meshes);
+				return;
+			}
+			if (record.modelMatrixStamp != mesh.getModelMatrixStamp())
+			{
+				record.modelMatrixStamp = mesh.getModelMatrixStamp();
+				refitLeaves(record, mesh);
+			}
+		}
+
+		//Note: the refitted boxes of the far moved meshes overlap more and more, so rebuild
+		//      once the total area of the nodes (the expected cost of the queries) is doubled
+		if (m_nodesArea > 2.0f * m_builtNodesArea)
+		{
+			build(meshes);
+		}
+	}
+
+	const TRBoundingBox &TRSceneBVH::getBoundingBox() const
+	{
+		static const TRBoundingBox empty;
+		return m_nodes.empty() ? empty : m_nodes[0].box;
+	}
+
+	void TRSceneBVH::build(const std::vector<TRDrawableMesh::ptr> &meshes)
+	{
+		m_numFaces = 0;
+		m_leaves.clear();
+		m_meshes.resize(meshes.size());
+		for (size_t m = 0; m < meshes.size(); ++m)
+		{
+			const TRDrawableMesh &mesh = *meshes[m];
+			const auto &submeshes = mesh.getDrawableSubMeshes();
+			auto &record = m_meshes[m];
+			record.mesh = &mesh;
+			record.modelMatrixStamp = mesh.getModelMatrixStamp();
+			record.numFaces = 0;
+			record.first = static_cast<int>(m_leaves.size());
+			record.count = static_cast<int>(submeshes.size());
+			for (size_t s = 0; s < submeshes.size(); ++s)
+			{
+				Leaf leaf;
+				leaf.item.meshIndex = static_cast<int>(m);
+				leaf.item.submeshIndex = static_cast<int>(s);
+				leaf.box = calcSubMeshWorldBox(mesh, submeshes[s]);
+				m_leaves.push_back(leaf);
+				record.numFaces += submeshes[s].getIndices().size() / 3;
+			}
+			m_numFaces += record.numFaces;
+		}
+
+		m_order.resize(m_leaves.size());
+		for (size_t i = 0; i < m_order.size(); ++i)
+		{
+			m_order[i] = static_cast<int>(i);
+		}
+
+		m_nodes.clear();
+		m_nodes.reserve(m_leaves.size() * 2);
+		if (!m_leaves.empty())
+		{
+			buildRecursive(-1, 0, static_cast<int>(m_leaves.size()));
+		}
+
+		m_nodesArea = 0.0f;
+		for (const auto &node : m_nodes)
+		{
+			m_nodesArea += calcHalfArea(node.box);
+		}
+		m_builtNodesArea = m_nodesArea;
+
+		m_valid = true;
+	}
+
+	int TRSceneBVH::buildRecursive(int parent, int first, int count)
+	{
+		//Note: m_nodes may be reallocated by the recursion, so refer to the node by index
+		const int index = static_cast<int>(m_nodes.size());
+		m_nodes.push_back(Node());
+		m_nodes[index].parent = parent;
+
+		TRBoundingBox box, centroidBox;
+		for (int i = first; i < first + count; ++i)
+		{
+			const auto &leafBox = m_leaves[m_order[i]].box;
+			box.expand(leafBox);
+			if (!leafBox.isEmpty())
+				centroidBox.expand(leafBox.getCenter());
+		}
+		m_nodes[index].box = box;
+
+		if (count <= MAX_LEAF_SIZE || centroidBox.isEmpty())
+		{
+			m_nodes[index].first = first;
+			m_nodes[index].count = count;
+			for (int i = first; i < first + count; ++i)
+			{
+				m_leaves[m_order[i]].node = index;
+			}
+			return index;
+		}
+
+		//Median split along the longest axis of the centroids
+		const glm::vec3 extent = centroidBox.getExtent();
+		const int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+		const int mid = first + count / 2;
+		std::nth_element(m_order.begin() + first, m_order.begin() + mid, m_order.begin() + first + count,
+			[&](const int &a, const int &b)
+		{
+			return m_leaves[a].box.getCenter()[axis] < m_leaves[b].box.getCenter()[axis];
+		});
+
+		buildRecursive(index, first, mid - first);
+		const int right = buildRecursive(index, mid, first + count - mid);
+		m_nodes[index].right = right;
+
+		return index;
+	}
+
+	void TRSceneBVH::refitLeaves(const MeshRecord &record, const TRDrawableMesh &mesh)
+	{
+		const auto &submeshes = mesh.getDrawableSubMeshes();
+		for (int l = record.first; l < record.first + record.count; ++l)
+		{
+			Leaf &leaf = m_leaves[l];
+			leaf.box = calcSubMeshWorldBox(mesh, submeshes[leaf.item.submeshIndex]);
+
+			//Leaf node
+			Node &leafNode = m_nodes[leaf.node];
+			TRBoundingBox box;
+			for (int i = leafNode.first; i < leafNode.first + leafNode.count; ++i)
+			{
+				box.expand(m_leaves[m_order[i]].box);
+			}
+			if (isSameBox(box, leafNode.box))
+				continue;
+			m_nodesArea += calcHalfArea(box) - calcHalfArea(leafNode.box);
+			leafNode.box = box;
+
+			//Up to the root until nothing changes
+			for (int n = leafNode.parent; n != -1; n = m_nodes[n].parent)
+			{
+				TRBoundingBox nodeBox = m_nodes[n + 1].box;
+				nodeBox.expand(m_nodes[m_nodes[n].right].box);
+				if (isSameBox(nodeBox, m_nodes[n].box))
+					break;
+				m_nodesArea += calcHalfArea(nodeBox) - calcHalfArea(m_nodes[n].box);
+				m_nodes[n].box = nodeBox;
+			}
+		}
+	}
+
+	template<typename Overlap, typename Visitor>
+	void TRSceneBVH::traverse(const Overlap &overlap, const Visitor &visitor) const
+	{
+		if (m_nodes.empty())
+			return;
+
+		//Note: the depth of the median split hierarchy is about log2(n)
+		struct Entry { int node; unsigned int mask; };
+		Entry stack[64];
+		int top = 0;
+		stack[top++] = { 0, TRFrustum::ALL_PLANES };
+		while (top > 0)
+		{
+			const Entry entry = stack[--top];
+			const Node &node = m_nodes[entry.node];
+			unsigned int mask = entry.mask;
+			if (!overlap(node.box, mask))
+				continue;
+
+			if (node.count > 0)
+			{
+				for (int i = node.first; i < node.first + node.count; ++i)
+				{
+					const Leaf &leaf = m_leaves[m_order[i]];
+					unsigned int leafMask = mask;
+					if (overlap(leaf.box, leafMask))
+						visitor(leaf);
+				}
+			}
+			else
+			{
+				stack[top++] = { node.right, mask };
+				stack[top++] = { entry.node + 1, mask };
+			}
+		}
+	}
+
+	void TRSceneBVH::queryFrustum(const TRFrustum &frustum, std::vector<Item> &items) const
+	{
+		items.clear();
+		traverse([&](const TRBoundingBox &box, unsigned int &mask) -> bool { return mask == 0 || !frustum.isOutside(box, mask); },
+			[&](const Leaf &leaf) { items.push_back(leaf.item); });
+	}
+
+	void TRSceneBVH::querySphere(const TRBoundingSphere &sphere, std::vector<Item> &items) const
+	{
+		items.clear();
+		traverse([&](const TRBoundingBox &box, unsigned int&) -> bool
+		{
+			if (box.isEmpty())
+				return false;
+			const glm::vec3 d = glm::clamp(sphere.center, box.min, box.max) - sphere.center;
+			return glm::dot(d, d) <= sphere.radius * sphere.radius;
+		},
+			[&](const Leaf &leaf) { items.push_back(leaf.item); });
+	}
+
+	unsigned int TRSceneBVH::queryVisibleMeshes(const TRFrustum &frustum, std::vector<size_t> &meshes) const
+	{
+		meshes.clear();
+		traverse([&](const TRBoundingBox &box, unsigned int &mask) -> bool { return mask == 0 || !frustum.isOutside(box, mask); },
+			[&](const Leaf &leaf) { meshes.push_back(leaf.item.meshIndex); });
+
+		//Note: the meshes are rendered in the order of submission for alpha blending
+		std::sort(meshes.begin(), meshes.end());
+		meshes.erase(std::unique(meshes.begin(), meshes.end()), meshes.end());
+
+		unsigned int numFaces = 0;
+		for (const auto &m : meshes)
+		{
+			numFaces += m_meshes[m].numFaces;
+		}
+		return numFaces;
+	}
+
+	bool TRSceneBVH::raycast(const std::vector<TRDrawableMesh::ptr> &meshes, const glm::vec3 &origin,
+		const glm::vec3 &dir, TRRayHit &hit) const
+	{
+		hit = TRRayHit();
+		const glm::vec3 invDir = 1.0f / dir;
+
+		//Slab test, only the boxes nearer than the current hit are visited
+		auto overlap = [&](const TRBoundingBox &box, unsigned int&) -> bool
+		{
+			if (box.isEmpty())
+				return false;
+			const glm::vec3 t0 = (box.min - origin) * invDir;
+			const glm::vec3 t1 = (box.max - origin) * invDir;
+			const glm::vec3 tmin = glm::min(t0, t1), tmax = glm::max(t0, t1);
+			const float tnear = glm::max(glm::max(tmin.x, tmin.y), glm::max(tmin.z, 0.0f));
+			const float tfar = glm::min(glm::min(tmax.x, tmax.y), tmax.z);
+			return tnear <= tfar && tnear < hit.distance;
+		};
+
+		auto visitor = [&](const Leaf &leaf)
+		{
+			const TRDrawableMesh &mesh = *meshes[leaf.item.meshIndex];
+			const TRDrawableSubMesh &submesh = mesh.getDrawableSubMeshes()[leaf.item.submeshIndex];
+			const auto &vertices = submesh.getVertices();
+			const auto &indices = submesh.getIndices();
+
+			//Note: the ray is transformed into the model space, the distance is the same along the transformed direction
+			const glm::mat4 invModel = glm::inverse(mesh.getModelMatrix());
+			const glm::vec3 o = glm::vec3(invModel * glm::vec4(origin, 1.0f));
+			const glm::vec3 d = glm::vec3(invModel * glm::vec4(dir, 0.0f));
+
+			//Refs: Fast, Minimum Storage Ray/Triangle Intersection, Moller & Trumbore
+			const size_t faceNum = indices.size() / 3;
+			for (size_t f = 0; f < faceNum; ++f)
+			{
+				const glm::vec3 &v0 = vertices[indices[f * 3 + 0]].vpositions;
+				const glm::vec3 e1 = vertices[indices[f * 3 + 1]].vpositions - v0;
+				const glm::vec3 e2 = vertices[indices[f * 3 + 2]].vpositions - v0;
+				const glm::vec3 p = glm::cross(d, e2);
+				const float det = glm::dot(e1, p);
+				if (glm::abs(det) < 1e-12f)
+					continue;
+				const float invDet = 1.0f / det;
+				const glm::vec3 s = o - v0;
+				const float u = glm::dot(s, p) * invDet;
+				if (u < 0.0f || u > 1.0f)
+					continue;
+				const glm::vec3 q = glm::cross(s, e1);
+				const float v = glm::dot(d, q) * invDet;
+				if (v < 0.0f || u + v > 1.0f)
+					continue;
+				const float t = glm::dot(e2, q) * invDet;
+				if (t > 0.0f && t < hit.distance)
+				{
+					hit.meshIndex = leaf.item.meshIndex;
+					hit.submeshIndex = leaf.item.submeshIndex;
+					hit.faceIndex = static_cast<int>(f);
+					hit.distance = t;
+				}
+			}
+		};
+
+		traverse(overlap, visitor);
+		if (hit.meshIndex < 0)
+			return false;
+		hit.position = origin + hit.distance * dir;
+		return true;
+	}
+}
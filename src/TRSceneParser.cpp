@@ -7,6 +7,7 @@
 #include "glm/gtc/matrix_transform.hpp"
 
 #include "TRLight.h"
+#include "TRTracer.h"
 
 namespace TinyRenderer
 {
@@ -26,6 +27,8 @@ namespace TinyRenderer
 
 	void TRSceneParser::parse(const std::string &path, TRRenderer::ptr renderer, bool generatedMipmap)
 	{
+		TRTraceScope trace("Load scene", "asset");
+
 		std::ifstream sceneFile;
 		sceneFile.open(path, std::ios::in);
 
@@ -69,7 +69,7 @@ namespace TinyRenderer
 			glm::vec3(0.25f, 0.25f, 0.25f),
 			glm::vec3(0.125f, 0.125f, 0.125f)
 		};
-		auto& tex = TRShadingPipeline::getTexture2D(m_diffuse_tex_id);
+		auto tex = TRShadingPipeline::getTexture2D(m_diffuse_tex_id);
 		int w = 1000, h = 100;
 		if (tex != nullptr)
 		{
@@ -142,11 +142,7 @@ namespace TinyRenderer
 			fragColor.z + glow_color.z, difftexcolor.a * m_transparency);
 
 		//Tone mapping: HDR -> LDR
-		//Refs: https://learnopengl.com/Advanced-Lighting/HDR
-		{
-			glm::vec3 hdrColor(fragColor);
-			fragColor = glm::vec4(glm::vec3(1.0f - glm::exp(-hdrColor * m_exposure)), fragColor.a);
-		}
+		fragColor = glm::vec4(toneMapping(glm::vec3(fragColor)), fragColor.a);
 	}
 
 	//----------------------------------------------TRBlinPhongShadingPipeline----------------------------------------------
@@ -154,8 +150,14 @@ namespace TinyRenderer
 	void TRBlinnPhongShadingPipeline::fragmentShader(const FragmentData &data, glm::vec4 &fragColor,
 		const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const
 	{
-		fragColor = glm::vec4(0.0f);
+		TRGBufferTexel texel;
+		materialShader(data, texel, dUVdx, dUVdy);
+		fragColor = blinnPhongLighting(texel, m_tone_mapping);
+	}
 
+	bool TRBlinnPhongShadingPipeline::materialShader(const FragmentData &data, TRGBufferTexel &texel,
+		const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const
+	{
 		//Fetch the corresponding color 
 		glm::vec3 amb_color, dif_color, spe_color, glow_color;
 		glm::vec4 difftexcolor = (m_diffuse_tex_id != -1) ? texture2D(m_diffuse_tex_id, data.tex, dUVdx, dUVdy) : glm::vec4(1.0f);
@@ -163,55 +165,24 @@ namespace TinyRenderer
 		spe_color = (m_specular_tex_id != -1) ? glm::vec3(texture2D(m_specular_tex_id, data.tex, dUVdx, dUVdy)) : m_ks;
 		glow_color = (m_glow_tex_id != -1) ? glm::vec3(texture2D(m_glow_tex_id, data.tex, dUVdx, dUVdy)) : m_ke;
 
+		texel.lighting = m_lighting_enable;
+		texel.emission = glow_color;
+
 		//No lighting
 		if (!m_lighting_enable)
 		{
-			fragColor = glm::vec4(glow_color, difftexcolor.a);
-			return;
-		}
-
-		//Calculate the lighting
-		glm::vec3 fragPos = glm::vec3(data.pos);
-		glm::vec3 normal = glm::normalize(data.nor);
-		glm::vec3 viewDir = glm::normalize(m_viewer_pos - fragPos);
-#pragma unroll
-		for (size_t i = 0; i < m_lights.size(); ++i)
-		{
-			const auto &light = m_lights[i];
-			glm::vec3 lightDir = light->direction(fragPos);
-
-			glm::vec3 ambient, diffuse, specular;
-			float attenuation = 1.0f;
-			{
-				//Ambient
-				ambient = light->intensity() * amb_color * m_ka;
-
-				//Diffuse
-				float diffCof = glm::max(glm::dot(normal, lightDir), 0.0f);
-				diffuse = light->intensity() * dif_color * diffCof * m_kd;
-				//diffuse = glm::vec3(diffCof);
-
-				//Blin-Phong Specular
-				glm::vec3 halfwayDir = glm::normalize(viewDir + lightDir);
-				float spec = glm::pow(glm::max(glm::dot(halfwayDir, normal), 0.0f), m_shininess);
-				specular = light->intensity() * spec * spe_color;
-
-				attenuation = light->attenuation(fragPos);
-			}
-
-			float cutoff = light->cutoff(lightDir);
-			fragColor += glm::vec4((ambient + diffuse + specular) * attenuation * cutoff, 0.0f);
+			texel.alpha = difftexcolor.a;
+			return true;
 		}
 
-		fragColor = glm::vec4(fragColor.x + glow_color.x, fragColor.y + glow_color.y,
-			fragColor.z + glow_color.z, difftexcolor.a * m_transparency);
-
-		//Tone mapping: HDR -> LDR
-		//Refs: https://learnopengl.com/Advanced-Lighting/HDR
-		{
-			glm::vec3 hdrColor(fragColor);
-			fragColor = glm::vec4(glm::vec3(1.0f - glm::exp(-hdrColor * m_exposure)), fragColor.a);
-		}
+		texel.pos = glm::vec3(data.pos);
+		texel.normal = glm::normalize(data.nor);
+		texel.ambient = amb_color * m_ka;
+		texel.diffuse = dif_color * m_kd;
+		texel.specular = spe_color;
+		texel.shininess = m_shininess;
+		texel.alpha = difftexcolor.a * m_transparency;
+		return true;
 	}
 
 	//----------------------------------------------TRBlinnPhongNormalMapShadingPipeline----------------------------------------------
@@ -232,8 +203,14 @@ namespace TinyRenderer
 	void TRBlinnPhongNormalMapShadingPipeline::fragmentShader(const FragmentData &data, glm::vec4 &fragColor,
 		const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const
 	{
-		fragColor = glm::vec4(0.0f);
+		TRGBufferTexel texel;
+		materialShader(data, texel, dUVdx, dUVdy);
+		fragColor = blinnPhongLighting(texel, m_tone_mapping);
+	}
 
+	bool TRBlinnPhongNormalMapShadingPipeline::materialShader(const FragmentData &data, TRGBufferTexel &texel,
+		const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const
+	{
 		//Fetch the corresponding color 
 		glm::vec3 amb_color, dif_color, spe_color, glow_color;
 		glm::vec4 difftexcolor = (m_diffuse_tex_id != -1) ? texture2D(m_diffuse_tex_id, data.tex, dUVdx, dUVdy) : glm::vec4(1.0f);
@@ -241,11 +218,14 @@ namespace TinyRenderer
 		spe_color = (m_specular_tex_id != -1) ? glm::vec3(texture2D(m_specular_tex_id, data.tex, dUVdx, dUVdy)) : m_ks;
 		glow_color = (m_glow_tex_id != -1) ? glm::vec3(texture2D(m_glow_tex_id, data.tex, dUVdx, dUVdy)) : m_ke;
 
+		texel.lighting = m_lighting_enable;
+		texel.emission = glow_color;
+
 		//No lighting
 		if (!m_lighting_enable)
 		{
-			fragColor = glm::vec4(glow_color, 1.0f);
-			return;
+			texel.alpha = 1.0f;
+			return true;
 		}
 
 		//Normal
@@ -255,48 +235,15 @@ namespace TinyRenderer
 			normal = glm::vec3(texture2D(m_normal_tex_id, data.tex, dUVdx, dUVdy)) * 2.0f - glm::vec3(1.0f);
 			normal = data.TBN * normal;
 		}
-		normal = glm::normalize(normal);
 
-		//Calculate the lighting
-		glm::vec3 fragPos = glm::vec3(data.pos);
-		glm::vec3 viewDir = glm::normalize(m_viewer_pos - fragPos);
-#pragma unroll
-		for (size_t i = 0; i < m_lights.size(); ++i)
-		{
-			const auto &light = m_lights[i];
-			glm::vec3 lightDir = light->direction(fragPos);
-
-			glm::vec3 ambient, diffuse, specular;
-			float attenuation = 1.0f;
-			{
-				//Ambient
-				ambient = light->intensity() * amb_color;
-
-				//Diffuse
-				float diffCof = glm::max(glm::dot(normal, lightDir), 0.0f);
-				diffuse = light->intensity() * dif_color * diffCof * m_kd;
-
-				//Blin-Phong Specular
-				glm::vec3 halfwayDir = glm::normalize(viewDir + lightDir);
-				float spec = glm::pow(glm::max(glm::dot(halfwayDir, normal), 0.0f), m_shininess);
-				specular = light->intensity() * spec * spe_color;
-
-				attenuation = light->attenuation(fragPos);
-			}
-
-			float cutoff = light->cutoff(lightDir);
-			fragColor += glm::vec4((ambient + diffuse + specular) * attenuation * cutoff, 0.0f);
-		}
-
-		fragColor = glm::vec4(fragColor.x + glow_color.x, fragColor.y + glow_color.y,
-			fragColor.z + glow_color.z, difftexcolor.a * m_transparency);
-
-		//Tone mapping: HDR -> LDR
-		//Refs: https://learnopengl.com/Advanced-Lighting/HDR
-		{
-			glm::vec3 hdrColor(fragColor);
-			fragColor = glm::vec4(glm::vec3(1.0f - glm::exp(-hdrColor * m_exposure)), fragColor.a);
-		}
+		texel.pos = glm::vec3(data.pos);
+		texel.normal = glm::normalize(normal);
+		texel.ambient = amb_color;
+		texel.diffuse = dif_color * m_kd;
+		texel.specular = spe_color;
+		texel.shininess = m_shininess;
+		texel.alpha = difftexcolor.a * m_transparency;
+		return true;
 	}
 
 	//----------------------------------------------TRAlphaBlendingShadingPipeline----------------------------------------------
@@ -2,9 +2,16 @@
 
 #include <algorithm>
 #include <iostream>
+#include <limits>
 
 #include "TRParallelWrapper.h"
 
+//SIMD edge functions evaluation (SSE2 is always available on x86-64)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TR_SIMD_SSE
+#include <emmintrin.h>
+#endif
+
 namespace TinyRenderer
 {
 	//----------------------------------------------VertexData----------------------------------------------
@@ -79,6 +86,62 @@ namespace TinyRenderer
 		v.nor *= w;
 	}
 
+	//----------------------------------------------TriangleSetup----------------------------------------------
+
+	template<typename T>
+	static void setupAttributePlane(const T &a0, const T &a1, const T &a2, const glm::vec2 &e1, const glm::vec2 &e2,
+		const float &one_div_det, TRShadingPipeline::AttributePlane<T> &plane)
+	{
+		//Solve a(x,y) = a0 + dadx * dx + dady * dy, given the values at the three vertices
+		const T d1 = a1 - a0, d2 = a2 - a0;
+		plane.a = a0;
+		plane.dadx = (d1 * e2.y - d2 * e1.y) * one_div_det;
+		plane.dady = (d2 * e1.x - d1 * e2.x) * one_div_det;
+	}
+
+	TRShadingPipeline::TriangleSetup::TriangleSetup(const VertexData &v0, const VertexData &v1, const VertexData &v2)
+	{
+		spos[0] = v0.spos, spos[1] = v1.spos, spos[2] = v2.spos;
+		rhw[0] = v0.rhw, rhw[1] = v1.rhw, rhw[2] = v2.rhw;
+
+		//Screen space gradients of the attributes
+		const glm::vec2 e1 = glm::vec2(v1.spos - v0.spos);
+		const glm::vec2 e2 = glm::vec2(v2.spos - v0.spos);
+		const float det = e1.x * e2.y - e2.x * e1.y;
+		//Note: degenerated triangles are never rasterized
+		const float one_div_det = det != 0.0f ? 1.0f / det : 0.0f;
+		setupAttributePlane(v0.pos, v1.pos, v2.pos, e1, e2, one_div_det, pos);
+		setupAttributePlane(v0.nor, v1.nor, v2.nor, e1, e2, one_div_det, nor);
+		setupAttributePlane(v0.tex, v1.tex, v2.tex, e1, e2, one_div_det, tex);
+		setupAttributePlane(v0.rhw, v1.rhw, v2.rhw, e1, e2, one_div_det, depth);
+		needInterpolatedTBN = v0.needInterpolatedTBN;
+		if (needInterpolatedTBN)
+		{
+			setupAttributePlane(v0.TBN, v1.TBN, v2.TBN, e1, e2, one_div_det, TBN);
+		}
+	}
+
+	void TRShadingPipeline::TriangleSetup::interpolate(const glm::ivec2 &p, FragmentData &data) const
+	{
+		const float dx = p.x - spos[0].x, dy = p.y - spos[0].y;
+		data.spos = p;
+		data.pos = pos.at(dx, dy);
+		data.nor = nor.at(dx, dy);
+		data.tex = tex.at(dx, dy);
+		data.rhw = depth.at(dx, dy);
+		if (needInterpolatedTBN)
+		{
+			data.TBN = TBN.at(dx, dy);
+		}
+		FragmentData::aftPrespCorrection(data);
+	}
+
+	glm::vec2 TRShadingPipeline::TriangleSetup::interpolateTexcoord(const glm::ivec2 &p) const
+	{
+		const float dx = p.x - spos[0].x, dy = p.y - spos[0].y;
+		return tex.at(dx, dy) / depth.at(dx, dy);
+	}
+
 	//----------------------------------------------TRShadingPipeline----------------------------------------------
 
 	std::vector<TRTexture2D::ptr> TRShadingPipeline::m_global_texture_units = {};
@@ -87,12 +150,42 @@ namespace TinyRenderer
 	float TRShadingPipeline::m_exposure = 1.0f;
 
 	void TRShadingPipeline::rasterize_fill_edge_function(
-		const VertexData &v0,
-		const VertexData &v1,
-		const VertexData &v2,
+		const TriangleSetup &triangle,
 		const unsigned int &screen_width,
 		const unsigned int &screene_height,
-		std::vector<QuadFragments> &rasterized_fragments)
+		QuadFragmentsBuffer &rasterized_fragments,
+		const int &sampling_num,
+		const TRFrameBuffer *coarse_depth)
+	{
+		rasterize_fill_edge_function(triangle, glm::ivec2(0, 0), glm::ivec2((int)screen_width - 1, 
+			(int)screene_height - 1), rasterized_fragments, sampling_num, coarse_depth);
+	}
+
+	void TRShadingPipeline::rasterize_fill_edge_function(
+		const TriangleSetup &triangle,
+		const glm::ivec2 &clip_min,
+		const glm::ivec2 &clip_max,
+		QuadFragmentsBuffer &rasterized_fragments,
+		const int &sampling_num,
+		const TRFrameBuffer *coarse_depth)
+	{
+		//Note: dispatch once per triangle, so that the per-sampling loops are unrolled at compile time
+		switch (sampling_num)
+		{
+		case 1: rasterize_fill_edge_function_aux<1>(triangle, clip_min, clip_max, rasterized_fragments.blocks<1>(), coarse_depth); break;
+		case 2: rasterize_fill_edge_function_aux<2>(triangle, clip_min, clip_max, rasterized_fragments.blocks<2>(), coarse_depth); break;
+		case 8: rasterize_fill_edge_function_aux<8>(triangle, clip_min, clip_max, rasterized_fragments.blocks<8>(), coarse_depth); break;
+		default: rasterize_fill_edge_function_aux<4>(triangle, clip_min, clip_max, rasterized_fragments.blocks<4>(), coarse_depth); break;
+		}
+	}
+
+	template<int N>
+	void TRShadingPipeline::rasterize_fill_edge_function_aux(
+		const TriangleSetup &triangle,
+		const glm::ivec2 &clip_min,
+		const glm::ivec2 &clip_max,
+		std::vector<QuadFragments<N>> &rasterized_fragments,
+		const TRFrameBuffer *coarse_depth)
 	{
 		//Edge function rasterization algorithm
 		//Accelerated Half-Space Triangle Rasterization
@@ -100,29 +193,35 @@ namespace TinyRenderer
 		//     Acta Polytechnica Hungarica, 2015, 12(7): 217-236.
 		//	   http://acta.uni-obuda.hu/Mileff_Nehez_Dudra_63.pdf
 
-		VertexData v[] = { v0, v1, v2 };
+		glm::ivec2 spos[] = { triangle.spos[0], triangle.spos[1], triangle.spos[2] };
+		float rhw[] = { triangle.rhw[0], triangle.rhw[1], triangle.rhw[2] };
 		glm::ivec2 bounding_min;
 		glm::ivec2 bounding_max;
-		bounding_min.x = std::max(std::min(v0.spos.x, std::min(v1.spos.x, v2.spos.x)), 0);
-		bounding_min.y = std::max(std::min(v0.spos.y, std::min(v1.spos.y, v2.spos.y)), 0);
-		bounding_max.x = std::min(std::max(v0.spos.x, std::max(v1.spos.x, v2.spos.x)), (int)screen_width - 1);
-		bounding_max.y = std::min(std::max(v0.spos.y, std::max(v1.spos.y, v2.spos.y)), (int)screene_height - 1);
+		bounding_min.x = std::max(std::min(spos[0].x, std::min(spos[1].x, spos[2].x)), clip_min.x);
+		bounding_min.y = std::max(std::min(spos[0].y, std::min(spos[1].y, spos[2].y)), clip_min.y);
+		bounding_max.x = std::min(std::max(spos[0].x, std::max(spos[1].x, spos[2].x)), clip_max.x);
+		bounding_max.y = std::min(std::max(spos[0].y, std::max(spos[1].y, spos[2].y)), clip_max.y);
+
+		//Outside the clipping rectangle
+		if (bounding_min.x > bounding_max.x || bounding_min.y > bounding_max.y)
+			return;
 
 		//Adjust the order
 		{
 			int orient = 0;
-			auto e1 = v1.spos - v0.spos;
-			auto e2 = v2.spos - v0.spos;
+			auto e1 = spos[1] - spos[0];
+			auto e2 = spos[2] - spos[0];
 			orient = e1.x * e2.y - e1.y * e2.x;
 			if (orient > 0)
 			{
-				std::swap(v[1], v[2]);
+				std::swap(spos[1], spos[2]);
+				std::swap(rhw[1], rhw[2]);
 			}
 		}
 
-		const glm::ivec2 &A = v[0].spos;
-		const glm::ivec2 &B = v[1].spos;
-		const glm::ivec2 &C = v[2].spos;
+		const glm::ivec2 &A = spos[0];
+		const glm::ivec2 &B = spos[1];
+		const glm::ivec2 &C = spos[2];
 
 		const int I01 = A.y - B.y, I02 = B.y - C.y, I03 = C.y - A.y;
 		const int J01 = B.x - A.x, J02 = C.x - B.x, J03 = A.x - C.x;
@@ -130,49 +229,140 @@ namespace TinyRenderer
 		const int K02 = B.x * C.y - B.y * C.x;
 		const int K03 = C.x * A.y - C.y * A.x;
 
-		int F01 = I01 * bounding_min.x + J01 * bounding_min.y + K01;
-		int F02 = I02 * bounding_min.x + J02 * bounding_min.y + K02;
-		int F03 = I03 * bounding_min.x + J03 * bounding_min.y + K03;
+		const int F01 = I01 * bounding_min.x + J01 * bounding_min.y + K01;
+		const int F02 = I02 * bounding_min.x + J02 * bounding_min.y + K02;
+		const int F03 = I03 * bounding_min.x + J03 * bounding_min.y + K03;
 
 		//Degenerated to a line or a point
 		if (F01 + F02 + F03 == 0)
 			return;
 
-		rasterized_fragments.reserve((bounding_max.y - bounding_min.y) * (bounding_max.x - bounding_min.x));
-
 		//Top left fill rule
-		const float offset = TRMaskPixelSampler::getSamplingNum() >= 4 ? 0.0 : +1.0;
+		const float offset = N >= 4 ? 0.0 : +1.0;
 		const int E1_t = (((B.y > A.y) || (A.y == B.y && A.x < B.x)) ? 0 : offset);
 		const int E2_t = (((C.y > B.y) || (B.y == C.y && B.x < C.x)) ? 0 : offset);
 		const int E3_t = (((A.y > C.y) || (C.y == A.y && C.x < A.x)) ? 0 : offset);
 
-		int Cy1 = F01, Cy2 = F02, Cy3 = F03;
 		const float one_div_delta = 1.0f / (F01 + F02 + F03);
 
-		//Strict barycenteric weights calculation
-		auto barycentericWeight = [&](const float &x, const float &y) -> glm::vec3
+		constexpr int sampling_num = N;
+
+#ifdef TR_SIMD_SSE
+		//Edge functions of the 2x2 fragments of a quad are evaluated at once (a lane per fragment),
+		//one set of SIMD operations per sampling point, so that the lanes are all busy for any sampling number
+		//Note: E = Cx + quad_offset + sampling_offset, covered if E <= bias
+		const __m128i simd_quad_offset1 = _mm_setr_epi32(0, I01, J01, I01 + J01);
+		const __m128i simd_quad_offset2 = _mm_setr_epi32(0, I02, J02, I02 + J02);
+		const __m128i simd_quad_offset3 = _mm_setr_epi32(0, I03, J03, I03 + J03);
+		__m128 simd_offset[3][sampling_num];
+		{
+			const auto &samplingOffsetArray = TRSamplingPattern<N>::getSamplingOffsets();
+			for (int s = 0; s < sampling_num; ++s)
+			{
+				const glm::vec2 &offset = samplingOffsetArray[s];
+				simd_offset[0][s] = _mm_set1_ps(offset.x * I01 + offset.y * J01);
+				simd_offset[1][s] = _mm_set1_ps(offset.x * I02 + offset.y * J02);
+				simd_offset[2][s] = _mm_set1_ps(offset.x * I03 + offset.y * J03);
+			}
+		}
+		const __m128 simd_bias1 = _mm_set1_ps(-E1_t);
+		const __m128 simd_bias2 = _mm_set1_ps(-E2_t);
+		const __m128 simd_bias3 = _mm_set1_ps(-E3_t);
+		const __m128 simd_one_div_delta = _mm_set1_ps(one_div_delta);
+		const __m128 simd_rhw0 = _mm_set1_ps(rhw[0]);
+		const __m128 simd_rhw1 = _mm_set1_ps(rhw[1]);
+		const __m128 simd_rhw2 = _mm_set1_ps(rhw[2]);
+
+		//Block corners (including the sampling offsets) relative to the block origin
+		const __m128 corner_dx = _mm_setr_ps(-0.5f, TRFrameBuffer::COARSE_DEPTH_BLOCK_SIZE - 0.5f,
+			-0.5f, TRFrameBuffer::COARSE_DEPTH_BLOCK_SIZE - 0.5f);
+		const __m128 corner_dy = _mm_setr_ps(-0.5f, -0.5f,
+			TRFrameBuffer::COARSE_DEPTH_BLOCK_SIZE - 0.5f, TRFrameBuffer::COARSE_DEPTH_BLOCK_SIZE - 0.5f);
+		const __m128 corner_offset1 = _mm_add_ps(_mm_mul_ps(corner_dx, _mm_set1_ps(I01)), _mm_mul_ps(corner_dy, _mm_set1_ps(J01)));
+		const __m128 corner_offset2 = _mm_add_ps(_mm_mul_ps(corner_dx, _mm_set1_ps(I02)), _mm_mul_ps(corner_dy, _mm_set1_ps(J02)));
+		const __m128 corner_offset3 = _mm_add_ps(_mm_mul_ps(corner_dx, _mm_set1_ps(I03)), _mm_mul_ps(corner_dy, _mm_set1_ps(J03)));
+#endif
+
+		//Whether the block is entirely outside one of the edges
+		auto block_is_outside = [&](const int &Cy1, const int &Cy2, const int &Cy3) -> bool
 		{
-			glm::vec3 s[2];
-			s[0] = glm::vec3(v[2].spos.x - v[0].spos.x, v[1].spos.x - v[0].spos.x, v[0].spos.x - x);
-			s[1] = glm::vec3(v[2].spos.y - v[0].spos.y, v[1].spos.y - v[0].spos.y, v[0].spos.y - y);
-			auto uf = glm::cross(s[0], s[1]);
-			return glm::vec3(1.f - (uf.x + uf.y) / uf.z, uf.y / uf.z, uf.x / uf.z);
+#ifdef TR_SIMD_SSE
+			//Edge functions are linear, so checking the 4 corners of the block is enough
+			const __m128 E1 = _mm_add_ps(_mm_set1_ps((float)Cy1), corner_offset1);
+			const __m128 E2 = _mm_add_ps(_mm_set1_ps((float)Cy2), corner_offset2);
+			const __m128 E3 = _mm_add_ps(_mm_set1_ps((float)Cy3), corner_offset3);
+			return _mm_movemask_ps(_mm_cmpgt_ps(E1, simd_bias1)) == 0xF ||
+				_mm_movemask_ps(_mm_cmpgt_ps(E2, simd_bias2)) == 0xF ||
+				_mm_movemask_ps(_mm_cmpgt_ps(E3, simd_bias3)) == 0xF;
+#else
+			return false;
+#endif
 		};
 
+#ifdef TR_SIMD_SSE
+		//Coverage and depth of the 2x2 fragments at (x, y)
+		auto quad_is_inside = [&](const int &x, const int &y, const int &Cx1, const int &Cx2,
+			const int &Cx3, QuadFragments<N> &group) -> bool
+		{
+			//Invalid fragments outside the bounding box: f0 & f2 (left), f1 & f3 (right), f0 & f1 (bottom), f2 & f3 (top)
+			int valid = 0xF;
+			if (x < bounding_min.x) valid &= ~0x5;
+			if (x + 1 > bounding_max.x) valid &= ~0xA;
+			if (y < bounding_min.y) valid &= ~0x3;
+			if (y + 1 > bounding_max.y) valid &= ~0xC;
+
+			//Note: the integer parts are added before the conversion, exactly as the per fragment edge functions
+			const __m128 Cx1_4 = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(Cx1), simd_quad_offset1));
+			const __m128 Cx2_4 = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(Cx2), simd_quad_offset2));
+			const __m128 Cx3_4 = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(Cx3), simd_quad_offset3));
+			int inside = 0;
+#pragma unroll
+			for (int s = 0; s < sampling_num; ++s)
+			{
+				//Edge function
+				const __m128 E1 = _mm_add_ps(Cx1_4, simd_offset[0][s]);
+				const __m128 E2 = _mm_add_ps(Cx2_4, simd_offset[1][s]);
+				const __m128 E3 = _mm_add_ps(Cx3_4, simd_offset[2][s]);
+				//Note: Counter-clockwise winding order
+				const int mask = valid & _mm_movemask_ps(_mm_and_ps(_mm_and_ps(
+					_mm_cmple_ps(E1, simd_bias1),
+					_mm_cmple_ps(E2, simd_bias2)),
+					_mm_cmple_ps(E3, simd_bias3)));
+				if (mask == 0)
+					continue;
+
+				inside |= mask;
+				//Note: each sampling point should have its own depth
+				const __m128 depth = _mm_add_ps(_mm_add_ps(
+					_mm_mul_ps(_mm_mul_ps(E2, simd_one_div_delta), simd_rhw0),
+					_mm_mul_ps(_mm_mul_ps(E3, simd_one_div_delta), simd_rhw1)),
+					_mm_mul_ps(_mm_mul_ps(E1, simd_one_div_delta), simd_rhw2));
+				alignas(16) float depths[4];
+				_mm_store_ps(depths, depth);
+				for (int f = 0; f < 4; ++f)
+				{
+					if ((mask >> f) & 1)
+					{
+						group.coverage[f][s] = 1;//Covered
+						group.coverage_depth[f][s] = depths[f];
+					}
+				}
+			}
+			return inside != 0;
+		};
+#else
 		auto sampling_is_inside = [&](const int &x, const int &y, const int &Cx1, const int &Cx2, 
-			const int &Cx3, FragmentData &p) -> bool
+			const int &Cx3, TRMaskPixelSampler<N> &coverage, TRDepthPixelSampler<N> &coverage_depth) -> bool
 		{
 			//Invalid fragment
-			if (x > bounding_max.x || y > bounding_max.y)
+			if (x < bounding_min.x || y < bounding_min.y || x > bounding_max.x || y > bounding_max.y)
 			{
-				p.spos = glm::ivec2(-1);
 				return false;
 			}
 			bool at_least_one_inside = false;
-			const int samplingNum = TRMaskPixelSampler::getSamplingNum();
-			auto samplingOffsetArray = TRMaskPixelSampler::getSamplingOffsets();
+			const auto &samplingOffsetArray = TRSamplingPattern<N>::getSamplingOffsets();
 #pragma unroll
-			for (int s = 0; s < samplingNum; ++s)
+			for (int s = 0; s < sampling_num; ++s)
 			{
 				const auto &offset = samplingOffsetArray[s];
 				//Edge function
@@ -183,104 +373,111 @@ namespace TinyRenderer
 				if ((E1 + E1_t) <= 0 && (E2 + E2_t) <= 0 && (E3 + E3_t) <= 0)
 				{
 					at_least_one_inside = true;
-					p.coverage[s] = 1;//Covered
+					coverage[s] = 1;//Covered
 					//Note: each sampling point should have its own depth
 					glm::vec3 uvw = glm::vec3(E2, E3, E1) * one_div_delta;
-					p.coverage_depth[s] = VertexData::barycentricLerp(v[0].rhw, v[1].rhw, v[2].rhw, uvw);
+					coverage_depth[s] = VertexData::barycentricLerp(rhw[0], rhw[1], rhw[2], uvw);
 				}
 			}
 
-			if (!at_least_one_inside)
-			{
-				p.spos = glm::ivec2(-1);
-			}
 			return at_least_one_inside;
 		};
+#endif
+
+		//Hierarchical z: the closest depth of the whole triangle.
+		//Note: reversed z, a fragment is occluded if the stored depth >= its depth.
+		const float triangle_max_depth = std::max(rhw[0], std::max(rhw[1], rhw[2]));
+		//Depth plane: rhw(x,y) = rhw(A) + depth_dx * (x - A.x) + depth_dy * (y - A.y)
+		const float depth_dx = (rhw[0] * I02 + rhw[1] * I03 + rhw[2] * I01) * one_div_delta;
+		const float depth_dy = (rhw[0] * J02 + rhw[1] * J03 + rhw[2] * J01) * one_div_delta;
+		const int block_size = TRFrameBuffer::COARSE_DEPTH_BLOCK_SIZE;
+		auto block_is_occluded = [&](const int &bx, const int &by, const float &block_depth) -> bool
+		{
+			//The closest depth of the triangle's plane inside the block (including the sampling offsets)
+			const float xa = bx - 0.5f - A.x, xb = bx + block_size - 0.5f - A.x;
+			const float ya = by - 0.5f - A.y, yb = by + block_size - 0.5f - A.y;
+			float max_depth = rhw[0] + std::max(depth_dx * xa, depth_dx * xb) + std::max(depth_dy * ya, depth_dy * yb);
+			max_depth = std::min(max_depth, triangle_max_depth);
+			return block_depth >= max_depth;
+		};
 
-		for(int y = bounding_min.y;y <= bounding_max.y;y += 2)
+		//Traverse the bounding box block by block, so that the fully occluded blocks could be skipped
+		const int block_min_x = bounding_min.x / block_size, block_max_x = bounding_max.x / block_size;
+		const int block_min_y = bounding_min.y / block_size, block_max_y = bounding_max.y / block_size;
+
+		//Whole triangle rejection
+		if (coarse_depth != nullptr)
 		{
-			int Cx1 = Cy1, Cx2 = Cy2, Cx3 = Cy3;
-#pragma unroll 4
-			for (int x = bounding_min.x; x <= bounding_max.x; x += 2)
+			bool all_occluded = true;
+			for (int by = block_min_y; by <= block_max_y && all_occluded; ++by)
 			{
-				//2x2 fragments block
-				QuadFragments group;
-				bool inside0 = sampling_is_inside(x, y, Cx1, Cx2, Cx3, group.fragments[0]);
-				bool inside1 = sampling_is_inside(x + 1, y, Cx1 + I01, Cx2 + I02, Cx3 + I03, group.fragments[1]);
-				bool inside2 = sampling_is_inside(x, y + 1, Cx1 + J01, Cx2 + J02, Cx3 + J03, group.fragments[2]);
-				bool inside3 = sampling_is_inside(x + 1, y + 1, Cx1 + J01 + I01, Cx2 + J02 + I02, Cx3 + J03 + I03, group.fragments[3]);
-				//Note: at least one of them is inside the triangle.
-				if (inside0 || inside1 || inside2 || inside3)
+				for (int bx = block_min_x; bx <= block_max_x && all_occluded; ++bx)
 				{
-					if (!inside0)//Invalid fragment
-					{
-						group.fragments[0] = VertexData::barycentricLerp(v[0], v[1], v[2], barycentericWeight(x, y));
-						group.fragments[0].spos = glm::ivec2(-1);
-					}
-					else
-					{
-						glm::vec3 uvw(Cx2, Cx3, Cx1);
-						auto coverage = group.fragments[0].coverage;
-						auto coverage_depth = group.fragments[0].coverage_depth;
-						group.fragments[0] = VertexData::barycentricLerp(v[0], v[1], v[2], uvw * one_div_delta);
-						group.fragments[0].spos = glm::ivec2(x, y);
-						group.fragments[0].coverage = coverage;
-						group.fragments[0].coverage_depth = coverage_depth;
-					}
-
-					if (!inside1)//Invalid fragment
-					{
-						group.fragments[1] = VertexData::barycentricLerp(v[0], v[1], v[2], barycentericWeight(x + 1, y));
-						group.fragments[1].spos = glm::ivec2(-1);
-					}
-					else
-					{
-						glm::vec3 uvw(Cx2 + I02, Cx3 + I03, Cx1 + I01);
-						auto coverage = group.fragments[1].coverage;
-						auto coverage_depth = group.fragments[1].coverage_depth;
-						group.fragments[1] = VertexData::barycentricLerp(v[0], v[1], v[2], uvw * one_div_delta);
-						group.fragments[1].spos = glm::ivec2(x + 1, y);
-						group.fragments[1].coverage = coverage;
-						group.fragments[1].coverage_depth = coverage_depth;
-					}
+					all_occluded = coarse_depth->readCoarseDepth(bx, by) >= triangle_max_depth;
+				}
+			}
+			if (all_occluded)
+				return;
+		}
 
-					if (!inside2)//Invalid fragment
-					{
-						group.fragments[2] = VertexData::barycentricLerp(v[0], v[1], v[2], barycentericWeight(x, y + 1));
-						group.fragments[2].spos = glm::ivec2(-1);
-					}
-					else
-					{
-						glm::vec3 uvw(Cx2 + J02, Cx3 + J03, Cx1 + J01);
-						auto coverage = group.fragments[2].coverage;
-						auto coverage_depth = group.fragments[2].coverage_depth;
-						group.fragments[2] = VertexData::barycentricLerp(v[0], v[1], v[2], uvw * one_div_delta);
-						group.fragments[2].spos = glm::ivec2(x, y + 1);
-						group.fragments[2].coverage = coverage;
-						group.fragments[2].coverage_depth = coverage_depth;
-					}
+		rasterized_fragments.reserve((bounding_max.y - bounding_min.y) * (bounding_max.x - bounding_min.x));
 
-					if (!inside3)//Invalid fragment
-					{
-						group.fragments[3] = VertexData::barycentricLerp(v[0], v[1], v[2], barycentericWeight(x + 1, y + 1));
-						group.fragments[3].spos = glm::ivec2(-1);
-					}
-					else
+		for (int by = block_min_y; by <= block_max_y; ++by)
+		{
+			for (int bx = block_min_x; bx <= block_max_x; ++bx)
+			{
+				//Whole block rejection by hierarchical z
+				if (coarse_depth != nullptr && block_is_occluded(bx * block_size, by * block_size,
+					coarse_depth->readCoarseDepth(bx, by)))
+					continue;
+
+				//Note: 2x2 fragments blocks are aligned to even coordinates
+				const int x0 = std::max(bx * block_size, bounding_min.x & ~1);
+				const int y0 = std::max(by * block_size, bounding_min.y & ~1);
+				const int x1 = std::min(bx * block_size + block_size - 1, bounding_max.x);
+				const int y1 = std::min(by * block_size + block_size - 1, bounding_max.y);
+				//Whole block rejection by edge functions
+				const int block_x = bx * block_size, block_y = by * block_size;
+				if (block_is_outside(I01 * block_x + J01 * block_y + K01, I02 * block_x + J02 * block_y + K02,
+					I03 * block_x + J03 * block_y + K03))
+					continue;
+
+				int Cy1 = I01 * x0 + J01 * y0 + K01;
+				int Cy2 = I02 * x0 + J02 * y0 + K02;
+				int Cy3 = I03 * x0 + J03 * y0 + K03;
+
+				for (int y = y0; y <= y1; y += 2)
+				{
+					int Cx1 = Cy1, Cx2 = Cy2, Cx3 = Cy3;
+#pragma unroll 4
+					for (int x = x0; x <= x1; x += 2)
 					{
-						glm::vec3 uvw(Cx2 + J02 + I02, Cx3 + J03 + I03, Cx1 + J01 + I01);
-						auto coverage = group.fragments[3].coverage;
-						auto coverage_depth = group.fragments[3].coverage_depth;
-						group.fragments[3] = VertexData::barycentricLerp(v[0], v[1], v[2], uvw * one_div_delta);
-						group.fragments[3].spos = glm::ivec2(x + 1, y + 1);
-						group.fragments[3].coverage = coverage;
-						group.fragments[3].coverage_depth = coverage_depth;
+						//2x2 fragments block
+						QuadFragments<N> group;
+						group.spos = glm::ivec2(x, y);
+						group.triangle = &triangle;
+#ifdef TR_SIMD_SSE
+						const bool inside = quad_is_inside(x, y, Cx1, Cx2, Cx3, group);
+#else
+						bool inside0 = sampling_is_inside(x, y, Cx1, Cx2, Cx3, group.coverage[0], group.coverage_depth[0]);
+						bool inside1 = sampling_is_inside(x + 1, y, Cx1 + I01, Cx2 + I02, Cx3 + I03,
+							group.coverage[1], group.coverage_depth[1]);
+						bool inside2 = sampling_is_inside(x, y + 1, Cx1 + J01, Cx2 + J02, Cx3 + J03,
+							group.coverage[2], group.coverage_depth[2]);
+						bool inside3 = sampling_is_inside(x + 1, y + 1, Cx1 + J01 + I01, Cx2 + J02 + I02, Cx3 + J03 + I03,
+							group.coverage[3], group.coverage_depth[3]);
+						const bool inside = inside0 || inside1 || inside2 || inside3;
+#endif
+						//Note: at least one of them is inside the triangle.
+						if (inside)
+						{
+							rasterized_fragments.push_back(group);
+						}
+						Cx1 += 2 * I01; Cx2 += 2 * I02; Cx3 += 2 * I03;
 					}
-
-					rasterized_fragments.push_back(group);
+					Cy1 += 2 * J01;	Cy2 += 2 * J02; Cy3 += 2 * J03;
 				}
-				Cx1 += 2 * I01; Cx2 += 2 * I02; Cx3 += 2 * I03;
 			}
-			Cy1 += 2 * J01;	Cy2 += 2 * J02; Cy3 += 2 * J03;
 		}
 	}
 
@@ -312,6 +509,11 @@ namespace TinyRenderer
 		return m_lights[index];
 	}
 
+	void TRShadingPipeline::clearLights()
+	{
+		std::vector<TRLight::ptr>().swap(m_lights);
+	}
+
 	glm::vec4 TRShadingPipeline::texture2D(const unsigned int &id, const glm::vec2 &uv,
 		const glm::vec2 &dUVdx, const glm::vec2 &dUVdy)
 	{
@@ -332,4 +534,48 @@ namespace TinyRenderer
 		}
 	}
 
+	glm::vec4 TRShadingPipeline::blinnPhongLighting(const TRGBufferTexel &texel, const bool &toneMapping)
+	{
+		//No lighting
+		if (!texel.lighting)
+		{
+			return glm::vec4(texel.emission, texel.alpha);
+		}
+
+		//Calculate the lighting
+		glm::vec3 fragColor(0.0f);
+		glm::vec3 viewDir = glm::normalize(m_viewer_pos - texel.pos);
+#pragma unroll
+		for (size_t i = 0; i < m_lights.size(); ++i)
+		{
+			const auto &light = m_lights[i];
+			glm::vec3 lightDir = light->direction(texel.pos);
+
+			glm::vec3 ambient, diffuse, specular;
+			float attenuation = 1.0f;
+			{
+				//Ambient
+				ambient = light->intensity() * texel.ambient;
+
+				//Diffuse
+				float diffCof = glm::max(glm::dot(texel.normal, lightDir), 0.0f);
+				diffuse = light->intensity() * texel.diffuse * diffCof;
+
+				//Blin-Phong Specular
+				glm::vec3 halfwayDir = glm::normalize(viewDir + lightDir);
+				float spec = glm::pow(glm::max(glm::dot(halfwayDir, texel.normal), 0.0f), texel.shininess);
+				specular = light->intensity() * spec * texel.specular;
+
+				attenuation = light->attenuation(texel.pos);
+			}
+
+			float cutoff = light->cutoff(lightDir);
+			fragColor += (ambient + diffuse + specular) * attenuation * cutoff;
+		}
+
+		fragColor += texel.emission;
+
+		return glm::vec4(TRShadingPipeline::toneMapping(fragColor, toneMapping), texel.alpha);
+	}
+
 }
\ No newline at end of file
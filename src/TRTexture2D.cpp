@@ -4,6 +4,7 @@
 #include "stb_image.h"
 
 #include "TRParallelWrapper.h"
+#include "TRTracer.h"
 
 #include <iostream>
 
@@ -29,6 +30,8 @@ namespace TinyRenderer
 		TRTextureWarpMode warpMode,
 		TRTextureFilterMode filterMode)
 	{
+		TRTraceScope trace("Load texture", "asset");
+
 		m_warp_mode = warpMode;
 		m_filtering_mode = filterMode;
 		std::vector<TRTextureHolder::ptr>().swap(m_texHolders);
@@ -101,6 +104,8 @@ namespace TinyRenderer
 
 	void TRTexture2D::generateMipmap(unsigned char *pixels, int width, int height, int channel)
 	{
+		TRTraceScope trace("Generate mipmap", "asset");
+
 		unsigned char *rawData = pixels;
 		bool reAlloc = false;
 
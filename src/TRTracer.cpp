@@ -0,0 +1,176 @@
+#include "TRTracer.h"
+
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
+#include <fstream>
+#include <algorithm>
+#include <iostream>
+
+namespace TinyRenderer
+{
+	//----------------------------------------------TraceBuffer----------------------------------------------
+
+	struct TraceEvent
+	{
+		const char *name;
+		const char *category;
+		std::int64_t timestamp;	//ns since the tracer was enabled
+		long long arg;
+		char phase;				//'B' or 'E'
+	};
+
+	//Ring buffer of a thread
+	//Note: written only by its owner thread, so the head is just published to the dumping thread
+	struct TraceBuffer
+	{
+		int tid = 0;
+		bool mainThread = false;
+		std::vector<TraceEvent> events;
+		std::atomic<size_t> head{ 0 };
+	};
+
+	using TraceClock = std::chrono::steady_clock;
+
+	static std::mutex s_registryMutex;
+	static std::vector<std::unique_ptr<TraceBuffer>> s_buffers;
+	static size_t s_capacity = 1 << 16;
+	static std::thread::id s_mainThread;
+	static TraceClock::time_point s_epoch = TraceClock::now();
+	static thread_local TraceBuffer *t_buffer = nullptr;
+
+	//Note: the registry is only locked by the first event of each thread
+	static TraceBuffer *registerThread()
+	{
+		std::lock_guard<std::mutex> lock(s_registryMutex);
+		std::unique_ptr<TraceBuffer> buffer(new TraceBuffer());
+		buffer->tid = static_cast<int>(s_buffers.size()) + 1;
+		buffer->mainThread = std::this_thread::get_id() == s_mainThread;
+		buffer->events.resize(s_capacity);
+		t_buffer = buffer.get();
+		s_buffers.push_back(std::move(buffer));
+		return t_buffer;
+	}
+
+	static inline void record(const char *name, const char *category, long long arg, char phase)
+	{
+		TraceBuffer *buffer = (t_buffer != nullptr) ? t_buffer : registerThread();
+		const size_t head = buffer->head.load(std::memory_order_relaxed);
+		TraceEvent &event = buffer->events[head % buffer->events.size()];
+		event.name = name;
+		event.category = category;
+		event.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(TraceClock::now() - s_epoch).count();
+		event.arg = arg;
+		event.phase = phase;
+		buffer->head.store(head + 1, std::memory_order_release);
+	}
+
+	//----------------------------------------------TRTracer----------------------------------------------
+
+	std::atomic<bool> TRTracer::s_enabled{ false };
+
+	void TRTracer::enable(size_t capacity)
+	{
+		{
+			std::lock_guard<std::mutex> lock(s_registryMutex);
+			s_capacity = std::max<size_t>(capacity, 1);
+			s_mainThread = std::this_thread::get_id();
+			for (auto &buffer : s_buffers)
+			{
+				buffer->mainThread = buffer.get() == t_buffer;
+				buffer->events.resize(s_capacity);
+				buffer->head.store(0, std::memory_order_relaxed);
+			}
+			s_epoch = TraceClock::now();
+		}
+		s_enabled.store(true, std::memory_order_release);
+	}
+
+	void TRTracer::disable()
+	{
+		s_enabled.store(false, std::memory_order_release);
+	}
+
+	void TRTracer::begin(const char *name, const char *category, long long arg)
+	{
+		record(name, category, arg, 'B');
+	}
+
+	void TRTracer::end(const char *name, const char *category)
+	{
+		record(name, category, -1, 'E');
+	}
+
+	void TRTracer::clear()
+	{
+		std::lock_guard<std::mutex> lock(s_registryMutex);
+		for (auto &buffer : s_buffers)
+		{
+			buffer->head.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	bool TRTracer::dumpChromeTrace(const std::string &path)
+	{
+		std::ofstream file(path);
+		if (!file.is_open())
+		{
+			std::cerr << "Failed to open file: " << path << std::endl;
+			return false;
+		}
+
+		//Json object format of the Trace Event Format, the timestamps are in microseconds
+		//Refs: https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+		std::lock_guard<std::mutex> lock(s_registryMutex);
+		file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"TinySoftRenderer\"}}";
+		int numWorkers = 0;
+		for (const auto &buffer : s_buffers)
+		{
+			file << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid << ",\"args\":{\"name\":\"";
+			if (buffer->mainThread)
+				file << "Main thread";
+			else
+				file << "Worker thread " << ++numWorkers;
+			file << "\"}}";
+			file << ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+				<< ",\"args\":{\"sort_index\":" << (buffer->mainThread ? 0 : buffer->tid) << "}}";
+
+			//Note: only the latest events are kept once the ring buffer wraps around,
+			//      the end events whose begin events were overwritten are skipped
+			const size_t head = buffer->head.load(std::memory_order_acquire);
+			const size_t capacity = buffer->events.size();
+			const size_t first = head > capacity ? head - capacity : 0;
+			int depth = 0;
+			for (size_t i = first; i < head; ++i)
+			{
+				const TraceEvent &event = buffer->events[i % capacity];
+				if (event.phase == 'E')
+				{
+					if (depth == 0)
+						continue;
+					--depth;
+				}
+				else
+				{
+					++depth;
+				}
+
+				char timestamp[32];
+				snprintf(timestamp, sizeof(timestamp), "%.3f", event.timestamp * 1e-3);
+				file << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"" << event.category << "\",\"ph\":\"" << event.phase
+					<< "\",\"ts\":" << timestamp << ",\"pid\":1,\"tid\":" << buffer->tid;
+				if (event.arg >= 0)
+					file << ",\"args\":{\"index\":" << event.arg << "}";
+				file << "}";
+			}
+		}
+		file << "\n]}\n";
+
+		return file.good();
+	}
+}
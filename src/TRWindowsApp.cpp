@@ -140,6 +140,58 @@ namespace TinyRenderer
 			});
 		}
 		SDL_UnlockSurface(m_screen_surface);
+
+		return presentScreenSurface(num_triangles);
+	}
+
+	double TRWindowsApp::updateScreenSurface(
+		TRRenderer::ptr renderer,
+		unsigned int num_triangles)
+	{
+		//Pixel format of the screen surface in memory byte order
+		TRPresentTarget target;
+		target.pitch = m_screen_surface->pitch;
+		bool supported = true;
+		switch (m_screen_surface->format->format)
+		{
+		case SDL_PIXELFORMAT_RGB24:
+			target.format = TRPresentFormat::TR_PRESENT_RGB8;
+			break;
+		case SDL_PIXELFORMAT_RGB888:
+		case SDL_PIXELFORMAT_ARGB8888:
+			target.format = TRPresentFormat::TR_PRESENT_BGRA8;
+			supported = SDL_BYTEORDER == SDL_LIL_ENDIAN;
+			break;
+		case SDL_PIXELFORMAT_BGR888:
+		case SDL_PIXELFORMAT_ABGR8888:
+			target.format = TRPresentFormat::TR_PRESENT_RGBA8;
+			supported = SDL_BYTEORDER == SDL_LIL_ENDIAN;
+			break;
+		default:
+			supported = false;
+			break;
+		}
+
+		//Unsupported format, convert the resolved RGB image pixel by pixel
+		if (!supported)
+		{
+			return updateScreenSurface(renderer->commitRenderedColorBuffer(),
+				m_screen_width, m_screen_height, 3, num_triangles);
+		}
+
+		//Resolve into the surface directly
+		SDL_LockSurface(m_screen_surface);
+		{
+			target.pixels = m_screen_surface->pixels;
+			renderer->commitRenderedColorBuffer(target);
+		}
+		SDL_UnlockSurface(m_screen_surface);
+
+		return presentScreenSurface(num_triangles);
+	}
+
+	double TRWindowsApp::presentScreenSurface(unsigned int num_triangles)
+	{
 		SDL_UpdateWindowSurface(m_window_handle);
 
 		m_delta_time = m_timer.getTicks() - m_last_time_point;
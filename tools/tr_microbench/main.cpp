@@ -0,0 +1,579 @@
+#include "TRRenderer.h"
+#include "TRShaderProgram.h"
+#include "TRFrameBuffer.h"
+#include "TRTexture2D.h"
+#include "TRTextureHolder.h"
+
+#include "tbb/global_control.h"
+#include "tbb/parallel_for.h"
+#include "tbb/enumerable_thread_specific.h"
+
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+using namespace TinyRenderer;
+
+//Micro benchmarks of the hot primitives with synthetic inputs, no scene or asset is required
+//Usage: tr_microbench [filter] [--time seconds] [--threads max]
+//Note: only the benchmarks whose name contains the filter are run, e.g. tr_microbench raster
+
+//----------------------------------------------Benchmark----------------------------------------------
+
+//Keep the results alive so that the compiler can't drop the benchmarked work
+static volatile float g_sink = 0.0f;
+
+static std::string g_filter;
+static double g_minTime = 0.25;//Seconds of each measurement
+
+struct BenchResult
+{
+	double nsPerOp = 0.0;
+	double pixelsPerSec = 0.0;
+};
+
+static bool isSelected(const std::string &name)
+{
+	return g_filter.empty() || name.find(g_filter) != std::string::npos;
+}
+
+//Run func (opsPerRun operations, pixelsPerRun pixels) repeatedly for at least g_minTime,
+//and take the best of 3 measurements to filter out the noise
+template<typename Function>
+static BenchResult runBenchmark(const Function &func, const double &opsPerRun, const double &pixelsPerRun)
+{
+	typedef std::chrono::high_resolution_clock Clock;
+
+	//Warm up and calibration
+	func();
+	size_t runs = 1;
+	while (true)
+	{
+		auto start = Clock::now();
+		for (size_t i = 0; i < runs; ++i)
+			func();
+		double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+		if (elapsed >= g_minTime / 4)
+			break;
+		runs *= 2;
+	}
+
+	double best = 1e30;
+	for (int trial = 0; trial < 3; ++trial)
+	{
+		size_t count = 0;
+		double elapsed = 0.0;
+		auto start = Clock::now();
+		do
+		{
+			for (size_t i = 0; i < runs; ++i)
+				func();
+			count += runs;
+			elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+		} while (elapsed < g_minTime);
+		best = std::min(best, elapsed / count);
+	}
+
+	BenchResult result;
+	result.nsPerOp = best * 1e9 / opsPerRun;
+	result.pixelsPerSec = pixelsPerRun / best;
+	return result;
+}
+
+static void printHeader(const std::string &title)
+{
+	printf("\n----------------------------------------------%s----------------------------------------------\n", title.c_str());
+	printf("%-52s %8s %14s %14s\n", "benchmark", "threads", "ns/op", "Mpixels/s");
+}
+
+static void printResult(const std::string &name, const int &threads, const BenchResult &result)
+{
+	if (result.pixelsPerSec > 0.0)
+		printf("%-52s %8d %14.2f %14.2f\n", name.c_str(), threads, result.nsPerOp, result.pixelsPerSec * 1e-6);
+	else
+		printf("%-52s %8d %14.2f %14s\n", name.c_str(), threads, result.nsPerOp, "-");
+	fflush(stdout);
+}
+
+//Thread counts for the scaling measurements: 1, 2, 4, ... up to the maximum
+static std::vector<int> g_threadCounts;
+
+//----------------------------------------------Rasterization----------------------------------------------
+
+//Right triangle with legs of the given size in pixels
+static TRShadingPipeline::TriangleSetup makeScreenTriangle(const glm::ivec2 &origin, const int &size, const bool &flip)
+{
+	TRShadingPipeline::VertexData v[3];
+	const glm::ivec2 spos[3] = { origin, origin + glm::ivec2(size, 0), origin + glm::ivec2(0, size) };
+	for (int i = 0; i < 3; ++i)
+	{
+		v[i].spos = spos[i];
+		v[i].rhw = 1.0f / (1.0f + 0.1f * i);
+		v[i].pos = glm::vec3(spos[i], 0.0f) * v[i].rhw;
+		v[i].nor = glm::vec3(0.0f, 0.0f, v[i].rhw);
+		v[i].tex = glm::vec2(spos[i]) * (v[i].rhw / 1024.0f);
+	}
+	return flip ? TRShadingPipeline::TriangleSetup(v[0], v[2], v[1]) : TRShadingPipeline::TriangleSetup(v[0], v[1], v[2]);
+}
+
+static void benchRasterization()
+{
+	printHeader("Rasterization");
+
+	const int screenSize = 1024;
+	TRShadingPipeline::QuadFragmentsBuffer fragments;
+
+	//Pick the winding accepted by the rasterizer
+	bool flip = false;
+	TRShadingPipeline::rasterize_fill_edge_function(makeScreenTriangle(glm::ivec2(16), 64, flip),
+		screenSize, screenSize, fragments, 4);
+	if (fragments.empty())
+		flip = true;
+
+	static const int sizes[] = { 2, 8, 32, 128, 512 };
+	static const int samplingNums[] = { 1, 4, 8 };
+	for (int samplingNum : samplingNums)
+	{
+		for (int size : sizes)
+		{
+			const std::string name = "rasterize_fill_edge_function/msaa" + std::to_string(samplingNum)
+				+ "/size" + std::to_string(size);
+			if (!isSelected(name))
+				continue;
+
+			//A batch of triangles at different sub-block offsets
+			std::vector<TRShadingPipeline::TriangleSetup> triangles;
+			for (int i = 0; i < 16; ++i)
+			{
+				triangles.push_back(makeScreenTriangle(glm::ivec2(16 + (i & 3) * 3, 16 + (i >> 2) * 5), size, flip));
+			}
+
+			auto func = [&]()
+			{
+				for (const auto &triangle : triangles)
+				{
+					fragments.clear();
+					TRShadingPipeline::rasterize_fill_edge_function(triangle, screenSize, screenSize, fragments, samplingNum);
+				}
+				g_sink = g_sink + fragments.size();
+			};
+			printResult(name, 1, runBenchmark(func, triangles.size(), triangles.size() * size * size * 0.5));
+		}
+	}
+
+	//Thread scaling: independent triangles spread over the workers
+	const std::string name = "rasterize_fill_edge_function/msaa4/size32/parallel";
+	if (!isSelected(name))
+		return;
+	std::vector<TRShadingPipeline::TriangleSetup> triangles;
+	for (int i = 0; i < 4096; ++i)
+	{
+		triangles.push_back(makeScreenTriangle(glm::ivec2((i * 37) % 960, (i * 53) % 960), 32, flip));
+	}
+	tbb::enumerable_thread_specific<TRShadingPipeline::QuadFragmentsBuffer> localFragments;
+	for (int threads : g_threadCounts)
+	{
+		tbb::global_control control(tbb::global_control::max_allowed_parallelism, threads);
+		auto func = [&]()
+		{
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, triangles.size(), 64), [&](const tbb::blocked_range<size_t> &range)
+			{
+				auto &local = localFragments.local();
+				for (size_t t = range.begin(); t != range.end(); ++t)
+				{
+					local.clear();
+					TRShadingPipeline::rasterize_fill_edge_function(triangles[t], screenSize, screenSize, local, 4);
+				}
+			});
+		};
+		printResult(name, threads, runBenchmark(func, triangles.size(), triangles.size() * 32 * 32 * 0.5));
+	}
+}
+
+//----------------------------------------------Clipping----------------------------------------------
+
+static void benchClipping()
+{
+	printHeader("Clipping");
+
+	const float near = 0.1f, far = 100.0f;
+	//Note: same guard band as the renderer for a 666x500 framebuffer
+	const glm::vec2 guardBand(1.0f + 2.0f * 4096 / 666, 1.0f + 2.0f * 4096 / 500);
+
+	struct ClipCase
+	{
+		std::string name;
+		glm::vec4 cpos[3];
+	};
+	const ClipCase cases[] =
+	{
+		{ "inside",			{ glm::vec4(-0.5f, -0.5f, 0.0f, 1.0f), glm::vec4(0.5f, -0.5f, 0.0f, 1.0f), glm::vec4(0.0f, 0.5f, 0.0f, 1.0f) } },
+		{ "guard_band",		{ glm::vec4(-3.0f, -0.5f, 0.0f, 1.0f), glm::vec4(3.0f, -0.5f, 0.0f, 1.0f), glm::vec4(0.0f, 3.0f, 0.0f, 1.0f) } },
+		{ "outside",		{ glm::vec4(1.5f, -0.5f, 0.0f, 1.0f), glm::vec4(2.5f, -0.5f, 0.0f, 1.0f), glm::vec4(2.0f, 0.5f, 0.0f, 1.0f) } },
+		{ "near_plane",		{ glm::vec4(-0.5f, -0.5f, 0.0f, 1.0f), glm::vec4(0.5f, -0.5f, 0.0f, 1.0f), glm::vec4(0.0f, 0.5f, -2.0f, 1.0f) } },
+		{ "near_far_planes",{ glm::vec4(-0.5f, -0.5f, 2.0f, 1.0f), glm::vec4(0.5f, -0.5f, 0.0f, 1.0f), glm::vec4(0.0f, 0.5f, -2.0f, 1.0f) } },
+		{ "four_planes",	{ glm::vec4(-50.0f, -50.0f, 0.0f, 1.0f), glm::vec4(50.0f, -50.0f, 0.0f, 1.0f), glm::vec4(0.0f, 50.0f, 0.0f, 1.0f) } },
+	};
+
+	for (const auto &clipCase : cases)
+	{
+		const std::string name = "clipingSutherlandHodgeman/" + clipCase.name;
+		if (!isSelected(name))
+			continue;
+
+		TRShadingPipeline::VertexData v[3];
+		for (int i = 0; i < 3; ++i)
+		{
+			v[i].cpos = clipCase.cpos[i];
+			v[i].pos = glm::vec3(clipCase.cpos[i]);
+			v[i].nor = glm::vec3(0.0f, 0.0f, 1.0f);
+			v[i].tex = glm::vec2(clipCase.cpos[i]);
+		}
+
+		const int batch = 256;
+		TRRenderer::ClippingPolygon polygon;
+		auto func = [&]()
+		{
+			int total = 0;
+			for (int i = 0; i < batch; ++i)
+			{
+				TRRenderer::clipingSutherlandHodgeman(v[0], v[1], v[2], near, far, polygon, guardBand);
+				total += polygon.size;
+			}
+			g_sink = g_sink + total;
+		};
+		printResult(name, 1, runBenchmark(func, batch, 0.0));
+	}
+}
+
+//----------------------------------------------Texture sampling----------------------------------------------
+
+static std::vector<unsigned char> makeCheckerboard(const int &size)
+{
+	std::vector<unsigned char> pixels(size * size * 4);
+	for (int y = 0; y < size; ++y)
+	{
+		for (int x = 0; x < size; ++x)
+		{
+			unsigned char *p = &pixels[(y * size + x) * 4];
+			p[0] = static_cast<unsigned char>(x);
+			p[1] = static_cast<unsigned char>(y);
+			p[2] = (((x >> 4) ^ (y >> 4)) & 1) ? 255 : 0;
+			p[3] = 255;
+		}
+	}
+	return pixels;
+}
+
+static void benchTextureSampling()
+{
+	printHeader("Texture sampling");
+
+	const int texSize = 1024;
+	std::vector<unsigned char> pixels = makeCheckerboard(texSize);
+
+	//Texture coordinates: coherent (a small step along a scanline) and random
+	const int batch = 4096;
+	std::vector<glm::vec2> coherentUVs(batch), randomUVs(batch);
+	unsigned int seed = 12345;
+	for (int i = 0; i < batch; ++i)
+	{
+		coherentUVs[i] = glm::vec2((i % 256) / 1024.0f, (i / 256) / 1024.0f);
+		seed = seed * 1664525u + 1013904223u;
+		float u = (seed >> 8) / 16777216.0f;
+		seed = seed * 1664525u + 1013904223u;
+		float v = (seed >> 8) / 16777216.0f;
+		randomUVs[i] = glm::vec2(u, v);
+	}
+
+	//Memory layouts of the texture holders
+	struct LayoutCase
+	{
+		std::string name;
+		TRTextureHolder::ptr holder;
+	};
+	const LayoutCase layouts[] =
+	{
+		{ "linear", std::make_shared<TRLinearTextureHolder>(pixels.data(), texSize, texSize, 4) },
+		{ "tiling", std::make_shared<TRTilingTextureHolder>(pixels.data(), texSize, texSize, 4) },
+		{ "zcurve", std::make_shared<TRZCurveTilingTextureHolder>(pixels.data(), texSize, texSize, 4) },
+	};
+
+	for (const auto &layout : layouts)
+	{
+		for (int filter = 0; filter < 2; ++filter)
+		{
+			for (int pattern = 0; pattern < 2; ++pattern)
+			{
+				const std::string name = "TRTexture2DSampler/" + layout.name + (filter == 0 ? "/nearest" : "/bilinear")
+					+ (pattern == 0 ? "/coherent" : "/random");
+				if (!isSelected(name))
+					continue;
+				const auto &uvs = (pattern == 0) ? coherentUVs : randomUVs;
+				const auto &holder = layout.holder;
+				auto func = [&]()
+				{
+					glm::vec4 sum(0.0f);
+					if (filter == 0)
+					{
+						for (const auto &uv : uvs)
+							sum += TRTexture2DSampler::textureSampling_nearest(holder, uv);
+					}
+					else
+					{
+						for (const auto &uv : uvs)
+							sum += TRTexture2DSampler::textureSampling_bilinear(holder, uv);
+					}
+					g_sink = g_sink + sum.x;
+				};
+				printResult(name, 1, runBenchmark(func, batch, batch));
+			}
+		}
+	}
+
+	//TRTexture2D::sample with the warping, filtering and mipmapping
+	//Note: the texture is loaded from a temporary file since that's the only way to fill it
+	const std::string path = "tr_microbench_texture.ppm";
+	{
+		std::ofstream file(path, std::ios::out | std::ios::binary);
+		file << "P6\n" << texSize << " " << texSize << "\n255\n";
+		for (int i = 0; i < texSize * texSize; ++i)
+			file.write(reinterpret_cast<const char*>(&pixels[i * 4]), 3);
+	}
+	for (int mipmap = 0; mipmap < 2; ++mipmap)
+	{
+		for (int filter = 0; filter < 2; ++filter)
+		{
+			const std::string name = std::string("TRTexture2D::sample") + (mipmap ? "/mipmap" : "/no_mipmap")
+				+ (filter == 0 ? "/nearest" : "/linear");
+			if (!isSelected(name))
+				continue;
+			TRTexture2D texture(mipmap == 1);
+			texture.loadTextureFromFile(path, TRTextureWarpMode::TR_REPEAT,
+				filter == 0 ? TRTextureFilterMode::TR_NEAREST : TRTextureFilterMode::TR_LINEAR);
+			const float level = mipmap ? 1.5f : 0.0f;
+			auto func = [&]()
+			{
+				glm::vec4 sum(0.0f);
+				for (const auto &uv : coherentUVs)
+					sum += texture.sample(uv * 3.0f, level);
+				g_sink = g_sink + sum.x;
+			};
+			printResult(name, 1, runBenchmark(func, batch, batch));
+		}
+	}
+	std::remove(path.c_str());
+}
+
+//----------------------------------------------Framebuffer----------------------------------------------
+
+//Fill the framebuffer with a full-screen pattern, every pixel on an edge (uncompressed) if edges is true
+template<int N>
+static void fillFrameBuffer(TRFrameBuffer &frameBuffer, const bool &edges)
+{
+	TRMaskPixelSampler<N> mask(1);
+	if (edges)
+		mask[0] = 0;
+	for (int y = 0; y < frameBuffer.getHeight(); ++y)
+	{
+		for (int x = 0; x < frameBuffer.getWidth(); ++x)
+		{
+			frameBuffer.writeColorWithMask<N>(x, y, glm::vec4(x / 1024.0f, y / 1024.0f, 0.5f, 1.0f), mask);
+		}
+	}
+}
+
+static void fillFrameBuffer(TRFrameBuffer &frameBuffer, const bool &edges)
+{
+	switch (frameBuffer.getSamplingNum())
+	{
+	case 1: fillFrameBuffer<1>(frameBuffer, edges); break;
+	case 2: fillFrameBuffer<2>(frameBuffer, edges); break;
+	case 8: fillFrameBuffer<8>(frameBuffer, edges); break;
+	default: fillFrameBuffer<4>(frameBuffer, edges); break;
+	}
+}
+
+static void benchFrameBuffer()
+{
+	printHeader("Framebuffer");
+
+	const int width = 1920, height = 1080;
+	const double numPixels = static_cast<double>(width) * height;
+
+	static const int samplingNums[] = { 1, 4, 8 };
+	struct FormatCase
+	{
+		std::string name;
+		TRColorFormat format;
+	};
+	const FormatCase formats[] =
+	{
+		{ "rgba8", TRColorFormat::TR_COLOR_RGBA8 },
+		{ "rgba16f", TRColorFormat::TR_COLOR_RGBA16F },
+		{ "r11g11b10f", TRColorFormat::TR_COLOR_R11G11B10F },
+	};
+
+	//Note: the interleaved layout is unnamed, the sample planes are suffixed with "/planes"
+	struct LayoutCase
+	{
+		std::string name;
+		TRFrameBufferLayout layout;
+	};
+	const LayoutCase layouts[] =
+	{
+		{ "", TRFrameBufferLayout::TR_LAYOUT_INTERLEAVED },
+		{ "/planes", TRFrameBufferLayout::TR_LAYOUT_SAMPLE_PLANES },
+	};
+
+	for (const auto &format : formats)
+	{
+		for (int samplingNum : samplingNums)
+		{
+			for (const auto &layout : layouts)
+			{
+				const std::string prefix = "/" + format.name + "/msaa" + std::to_string(samplingNum) + layout.name;
+				const bool runClear = isSelected("clear" + prefix);
+				const bool runResolve = isSelected("resolve" + prefix + "/compressed") || isSelected("resolve" + prefix + "/edges");
+				if (!runClear && !runResolve)
+					continue;
+
+				TRFrameBuffer frameBuffer(width, height, samplingNum, layout.layout,
+					TRPixelAddressMode::TR_ADDRESS_LINEAR, format.format);
+
+				//Fast clear: flagging the blocks only
+				if (runClear)
+				{
+					for (int threads : g_threadCounts)
+					{
+						tbb::global_control control(tbb::global_control::max_allowed_parallelism, threads);
+						auto func = [&]()
+						{
+							frameBuffer.clearColorAndDepth(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), 0.0f);
+						};
+						printResult("clear" + prefix, threads, runBenchmark(func, 1, numPixels));
+					}
+				}
+
+				//Fused resolve into an RGB8 image
+				std::vector<unsigned char> image(width * height * 3);
+				TRPresentTarget target;
+				target.pixels = image.data();
+				target.pitch = width * 3;
+				target.format = TRPresentFormat::TR_PRESENT_RGB8;
+				target.toneMapping = frameBuffer.isHDR();
+				//Note: there is no edge without MSAA
+				for (int edges = 0; edges < (samplingNum > 1 ? 2 : 1); ++edges)
+				{
+					const std::string name = "resolve" + prefix + (edges ? "/edges" : "/compressed");
+					if (!isSelected(name))
+						continue;
+					frameBuffer.clearColorAndDepth(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), 0.0f);
+					fillFrameBuffer(frameBuffer, edges == 1);
+					for (int threads : g_threadCounts)
+					{
+						tbb::global_control control(tbb::global_control::max_allowed_parallelism, threads);
+						auto func = [&]()
+						{
+							frameBuffer.resolve(target);
+						};
+						printResult(name, threads, runBenchmark(func, 1, numPixels));
+					}
+				}
+			}
+		}
+	}
+}
+
+//----------------------------------------------Vertex shading----------------------------------------------
+
+static void benchVertexShading()
+{
+	printHeader("Vertex shading");
+
+	const int numVertices = 1 << 16;
+	std::vector<TRShadingPipeline::VertexData> input(numVertices), output(numVertices);
+	for (int i = 0; i < numVertices; ++i)
+	{
+		const float t = i / static_cast<float>(numVertices);
+		input[i].pos = glm::vec3(t, glm::sin(t * 100.0f), glm::cos(t * 100.0f));
+		input[i].nor = glm::normalize(glm::vec3(1.0f, t, 1.0f - t));
+		input[i].tex = glm::vec2(t, 1.0f - t);
+		input[i].TBN = glm::mat3(1.0f);
+	}
+
+	struct PipelineCase
+	{
+		std::string name;
+		TRShadingPipeline::ptr pipeline;
+	};
+	const PipelineCase pipelines[] =
+	{
+		{ "blinn", std::make_shared<TRBlinnPhongShadingPipeline>() },
+		{ "normalmap", std::make_shared<TRBlinnPhongNormalMapShadingPipeline>() },
+	};
+
+	for (const auto &pipelineCase : pipelines)
+	{
+		const std::string name = "vertexShader/" + pipelineCase.name;
+		if (!isSelected(name))
+			continue;
+
+		const TRShadingPipeline *pipeline = pipelineCase.pipeline.get();
+		pipelineCase.pipeline->setModelMatrix(glm::mat4(1.0f));
+		pipelineCase.pipeline->setViewProjectMatrix(glm::mat4(1.0f));
+		for (int threads : g_threadCounts)
+		{
+			tbb::global_control control(tbb::global_control::max_allowed_parallelism, threads);
+			auto func = [&]()
+			{
+				parallelFor((size_t)0, (size_t)numVertices, [&](const size_t &index)
+				{
+					TRShadingPipeline::VertexData v = input[index];
+					pipeline->vertexShader(v);
+					output[index] = v;
+				});
+			};
+			printResult(name, threads, runBenchmark(func, numVertices, 0.0));
+		}
+	}
+}
+
+int main(int argc, char* args[])
+{
+	int maxThreads = static_cast<int>(std::thread::hardware_concurrency());
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = args[i];
+		if (arg == "--time" && i + 1 < argc)
+			g_minTime = std::atof(args[++i]);
+		else if (arg == "--threads" && i + 1 < argc)
+			maxThreads = std::atoi(args[++i]);
+		else if (arg == "--help" || arg == "-h")
+		{
+			std::cout << "Usage: tr_microbench [filter] [--time seconds] [--threads max]" << std::endl;
+			return 0;
+		}
+		else
+			g_filter = arg;
+	}
+
+	maxThreads = std::max(1, maxThreads);
+	for (int threads = 1; threads < maxThreads; threads *= 2)
+		g_threadCounts.push_back(threads);
+	g_threadCounts.push_back(maxThreads);
+
+	benchRasterization();
+	benchClipping();
+	benchTextureSampling();
+	benchFrameBuffer();
+	benchVertexShading();
+
+	return 0;
+}
@@ -0,0 +1,239 @@
+#include "TRImageWriter.h"
+
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace TinyRenderer
+{
+	//Byte stream helpers
+	static void appendBE32(std::vector<unsigned char> &buffer, const unsigned int &value)
+	{
+		buffer.push_back(static_cast<unsigned char>(value >> 24));
+		buffer.push_back(static_cast<unsigned char>(value >> 16));
+		buffer.push_back(static_cast<unsigned char>(value >> 8));
+		buffer.push_back(static_cast<unsigned char>(value));
+	}
+
+	static void appendLE32(std::vector<unsigned char> &buffer, const unsigned int &value)
+	{
+		buffer.push_back(static_cast<unsigned char>(value));
+		buffer.push_back(static_cast<unsigned char>(value >> 8));
+		buffer.push_back(static_cast<unsigned char>(value >> 16));
+		buffer.push_back(static_cast<unsigned char>(value >> 24));
+	}
+
+	static void appendLE64(std::vector<unsigned char> &buffer, const unsigned long long &value)
+	{
+		appendLE32(buffer, static_cast<unsigned int>(value));
+		appendLE32(buffer, static_cast<unsigned int>(value >> 32));
+	}
+
+	static void appendFloat(std::vector<unsigned char> &buffer, const float &value)
+	{
+		unsigned int bits;
+		std::memcpy(&bits, &value, 4);
+		appendLE32(buffer, bits);
+	}
+
+	static void appendString(std::vector<unsigned char> &buffer, const char *str)
+	{
+		//Note: including the null terminator
+		buffer.insert(buffer.end(), str, str + std::strlen(str) + 1);
+	}
+
+	static bool writeFile(const std::string &path, const std::vector<unsigned char> &buffer)
+	{
+		std::ofstream file(path, std::ios::out | std::ios::binary);
+		if (!file.is_open())
+		{
+			std::cerr << "Failed to open file: " << path << std::endl;
+			return false;
+		}
+		file.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+		return file.good();
+	}
+
+	//----------------------------------------------PPM----------------------------------------------
+
+	bool TRImageWriter::writePPM(const std::string &path, int width, int height, const unsigned char *rgb)
+	{
+		const std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+		std::vector<unsigned char> buffer(header.begin(), header.end());
+		buffer.insert(buffer.end(), rgb, rgb + width * height * 3);
+		return writeFile(path, buffer);
+	}
+
+	//----------------------------------------------PNG----------------------------------------------
+
+	static unsigned int crc32(const unsigned char *data, const size_t &size, unsigned int crc = 0)
+	{
+		static unsigned int table[256] = { 0 };
+		if (table[1] == 0)
+		{
+			for (unsigned int n = 0; n < 256; ++n)
+			{
+				unsigned int c = n;
+				for (int k = 0; k < 8; ++k)
+					c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+				table[n] = c;
+			}
+		}
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i)
+			crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	static void appendPNGChunk(std::vector<unsigned char> &buffer, const char *type, const std::vector<unsigned char> &data)
+	{
+		appendBE32(buffer, static_cast<unsigned int>(data.size()));
+		const size_t start = buffer.size();
+		buffer.insert(buffer.end(), type, type + 4);
+		buffer.insert(buffer.end(), data.begin(), data.end());
+		appendBE32(buffer, crc32(&buffer[start], buffer.size() - start));
+	}
+
+	bool TRImageWriter::writePNG(const std::string &path, int width, int height, const unsigned char *rgb)
+	{
+		//Raw scanlines, each one starts with the filter type (0: none)
+		const size_t rowSize = width * 3;
+		std::vector<unsigned char> raw;
+		raw.reserve((rowSize + 1) * height);
+		for (int y = 0; y < height; ++y)
+		{
+			raw.push_back(0);
+			raw.insert(raw.end(), rgb + y * rowSize, rgb + (y + 1) * rowSize);
+		}
+
+		//Zlib stream made of uncompressed deflate blocks
+		//Note: the output is meant to be fast to write rather than small
+		std::vector<unsigned char> zlib = { 0x78, 0x01 };
+		unsigned int s1 = 1, s2 = 0;
+		for (size_t offset = 0; offset < raw.size() || offset == 0;)
+		{
+			const size_t size = std::min<size_t>(raw.size() - offset, 65535);
+			const bool final = offset + size == raw.size();
+			zlib.push_back(final ? 1 : 0);
+			zlib.push_back(static_cast<unsigned char>(size));
+			zlib.push_back(static_cast<unsigned char>(size >> 8));
+			zlib.push_back(static_cast<unsigned char>(~size));
+			zlib.push_back(static_cast<unsigned char>(~size >> 8));
+			zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + size);
+			for (size_t i = offset; i < offset + size; ++i)
+			{
+				s1 = (s1 + raw[i]) % 65521;
+				s2 = (s2 + s1) % 65521;
+			}
+			offset += size;
+			if (final)
+				break;
+		}
+		appendBE32(zlib, (s2 << 16) | s1);
+
+		std::vector<unsigned char> ihdr;
+		appendBE32(ihdr, width);
+		appendBE32(ihdr, height);
+		ihdr.push_back(8);//Bit depth
+		ihdr.push_back(2);//Color type: RGB
+		ihdr.push_back(0);//Compression method
+		ihdr.push_back(0);//Filter method
+		ihdr.push_back(0);//No interlace
+
+		std::vector<unsigned char> buffer = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		appendPNGChunk(buffer, "IHDR", ihdr);
+		appendPNGChunk(buffer, "IDAT", zlib);
+		appendPNGChunk(buffer, "IEND", std::vector<unsigned char>());
+		return writeFile(path, buffer);
+	}
+
+	//----------------------------------------------EXR----------------------------------------------
+
+	bool TRImageWriter::writeEXR(const std::string &path, int width, int height, const float *rgb)
+	{
+		//Scanline OpenEXR image without compression, 32-bit float channels
+		//Refs: https://www.openexr.com/documentation/openexrfilelayout.pdf
+		std::vector<unsigned char> buffer = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 };
+
+		//Header attributes: name, type, size and value
+		//Note: the channels must be sorted by name
+		static const char *channels[] = { "B", "G", "R" };
+		appendString(buffer, "channels");
+		appendString(buffer, "chlist");
+		appendLE32(buffer, 3 * 18 + 1);
+		for (const char *channel : channels)
+		{
+			appendString(buffer, channel);
+			appendLE32(buffer, 2);//FLOAT
+			appendLE32(buffer, 0);//pLinear & reserved
+			appendLE32(buffer, 1);//xSampling
+			appendLE32(buffer, 1);//ySampling
+		}
+		buffer.push_back(0);
+
+		appendString(buffer, "compression");
+		appendString(buffer, "compression");
+		appendLE32(buffer, 1);
+		buffer.push_back(0);//NO_COMPRESSION
+
+		for (const char *window : { "dataWindow", "displayWindow" })
+		{
+			appendString(buffer, window);
+			appendString(buffer, "box2i");
+			appendLE32(buffer, 16);
+			appendLE32(buffer, 0);
+			appendLE32(buffer, 0);
+			appendLE32(buffer, width - 1);
+			appendLE32(buffer, height - 1);
+		}
+
+		appendString(buffer, "lineOrder");
+		appendString(buffer, "lineOrder");
+		appendLE32(buffer, 1);
+		buffer.push_back(0);//INCREASING_Y
+
+		appendString(buffer, "pixelAspectRatio");
+		appendString(buffer, "float");
+		appendLE32(buffer, 4);
+		appendFloat(buffer, 1.0f);
+
+		appendString(buffer, "screenWindowCenter");
+		appendString(buffer, "v2f");
+		appendLE32(buffer, 8);
+		appendFloat(buffer, 0.0f);
+		appendFloat(buffer, 0.0f);
+
+		appendString(buffer, "screenWindowWidth");
+		appendString(buffer, "float");
+		appendLE32(buffer, 4);
+		appendFloat(buffer, 1.0f);
+
+		buffer.push_back(0);//End of header
+
+		//Offset table, one scanline per block
+		const unsigned int blockSize = 4 + 4 + width * 3 * 4;
+		const unsigned long long tableEnd = buffer.size() + 8ull * height;
+		for (int y = 0; y < height; ++y)
+		{
+			appendLE64(buffer, tableEnd + static_cast<unsigned long long>(y) * blockSize);
+		}
+
+		//Scanlines: y, size, then the pixels of each channel
+		for (int y = 0; y < height; ++y)
+		{
+			appendLE32(buffer, y);
+			appendLE32(buffer, width * 3 * 4);
+			const float *row = rgb + y * width * 3;
+			for (int c = 2; c >= 0; --c)
+			{
+				for (int x = 0; x < width; ++x)
+				{
+					appendFloat(buffer, row[x * 3 + c]);
+				}
+			}
+		}
+
+		return writeFile(path, buffer);
+	}
+}
@@ -0,0 +1,23 @@
+#ifndef TRIMAGEWRITER_H
+#define TRIMAGEWRITER_H
+
+#include <string>
+
+namespace TinyRenderer
+{
+	//Writing the rendered images to disk without any third-party library
+	class TRImageWriter final
+	{
+	public:
+
+		//8-bit RGB images, row by row (width * height * 3 bytes)
+		static bool writePPM(const std::string &path, int width, int height, const unsigned char *rgb);
+		static bool writePNG(const std::string &path, int width, int height, const unsigned char *rgb);
+
+		//32-bit float RGB images, row by row (width * height * 3 floats)
+		static bool writeEXR(const std::string &path, int width, int height, const float *rgb);
+
+	};
+}
+
+#endif
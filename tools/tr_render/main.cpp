@@ -0,0 +1,218 @@
+#include "TRRenderer.h"
+#include "TRMathUtils.h"
+#include "TRShaderProgram.h"
+#include "TRSceneParser.h"
+#include "TRTracer.h"
+
+#include "TRImageWriter.h"
+
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <iostream>
+
+using namespace TinyRenderer;
+
+//Headless renderer: load a scene, render it offscreen and save the result, no window system involved
+//Usage: tr_render <scene> [-o out.png|out.ppm|out.exr] [-n frames] [-w width] [-h height] [--msaa N]
+//                         [--pipeline blinn|phong|normalmap|texture|alpha] [--hdr] [--deferred] [--binning] [--trace trace.json]
+//Note: the model paths of the scene files are relative (../../models), same as the examples, e.g. run it in build/tools/tr_render:
+//      tr_render ../../scenes/complicatedscene.scene -o complicatedscene.png -n 100
+
+static void printUsage()
+{
+	std::cerr << "Usage: tr_render <scene> [-o out.png|out.ppm|out.exr] [-n frames] [-w width] [-h height] [--msaa N]\n"
+		<< "                          [--pipeline blinn|phong|normalmap|texture|alpha] [--hdr] [--deferred] [--binning]"
+		<< " [--trace trace.json]"
+		<< std::endl;
+}
+
+static bool endsWith(const std::string &str, const std::string &suffix)
+{
+	return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static TRShadingPipeline::ptr createPipeline(const std::string &name)
+{
+	if (name == "blinn")
+		return std::make_shared<TRBlinnPhongShadingPipeline>();
+	if (name == "phong")
+		return std::make_shared<TRPhongShadingPipeline>();
+	if (name == "normalmap")
+		return std::make_shared<TRBlinnPhongNormalMapShadingPipeline>();
+	if (name == "texture")
+		return std::make_shared<TRTextureShadingPipeline>();
+	if (name == "alpha")
+		return std::make_shared<TRAlphaBlendingShadingPipeline>();
+	return nullptr;
+}
+
+int main(int argc, char* args[])
+{
+	if (argc < 2)
+	{
+		printUsage();
+		return -1;
+	}
+
+	std::string scenePath = args[1];
+	std::string outputPath = "output.png";
+	std::string pipelineName = "blinn";
+	std::string tracePath;
+	int width = 666, height = 500;
+	int numFrames = 1;
+	int samplingNum = 4;
+	bool hdr = false, deferred = false, binning = false;
+
+	for (int i = 2; i < argc; ++i)
+	{
+		const std::string arg = args[i];
+		const bool hasValue = i + 1 < argc;
+		if (arg == "-o" && hasValue)
+			outputPath = args[++i];
+		else if (arg == "-n" && hasValue)
+			numFrames = std::max(1, std::atoi(args[++i]));
+		else if (arg == "-w" && hasValue)
+			width = std::atoi(args[++i]);
+		else if (arg == "-h" && hasValue)
+			height = std::atoi(args[++i]);
+		else if (arg == "--msaa" && hasValue)
+			samplingNum = std::atoi(args[++i]);
+		else if (arg == "--pipeline" && hasValue)
+			pipelineName = args[++i];
+		else if (arg == "--hdr")
+			hdr = true;
+		else if (arg == "--deferred")
+			deferred = true;
+		else if (arg == "--binning")
+			binning = true;
+		else if (arg == "--trace" && hasValue)
+			tracePath = args[++i];
+		else
+		{
+			std::cerr << "Unknown option: " << arg << std::endl;
+			printUsage();
+			return -1;
+		}
+	}
+
+	if (width <= 0 || height <= 0)
+	{
+		std::cerr << "Invalid image size: " << width << "x" << height << std::endl;
+		return -1;
+	}
+
+	TRShadingPipeline::ptr pipeline = createPipeline(pipelineName);
+	if (pipeline == nullptr)
+	{
+		std::cerr << "Unknown shading pipeline: " << pipelineName << std::endl;
+		printUsage();
+		return -1;
+	}
+
+	const bool exr = endsWith(outputPath, ".exr");
+	if (!exr && !endsWith(outputPath, ".png") && !endsWith(outputPath, ".ppm"))
+	{
+		std::cerr << "Unsupported output format: " << outputPath << std::endl;
+		return -1;
+	}
+
+	//Note: the asset loading is traced as well, and the events of a face are kept for several frames per thread
+	if (!tracePath.empty())
+		TRTracer::enable(1 << 18);
+
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	TRRenderer::ptr renderer = std::make_shared<TRRenderer>(width, height, samplingNum,
+		TRFrameBufferLayout::TR_LAYOUT_INTERLEAVED, TRPixelAddressMode::TR_ADDRESS_LINEAR,
+		hdr ? TRColorFormat::TR_COLOR_RGBA16F : TRColorFormat::TR_COLOR_RGBA8);
+
+	//Load scene
+	TRSceneParser parser;
+	parser.parse(scenePath, renderer, true);
+
+	renderer->setViewMatrix(TRMathUtils::calcViewMatrix(parser.m_scene.cameraPos,
+		parser.m_scene.cameraFocus, parser.m_scene.cameraUp));
+	renderer->setProjectMatrix(TRMathUtils::calcPerspProjectMatrix(parser.m_scene.frustumFovy,
+		static_cast<float>(width) / height, parser.m_scene.frustumNear, parser.m_scene.frustumFar),
+		parser.m_scene.frustumNear, parser.m_scene.frustumFar);
+
+	renderer->setShaderPipeline(pipeline);
+	if (deferred)
+		renderer->setShadingMode(TRShadingMode::TR_SHADING_DEFERRED);
+	if (binning)
+		renderer->setRasterizationMode(TRRasterizationMode::TR_RASTER_TILE_BINNING);
+
+	auto loadedTime = std::chrono::high_resolution_clock::now();
+
+	//Offscreen rendering loop
+	//Note: the EXR output keeps the linear HDR colors, the other ones are tone mapped 8-bit colors
+	std::vector<unsigned char> image(width * height * 3);
+	std::vector<float> imagef(exr ? width * height * 3 : 0);
+	TRPresentTarget target;
+	target.pixels = exr ? static_cast<void*>(imagef.data()) : static_cast<void*>(image.data());
+	target.pitch = exr ? width * 3 * sizeof(float) : width * 3;
+	target.format = exr ? TRPresentFormat::TR_PRESENT_RGB32F : TRPresentFormat::TR_PRESENT_RGB8;
+
+	unsigned int numTriangles = 0;
+	double totalTime = 0.0, bestTime = 0.0;
+	for (int frame = 0; frame < numFrames; ++frame)
+	{
+		auto frameStart = std::chrono::high_resolution_clock::now();
+
+		renderer->clearColorAndDepth(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), 0.0f);
+		renderer->setViewerPos(parser.m_scene.cameraPos);
+		numTriangles = renderer->renderAllDrawableMeshes();
+		renderer->commitRenderedColorBuffer(target);
+
+		double frameTime = std::chrono::duration<double, std::milli>(
+			std::chrono::high_resolution_clock::now() - frameStart).count();
+		totalTime += frameTime;
+		bestTime = (frame == 0) ? frameTime : std::min(bestTime, frameTime);
+	}
+
+	std::cout << "Scene loading: " << std::chrono::duration<double, std::milli>(loadedTime - startTime).count() << " ms\n"
+		<< "Frames: " << numFrames << ", triangles: " << numTriangles
+		<< ", average: " << totalTime / numFrames << " ms, best: " << bestTime << " ms" << std::endl;
+
+	//Pipeline statistics of the last frame
+	const TRFrameStats stats = renderer->getFrameStats();
+	std::cout << "Triangles: " << stats.numTrianglesSubmitted << " submitted, " << stats.numTrianglesFrustumCulled
+		<< " frustum culled, " << stats.numTrianglesClipped << " clipped, "
+		<< stats.numTrianglesOutside << " outside, " << stats.numTrianglesCulled << " culled, "
+		<< stats.numTrianglesRasterized << " rasterized\n"
+		<< "Fragments: " << stats.numQuadsGenerated << " quads, " << stats.numFragmentsGenerated << " generated, "
+		<< stats.numFragmentsDepthRejected << " depth rejected, " << stats.numFragmentsCoverageRejected << " coverage rejected, "
+		<< stats.numFragmentShaderInvocations << " shaded, " << stats.numSamplesWritten << " samples written\n"
+		<< "Stages (summed over threads): vertex & raster " << stats.vertexRasterTime << " ms, fragment "
+		<< stats.fragmentTime << " ms, resolve " << stats.resolveTime << " ms, commit " << stats.commitTime << " ms" << std::endl;
+
+	if (!tracePath.empty())
+	{
+		TRTracer::disable();
+		if (TRTracer::dumpChromeTrace(tracePath))
+			std::cout << "Trace saved to " << tracePath << std::endl;
+	}
+
+	bool saved = false;
+	if (exr)
+		saved = TRImageWriter::writeEXR(outputPath, width, height, imagef.data());
+	else if (endsWith(outputPath, ".png"))
+		saved = TRImageWriter::writePNG(outputPath, width, height, image.data());
+	else
+		saved = TRImageWriter::writePPM(outputPath, width, height, image.data());
+
+	renderer->unloadDrawableMesh();
+
+	if (!saved)
+	{
+		std::cerr << "Failed to save the image: " << outputPath << std::endl;
+		return -1;
+	}
+
+	std::cout << "Saved to " << outputPath << std::endl;
+
+	return 0;
+}
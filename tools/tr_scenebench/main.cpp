@@ -0,0 +1,368 @@
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+
+#include "TRRenderer.h"
+#include "TRMathUtils.h"
+#include "TRShaderProgram.h"
+#include "TRSceneParser.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+using namespace TinyRenderer;
+
+//End-to-end scene benchmark: render a scripted camera orbit of each scene offscreen and report the frame times
+//Usage: tr_scenebench [scene ...] [--scenes-dir dir] [-n frames] [--warmup frames] [-w width] [-h height]
+//                     [--msaa N] [--pipeline blinn|phong|normalmap|texture|alpha] [--binning] [--deferred] [--json out.json|-]
+//Note: the model paths of the scene files are relative (../../models), same as the examples, e.g. run it in build/tools/tr_scenebench:
+//      tr_scenebench complicatedscene terrain diablo3 -n 200 --json results.json
+
+static void printUsage()
+{
+	std::cerr << "Usage: tr_scenebench [scene ...] [--scenes-dir dir] [-n frames] [--warmup frames] [-w width] [-h height]\n"
+		<< "                     [--msaa N] [--pipeline blinn|phong|normalmap|texture|alpha] [--binning] [--deferred] [--json out.json|-]"
+		<< std::endl;
+}
+
+//All the scenes of build/scenes
+static const char *g_defaultScenes[] =
+{
+	"pointlight", "spotlight", "directionallight", "alpha", "alpha2coverage",
+	"diablo3", "normalmapping", "terrain", "complicatedscene"
+};
+
+struct BenchSetting
+{
+	std::string scenesDir = "../../scenes";
+	std::string pipeline;//Empty: chosen by the scene as the examples do
+	int width = 666, height = 500;
+	int numFrames = 100;
+	int numWarmupFrames = 5;
+	int samplingNum = 4;
+	bool binning = false;
+	bool deferred = false;
+};
+
+struct SceneResult
+{
+	std::string name;
+	std::string pipeline;
+	double loadTime = 0.0;			//ms
+	std::vector<double> frameTimes;	//ms, in the order of rendering
+	unsigned long long numTriangles = 0;
+	TRFrameStats stats;				//Pipeline statistics summed over the measured frames
+
+	double mean = 0.0, p50 = 0.0, p95 = 0.0, p99 = 0.0, best = 0.0, worst = 0.0;
+	double trianglesPerSec = 0.0;
+	double fragmentsPerSec = 0.0;
+};
+
+static bool endsWith(const std::string &str, const std::string &suffix)
+{
+	return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+//Shading pipeline of the corresponding example
+static std::string defaultPipeline(const std::string &scene)
+{
+	if (scene == "alpha" || scene == "alpha2coverage")
+		return "alpha";
+	if (scene == "normalmapping")
+		return "normalmap";
+	return "blinn";
+}
+
+static TRShadingPipeline::ptr createPipeline(const std::string &name)
+{
+	if (name == "blinn")
+		return std::make_shared<TRBlinnPhongShadingPipeline>();
+	if (name == "phong")
+		return std::make_shared<TRPhongShadingPipeline>();
+	if (name == "normalmap")
+		return std::make_shared<TRBlinnPhongNormalMapShadingPipeline>();
+	if (name == "texture")
+		return std::make_shared<TRTextureShadingPipeline>();
+	if (name == "alpha")
+		return std::make_shared<TRAlphaBlendingShadingPipeline>();
+	return nullptr;
+}
+
+//Nearest-rank percentile of the sorted samples
+static double percentile(const std::vector<double> &sorted, const double &p)
+{
+	if (sorted.empty())
+		return 0.0;
+	size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+	rank = std::min(std::max<size_t>(rank, 1), sorted.size());
+	return sorted[rank - 1];
+}
+
+static bool benchScene(const std::string &scene, const BenchSetting &setting, SceneResult &result)
+{
+	typedef std::chrono::high_resolution_clock Clock;
+
+	//Either a scene name of the scenes directory or the path of a scene file
+	std::string path = scene;
+	result.name = scene;
+	if (endsWith(scene, ".scene"))
+	{
+		const size_t slash = scene.find_last_of("/\\");
+		result.name = scene.substr(slash == std::string::npos ? 0 : slash + 1);
+		result.name = result.name.substr(0, result.name.size() - 6);
+	}
+	else
+	{
+		path = setting.scenesDir + "/" + scene + ".scene";
+	}
+
+	result.pipeline = setting.pipeline.empty() ? defaultPipeline(result.name) : setting.pipeline;
+	TRShadingPipeline::ptr pipeline = createPipeline(result.pipeline);
+	if (pipeline == nullptr)
+	{
+		std::cerr << "Unknown shading pipeline: " << result.pipeline << std::endl;
+		return false;
+	}
+
+	if (!std::ifstream(path).good())
+	{
+		std::cerr << "Failed to open scene: " << path << std::endl;
+		return false;
+	}
+
+	auto loadStart = Clock::now();
+
+	TRRenderer::ptr renderer = std::make_shared<TRRenderer>(setting.width, setting.height, setting.samplingNum);
+
+	//Load scene
+	//Note: the parser logs every entity, keep the output of the benchmark clean
+	TRSceneParser parser;
+	std::cout.setstate(std::ios::failbit);
+	parser.parse(path, renderer, true);
+	std::cout.clear();
+
+	renderer->setProjectMatrix(TRMathUtils::calcPerspProjectMatrix(parser.m_scene.frustumFovy,
+		static_cast<float>(setting.width) / setting.height, parser.m_scene.frustumNear, parser.m_scene.frustumFar),
+		parser.m_scene.frustumNear, parser.m_scene.frustumFar);
+	renderer->setShaderPipeline(pipeline);
+	if (setting.deferred)
+		renderer->setShadingMode(TRShadingMode::TR_SHADING_DEFERRED);
+	if (setting.binning)
+		renderer->setRasterizationMode(TRRasterizationMode::TR_RASTER_TILE_BINNING);
+
+	result.loadTime = std::chrono::duration<double, std::milli>(Clock::now() - loadStart).count();
+
+	std::vector<unsigned char> image(setting.width * setting.height * 3);
+	TRPresentTarget target;
+	target.pixels = image.data();
+	target.pitch = setting.width * 3;
+	target.format = TRPresentFormat::TR_PRESENT_RGB8;
+
+	//Scripted camera: one full orbit around the focus over the measured frames
+	const glm::vec3 focus = parser.m_scene.cameraFocus;
+	const glm::vec3 up = parser.m_scene.cameraUp;
+	const glm::vec3 offset = parser.m_scene.cameraPos - focus;
+
+	const int totalFrames = setting.numWarmupFrames + setting.numFrames;
+	result.frameTimes.reserve(setting.numFrames);
+	for (int frame = 0; frame < totalFrames; ++frame)
+	{
+		const int index = std::max(0, frame - setting.numWarmupFrames);
+		const float angle = glm::radians(360.0f) * index / setting.numFrames;
+		const glm::vec3 cameraPos = focus + glm::vec3(glm::rotate(glm::mat4(1.0f), angle, up) * glm::vec4(offset, 0.0f));
+
+		auto frameStart = Clock::now();
+
+		renderer->setViewMatrix(TRMathUtils::calcViewMatrix(cameraPos, focus, up));
+		renderer->clearColorAndDepth(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), 0.0f);
+		renderer->setViewerPos(cameraPos);
+		unsigned int numTriangles = renderer->renderAllDrawableMeshes();
+		renderer->commitRenderedColorBuffer(target);
+
+		const double frameTime = std::chrono::duration<double, std::milli>(Clock::now() - frameStart).count();
+		if (frame >= setting.numWarmupFrames)
+		{
+			result.frameTimes.push_back(frameTime);
+			result.numTriangles += numTriangles;
+			result.stats += renderer->getFrameStats();
+		}
+	}
+
+	renderer->unloadDrawableMesh();
+	renderer->unloadLightSources();
+
+	//Statistics
+	std::vector<double> sorted = result.frameTimes;
+	std::sort(sorted.begin(), sorted.end());
+	double total = 0.0;
+	for (const auto &t : sorted)
+		total += t;
+	result.mean = total / sorted.size();
+	result.p50 = percentile(sorted, 50.0);
+	result.p95 = percentile(sorted, 95.0);
+	result.p99 = percentile(sorted, 99.0);
+	result.best = sorted.front();
+	result.worst = sorted.back();
+	result.trianglesPerSec = result.numTriangles / (total * 1e-3);
+	result.fragmentsPerSec = result.stats.numFragmentsGenerated / (total * 1e-3);
+
+	return true;
+}
+
+static std::string toJson(const BenchSetting &setting, const std::vector<SceneResult> &results)
+{
+	std::ostringstream json;
+	json.precision(6);
+	json << std::fixed;
+	json << "{\n"
+		<< "  \"width\": " << setting.width << ",\n"
+		<< "  \"height\": " << setting.height << ",\n"
+		<< "  \"msaa\": " << setting.samplingNum << ",\n"
+		<< "  \"rasterization\": \"" << (setting.binning ? "binning" : "streaming") << "\",\n"
+		<< "  \"shading\": \"" << (setting.deferred ? "deferred" : "forward") << "\",\n"
+		<< "  \"frames\": " << setting.numFrames << ",\n"
+		<< "  \"warmup_frames\": " << setting.numWarmupFrames << ",\n"
+		<< "  \"scenes\": [";
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const SceneResult &r = results[i];
+		json << (i == 0 ? "\n" : ",\n")
+			<< "    {\n"
+			<< "      \"name\": \"" << r.name << "\",\n"
+			<< "      \"pipeline\": \"" << r.pipeline << "\",\n"
+			<< "      \"load_ms\": " << r.loadTime << ",\n"
+			<< "      \"frame_ms\": { \"mean\": " << r.mean << ", \"p50\": " << r.p50 << ", \"p95\": " << r.p95
+			<< ", \"p99\": " << r.p99 << ", \"min\": " << r.best << ", \"max\": " << r.worst << " },\n"
+			<< "      \"fps\": " << 1000.0 / r.mean << ",\n"
+			<< "      \"triangles_per_frame\": " << r.numTriangles / r.frameTimes.size() << ",\n"
+			<< "      \"triangles_per_sec\": " << r.trianglesPerSec << ",\n"
+			<< "      \"fragments_per_sec\": " << r.fragmentsPerSec << ",\n";
+
+		//Note: average per frame, the stage times are summed over the worker threads
+		const TRFrameStats &s = r.stats;
+		const double n = static_cast<double>(r.frameTimes.size());
+		json << "      \"stats_per_frame\": {\n"
+			<< "        \"vertices_shaded\": " << s.numVerticesShaded / n << ",\n"
+			<< "        \"triangles_submitted\": " << s.numTrianglesSubmitted / n << ",\n"
+			<< "        \"triangles_frustum_culled\": " << s.numTrianglesFrustumCulled / n << ",\n"
+			<< "        \"triangles_clipped\": " << s.numTrianglesClipped / n << ",\n"
+			<< "        \"triangles_outside\": " << s.numTrianglesOutside / n << ",\n"
+			<< "        \"triangles_culled\": " << s.numTrianglesCulled / n << ",\n"
+			<< "        \"triangles_rasterized\": " << s.numTrianglesRasterized / n << ",\n"
+			<< "        \"quads\": " << s.numQuadsGenerated / n << ",\n"
+			<< "        \"fragments\": " << s.numFragmentsGenerated / n << ",\n"
+			<< "        \"fragments_depth_rejected\": " << s.numFragmentsDepthRejected / n << ",\n"
+			<< "        \"fragments_coverage_rejected\": " << s.numFragmentsCoverageRejected / n << ",\n"
+			<< "        \"fragment_shader_invocations\": " << s.numFragmentShaderInvocations / n << ",\n"
+			<< "        \"samples_written\": " << s.numSamplesWritten / n << ",\n"
+			<< "        \"vertex_raster_ms\": " << s.vertexRasterTime / n << ",\n"
+			<< "        \"fragment_ms\": " << s.fragmentTime / n << ",\n"
+			<< "        \"resolve_ms\": " << s.resolveTime / n << ",\n"
+			<< "        \"commit_ms\": " << s.commitTime / n << "\n"
+			<< "      },\n"
+			<< "      \"frame_times_ms\": [";
+		for (size_t f = 0; f < r.frameTimes.size(); ++f)
+			json << (f == 0 ? "" : ", ") << r.frameTimes[f];
+		json << "]\n    }";
+	}
+	json << "\n  ]\n}\n";
+	return json.str();
+}
+
+int main(int argc, char* args[])
+{
+	BenchSetting setting;
+	std::vector<std::string> scenes;
+	std::string jsonPath;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = args[i];
+		const bool hasValue = i + 1 < argc;
+		if (arg == "--scenes-dir" && hasValue)
+			setting.scenesDir = args[++i];
+		else if (arg == "-n" && hasValue)
+			setting.numFrames = std::max(1, std::atoi(args[++i]));
+		else if (arg == "--warmup" && hasValue)
+			setting.numWarmupFrames = std::max(0, std::atoi(args[++i]));
+		else if (arg == "-w" && hasValue)
+			setting.width = std::atoi(args[++i]);
+		else if (arg == "-h" && hasValue)
+			setting.height = std::atoi(args[++i]);
+		else if (arg == "--msaa" && hasValue)
+			setting.samplingNum = std::atoi(args[++i]);
+		else if (arg == "--pipeline" && hasValue)
+			setting.pipeline = args[++i];
+		else if (arg == "--binning")
+			setting.binning = true;
+		else if (arg == "--deferred")
+			setting.deferred = true;
+		else if (arg == "--json" && hasValue)
+			jsonPath = args[++i];
+		else if (!arg.empty() && arg[0] == '-')
+		{
+			std::cerr << "Unknown option: " << arg << std::endl;
+			printUsage();
+			return -1;
+		}
+		else
+			scenes.push_back(arg);
+	}
+
+	if (setting.width <= 0 || setting.height <= 0)
+	{
+		std::cerr << "Invalid image size: " << setting.width << "x" << setting.height << std::endl;
+		return -1;
+	}
+
+	if (scenes.empty())
+		scenes.assign(std::begin(g_defaultScenes), std::end(g_defaultScenes));
+
+	//The human-readable table goes to stderr if the json is written to stdout
+	std::ostream &log = (jsonPath == "-") ? std::cerr : std::cout;
+	char line[256];
+	snprintf(line, sizeof(line), "%-20s %-10s %10s %10s %10s %10s %10s %14s %14s",
+		"scene", "pipeline", "load(ms)", "mean(ms)", "p50(ms)", "p95(ms)", "p99(ms)", "Mtriangles/s", "Mfragments/s");
+	log << line << std::endl;
+
+	std::vector<SceneResult> results;
+	for (const auto &scene : scenes)
+	{
+		SceneResult result;
+		if (!benchScene(scene, setting, result))
+			continue;
+		snprintf(line, sizeof(line), "%-20s %-10s %10.2f %10.2f %10.2f %10.2f %10.2f %14.3f %14.3f",
+			result.name.c_str(), result.pipeline.c_str(), result.loadTime, result.mean,
+			result.p50, result.p95, result.p99, result.trianglesPerSec * 1e-6, result.fragmentsPerSec * 1e-6);
+		log << line << std::endl;
+		results.push_back(result);
+	}
+
+	if (!jsonPath.empty())
+	{
+		const std::string json = toJson(setting, results);
+		if (jsonPath == "-")
+		{
+			std::cout << json;
+		}
+		else
+		{
+			std::ofstream file(jsonPath);
+			if (!file.is_open())
+			{
+				std::cerr << "Failed to open file: " << jsonPath << std::endl;
+				return -1;
+			}
+			file << json;
+		}
+	}
+
+	return results.size() == scenes.size() ? 0 : -1;
+}